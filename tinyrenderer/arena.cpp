@@ -0,0 +1,194 @@
+//
+//  arena.cpp
+//  tinyrenderer
+//
+//  Created by skychx on 2021/4/3.
+//
+
+#include <atomic>
+#include <cstdlib>
+#include <cassert>
+#include <algorithm>
+#include "arena.h"
+
+FrameArena::FrameArena(const size_t block_bytes) : blocks_(), block_(0), offset_(0), block_bytes_(block_bytes) {
+}
+
+FrameArena::~FrameArena() {
+    for (size_t i = 0; i < blocks_.size(); i++) delete [] blocks_[i].data;
+}
+
+void *FrameArena::allocate(const size_t bytes, const size_t align) {
+    assert(align && !(align & (align - 1)));
+    if (block_ < blocks_.size()) {
+        size_t start = (offset_ + align - 1) & ~(align - 1);
+        if (start + bytes <= blocks_[block_].size) {
+            offset_ = start + bytes;
+            return blocks_[block_].data + start;
+        }
+        // 当前块放不下，换到下一块（放不下的块跳过），都不够时新分配一块
+        block_++;
+    }
+    while (block_ < blocks_.size() && blocks_[block_].size < bytes + align) block_++;
+    if (block_ == blocks_.size()) {
+        Block b;
+        b.size = std::max(block_bytes_, bytes + align);
+        b.data = new unsigned char[b.size];
+        blocks_.push_back(b);
+    }
+    // new[] 返回的地址至少按 alignof(max_align_t) 对齐，大于它的对齐靠 bytes + align 的余量
+    size_t start = ((size_t)blocks_[block_].data + align - 1) / align * align - (size_t)blocks_[block_].data;
+    offset_ = start + bytes;
+    return blocks_[block_].data + start;
+}
+
+FrameArena::Marker FrameArena::mark() const {
+    Marker m = {block_, offset_};
+    return m;
+}
+
+void FrameArena::release(const Marker &m) {
+    block_ = m.block;
+    offset_ = m.offset;
+}
+
+void FrameArena::reset() {
+    block_ = 0;
+    offset_ = 0;
+}
+
+size_t FrameArena::used() const {
+    size_t n = offset_;
+    for (size_t i = 0; i < block_ && i < blocks_.size(); i++) n += blocks_[i].size;
+    return n;
+}
+
+size_t FrameArena::capacity() const {
+    size_t n = 0;
+    for (size_t i = 0; i < blocks_.size(); i++) n += blocks_[i].size;
+    return n;
+}
+
+FrameArena &frame_arena() {
+    static thread_local FrameArena arena;
+    return arena;
+}
+
+RenderTargetPool::~RenderTargetPool() {
+    for (size_t i = 0; i < targets_.size(); i++) delete targets_[i].image;
+}
+
+TGAImage &RenderTargetPool::acquire(const int width, const int height, const int bpp) {
+    for (size_t i = 0; i < targets_.size(); i++) {
+        Target &t = targets_[i];
+        if (!t.used && t.image->get_width() == width && t.image->get_height() == height && t.image->get_bytespp() == bpp) {
+            t.used = true;
+            t.image->clear();
+            return *t.image;
+        }
+    }
+    Target t = {new TGAImage(width, height, bpp), true};
+    targets_.push_back(t);
+    return *t.image;
+}
+
+void RenderTargetPool::release(const TGAImage &image) {
+    for (size_t i = 0; i < targets_.size(); i++) {
+        if (targets_[i].image == &image) {
+            targets_[i].used = false;
+            return;
+        }
+    }
+    assert(!"image doesn't belong to this pool");
+}
+
+#ifdef COUNT_HEAP_ALLOCATIONS
+// 只在 --bench 用的构建里替换全局的 operator new/delete，只多了一次计数；普通构建用系统的分配器
+static std::atomic<unsigned long> allocations(0);
+
+bool heap_allocations(unsigned long &count) {
+    count = allocations.load(std::memory_order_relaxed);
+    return true;
+}
+
+void *operator new(size_t n) {
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    void *p = std::malloc(n ? n : 1);
+    if (!p) throw std::bad_alloc();
+    return p;
+}
+
+void *operator new[](size_t n) {
+    return operator new(n);
+}
+
+void *operator new(size_t n, const std::nothrow_t &) noexcept {
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    return std::malloc(n ? n : 1);
+}
+
+void *operator new[](size_t n, const std::nothrow_t &tag) noexcept {
+    return operator new(n, tag);
+}
+
+void operator delete(void *p) noexcept {
+    std::free(p);
+}
+
+void operator delete[](void *p) noexcept {
+    std::free(p);
+}
+
+void operator delete(void *p, size_t) noexcept {
+    std::free(p);
+}
+
+void operator delete[](void *p, size_t) noexcept {
+    std::free(p);
+}
+
+#ifdef __cpp_aligned_new
+// C++17 以后对齐要求超过 __STDCPP_DEFAULT_NEW_ALIGNMENT__ 的类型走这一组，也要计数
+void *operator new(size_t n, std::align_val_t align) {
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    void *p = NULL;
+    if (posix_memalign(&p, std::max((size_t)align, sizeof(void *)), n ? n : 1) != 0) throw std::bad_alloc();
+    return p;
+}
+
+void *operator new[](size_t n, std::align_val_t align) {
+    return operator new(n, align);
+}
+
+void *operator new(size_t n, std::align_val_t align, const std::nothrow_t &) noexcept {
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    void *p = NULL;
+    return posix_memalign(&p, std::max((size_t)align, sizeof(void *)), n ? n : 1) == 0 ? p : NULL;
+}
+
+void *operator new[](size_t n, std::align_val_t align, const std::nothrow_t &tag) noexcept {
+    return operator new(n, align, tag);
+}
+
+void operator delete(void *p, std::align_val_t) noexcept {
+    std::free(p);
+}
+
+void operator delete[](void *p, std::align_val_t) noexcept {
+    std::free(p);
+}
+
+void operator delete(void *p, size_t, std::align_val_t) noexcept {
+    std::free(p);
+}
+
+void operator delete[](void *p, size_t, std::align_val_t) noexcept {
+    std::free(p);
+}
+#endif
+#else
+bool heap_allocations(unsigned long &count) {
+    count = 0;
+    return false;
+}
+#endif
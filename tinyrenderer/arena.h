@@ -0,0 +1,94 @@
+//
+//  arena.h
+//  tinyrenderer
+//
+//  Created by skychx on 2021/4/3.
+//
+
+#ifndef __ARENA_H__
+#define __ARENA_H__
+
+#include <cstddef>
+#include <new>
+#include <type_traits>
+#include <vector>
+#include "tgaimage.h"
+
+// 帧内存：一帧里的临时数据（三角形顺序、变换后的顶点、流水线的批次……）都从这里按顺序切，
+// 释放就是把指针拨回去，O(1)；内存块分配以后一直保留，稳定状态下不再调用 new
+// 每个线程一个（frame_arena()），不需要加锁
+class FrameArena {
+public:
+    struct Marker {
+        size_t block, offset;
+    };
+
+    FrameArena(const size_t block_bytes=1 << 20);
+    ~FrameArena();
+    void *allocate(const size_t bytes, const size_t align=16);
+    template <typename T> T *allocate(const size_t n) {
+        return static_cast<T *>(allocate(n * sizeof(T), alignof(T)));
+    }
+    // 分配并默认构造 n 个对象，不会调用析构函数，所以只能用于平凡析构的类型
+    template <typename T> T *make(const size_t n) {
+        static_assert(std::is_trivially_destructible<T>::value, "arena objects are never destroyed");
+        T *p = allocate<T>(n);
+        for (size_t i = 0; i < n; i++) new (p + i) T();
+        return p;
+    }
+    Marker mark() const;
+    void release(const Marker &m); // 回到 mark() 时的位置，之后分配的内存全部作废
+    void reset();                  // 帧结束时调用，全部作废
+    size_t used() const;
+    size_t capacity() const;
+
+private:
+    struct Block {
+        unsigned char *data;
+        size_t size;
+    };
+    std::vector<Block> blocks_;
+    size_t block_, offset_;
+    size_t block_bytes_;
+
+    FrameArena(const FrameArena &);
+    FrameArena &operator =(const FrameArena &);
+};
+
+FrameArena &frame_arena(); // 当前线程的帧内存
+
+// 作用域内从帧内存分配的东西在离开作用域时全部释放，可以嵌套
+class ArenaScope {
+public:
+    ArenaScope(FrameArena &arena=frame_arena()) : arena_(arena), marker_(arena.mark()) {}
+    ~ArenaScope() { arena_.release(marker_); }
+
+private:
+    FrameArena &arena_;
+    FrameArena::Marker marker_;
+};
+
+// 跨帧复用的 render target：按尺寸和格式找一张空闲的图片，用完归还，尺寸不变时不会重新分配
+class RenderTargetPool {
+public:
+    RenderTargetPool() : targets_() {}
+    ~RenderTargetPool();
+    TGAImage &acquire(const int width, const int height, const int bpp); // 返回清零的图片
+    void release(const TGAImage &image);
+
+private:
+    struct Target {
+        TGAImage *image;
+        bool used;
+    };
+    std::vector<Target> targets_;
+
+    RenderTargetPool(const RenderTargetPool &);
+    RenderTargetPool &operator =(const RenderTargetPool &);
+};
+
+// 程序启动以来全局 operator new 的调用次数，用来验证稳定状态下的渲染没有堆分配
+// 计数要替换整个程序的 operator new/delete，只有定义了 COUNT_HEAP_ALLOCATIONS 的构建才这样做，否则返回 false
+bool heap_allocations(unsigned long &count);
+
+#endif //__ARENA_H__
@@ -0,0 +1,118 @@
+//
+//  fastmath.cpp
+//  tinyrenderer
+//
+//  Created by skychx on 2021/3/20.
+//
+
+#include <iostream>
+#include <cmath>
+#include <vector>
+#include "fastmath.h"
+
+// 最后多一项，x = 1 时插值也不会越界
+static float spec_table_data[SPEC_TABLE_SIZE + 2];
+
+static const float *build_spec_table() {
+    // log2(0) 是 -inf，用一个足够小的数代替，fast_exp2 会把结果截到 2^-126
+    spec_table_data[0] = -1000.f;
+    for (int i = 1; i <= SPEC_TABLE_SIZE + 1; i++) {
+        spec_table_data[i] = std::log2((float)i / SPEC_TABLE_SIZE);
+    }
+    return spec_table_data;
+}
+
+const float *spec_log2_table = build_spec_table();
+
+void fast_rsqrt(const float *x, float *out, const int n) {
+    for (int i = 0; i < n; i++) out[i] = fast_rsqrt(x[i]);
+}
+
+void fast_normalize(float *x, float *y, float *z, const int n) {
+    for (int i = 0; i < n; i++) {
+        float k = fast_rsqrt(x[i] * x[i] + y[i] * y[i] + z[i] * z[i]);
+        x[i] *= k;
+        y[i] *= k;
+        z[i] *= k;
+    }
+}
+
+void fast_exp2(const float *x, float *out, const int n) {
+    for (int i = 0; i < n; i++) out[i] = fast_exp2(x[i]);
+}
+
+void fast_log2(const float *x, float *out, const int n) {
+    for (int i = 0; i < n; i++) out[i] = fast_log2(x[i]);
+}
+
+void fast_pow(const float *x, const float *y, float *out, const int n) {
+    for (int i = 0; i < n; i++) out[i] = fast_pow(x[i], y[i]);
+}
+
+void spec_pow(const float *x, const float *e, float *out, const int n) {
+    for (int i = 0; i < n; i++) out[i] = spec_pow(x[i], e[i]);
+}
+
+/////////////////////////////////////////////////////////////////////////////////
+// 精度检查
+
+static bool report(const char *name, const double err, const double bound) {
+    std::cerr << name << " max error " << err << " (bound " << bound << ")" << (err <= bound ? "" : " FAILED") << std::endl;
+    return err <= bound;
+}
+
+bool fastmath_accuracy() {
+    const int N = 1 << 16;
+    std::vector<float> x(N), y(N), out(N);
+    bool ok = true;
+
+    // rsqrt：相对误差，x 覆盖很大的范围
+    for (int i = 0; i < N; i++) x[i] = std::pow(2.f, -20.f + 40.f * i / N);
+    fast_rsqrt(x.data(), out.data(), N);
+    double err = 0;
+    for (int i = 0; i < N; i++) err = std::max(err, std::abs(out[i] * std::sqrt((double)x[i]) - 1.));
+    ok &= report("rsqrt", err, 5e-6);
+
+    // exp2：相对误差
+    for (int i = 0; i < N; i++) x[i] = -30.f + 60.f * i / N;
+    fast_exp2(x.data(), out.data(), N);
+    err = 0;
+    for (int i = 0; i < N; i++) err = std::max(err, std::abs(out[i] / std::exp2((double)x[i]) - 1.));
+    ok &= report("exp2", err, 5e-6);
+
+    // log2：绝对误差
+    for (int i = 0; i < N; i++) x[i] = std::pow(2.f, -20.f + 40.f * i / N);
+    fast_log2(x.data(), out.data(), N);
+    err = 0;
+    for (int i = 0; i < N; i++) err = std::max(err, std::abs(out[i] - std::log2((double)x[i])));
+    ok &= report("log2", err, 2e-6);
+
+    // pow 和镜面查表：着色器里的用法，x ∈ [0, 1]，指数 [1, 64]，结果 [0, 1] 里比较绝对误差
+    for (int i = 0; i < N; i++) {
+        x[i] = (float)(i % 1024) / 1023.f;
+        y[i] = 1.f + 63.f * (i / 1024) / 63.f;
+    }
+    fast_pow(x.data(), y.data(), out.data(), N);
+    err = 0;
+    for (int i = 0; i < N; i++) err = std::max(err, std::abs(out[i] - std::pow((double)x[i], (double)y[i])));
+    ok &= report("pow", err, 1e-4);
+
+    spec_pow(x.data(), y.data(), out.data(), N);
+    err = 0;
+    for (int i = 0; i < N; i++) err = std::max(err, std::abs(out[i] - std::pow((double)x[i], (double)y[i])));
+    ok &= report("spec_pow", err, 1e-3);
+
+    // normalize：结果长度和 1 的误差
+    std::vector<float> z(N);
+    for (int i = 0; i < N; i++) {
+        x[i] = std::sin(i * .1f) * (1 + i % 100);
+        y[i] = std::cos(i * .3f) * (1 + i % 100);
+        z[i] = std::sin(i * .7f) + 1.5f;
+    }
+    fast_normalize(x.data(), y.data(), z.data(), N);
+    err = 0;
+    for (int i = 0; i < N; i++) err = std::max(err, std::abs(std::sqrt((double)x[i] * x[i] + (double)y[i] * y[i] + (double)z[i] * z[i]) - 1.));
+    ok &= report("normalize", err, 1e-5);
+
+    return ok;
+}
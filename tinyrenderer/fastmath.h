@@ -0,0 +1,89 @@
+//
+//  fastmath.h
+//  tinyrenderer
+//
+//  Created by skychx on 2021/3/20.
+//
+
+#ifndef __FASTMATH_H__
+#define __FASTMATH_H__
+
+#include <cstring>
+#include <cstdint>
+#include <algorithm>
+#include "geometry.h"
+
+// 着色器热路径用的近似数学函数，误差有上界（见 fastmath_accuracy）
+// 标量版本全部是内联、无分支的，放在循环里编译器可以直接向量化；数组版本按 SoA 布局批量计算
+
+static inline float bits_to_float(const uint32_t i) {
+    float f;
+    memcpy(&f, &i, sizeof(f));
+    return f;
+}
+
+static inline uint32_t float_to_bits(const float f) {
+    uint32_t i;
+    memcpy(&i, &f, sizeof(i));
+    return i;
+}
+
+// 1/sqrt(x)：位运算给出初值，再做两次牛顿迭代，相对误差 < 5e-6
+static inline float fast_rsqrt(const float x) {
+    float y = bits_to_float(0x5f375a86 - (float_to_bits(x) >> 1));
+    y = y * (1.5f - .5f * x * y * y);
+    y = y * (1.5f - .5f * x * y * y);
+    return y;
+}
+
+static inline vec3 fast_normalize(const vec3 &v) {
+    return v * fast_rsqrt((float)(v * v));
+}
+
+// 2^x：拆成最近的整数 i 和 [-0.5, 0.5) 的小数 f，2^i 直接拼出浮点数的指数位，2^f 用 5 次多项式，相对误差 < 5e-6
+static inline float fast_exp2(float x) {
+    x = std::min(127.f, std::max(-126.f, x));
+    const int i = (int)(x + 127.5f) - 127; // x + 127.5 > 0，截断就是向下取整
+    const float f = x - i;
+    const float p = 1.f + f * (.69314718f + f * (.24022651f + f * (.05550411f + f * (.00961813f + f * .00133336f))));
+    return p * bits_to_float((uint32_t)(i + 127) << 23);
+}
+
+// log2(x)，x > 0：指数位给出整数部分，尾数 m ∈ [1, 2) 用 log2(m) = 2/ln2 * atanh((m-1)/(m+1)) 的级数，绝对误差 < 2e-6
+static inline float fast_log2(const float x) {
+    const uint32_t bits = float_to_bits(x);
+    const float e = (float)((int)((bits >> 23) & 255) - 127);
+    const float m = bits_to_float((bits & 0x7fffff) | 0x3f800000);
+    const float t = (m - 1.f) / (m + 1.f);
+    const float t2 = t * t;
+    return e + t * (2.88539008f + t2 * (.96179669f + t2 * (.57707801f + t2 * (.41219858f + t2 * .32059889f))));
+}
+
+// x^y，x >= 0
+static inline float fast_pow(const float x, const float y) {
+    return fast_exp2(y * fast_log2(x));
+}
+
+// 查表的镜面高光 x^e，x ∈ [0, 1]：log2(x) 按 1/1024 的间隔打表并线性插值，再用 fast_exp2
+#define SPEC_TABLE_SIZE 1024
+extern const float *spec_log2_table; // SPEC_TABLE_SIZE + 2 个值
+static inline float spec_pow(float x, const float e) {
+    x = std::min(1.f, std::max(0.f, x)) * SPEC_TABLE_SIZE;
+    const int i = (int)x;
+    const float f = x - i;
+    const float l = spec_log2_table[i] + (spec_log2_table[i + 1] - spec_log2_table[i]) * f;
+    return fast_exp2(e * l);
+}
+
+// 数组版本，n 个元素
+void fast_rsqrt(const float *x, float *out, const int n);
+void fast_normalize(float *x, float *y, float *z, const int n); // 原地归一化 n 个向量
+void fast_exp2(const float *x, float *out, const int n);
+void fast_log2(const float *x, float *out, const int n);
+void fast_pow(const float *x, const float *y, float *out, const int n);
+void spec_pow(const float *x, const float *e, float *out, const int n);
+
+// 和 std 版本比较，打印每个函数的最大误差，超出上界时返回 false
+bool fastmath_accuracy();
+
+#endif //__FASTMATH_H__
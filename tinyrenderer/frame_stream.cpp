@@ -0,0 +1,165 @@
+//
+//  frame_stream.cpp
+//  tinyrenderer
+//
+//  Created by skychx on 2021/3/28.
+//
+
+#include <iostream>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include "frame_stream.h"
+
+FrameStream::FrameStream() : fd_(-1), owns_fd_(false), format_(PPM), width_(0), height_(0), frames_(0), buffer_(), header_bytes_(0) {
+}
+
+FrameStream::~FrameStream() {
+    close();
+}
+
+bool FrameStream::parse_format(const char *name, Format &format) {
+    if      (!strcmp(name, "ppm"))  format = PPM;
+    else if (!strcmp(name, "y4m"))  format = Y4M;
+    else if (!strcmp(name, "bgra")) format = BGRA;
+    else return false;
+    return true;
+}
+
+bool FrameStream::open(const char *path, const Format format, const int width, const int height, const int fps) {
+    close();
+    if (width <= 0 || height <= 0 || fps <= 0) {
+        std::cerr << "bad frame stream size " << width << "x" << height << "@" << fps << std::endl;
+        return false;
+    }
+    if (!strcmp(path, "-")) {
+        fd_ = 1;
+        owns_fd_ = false;
+    } else {
+        fd_ = ::open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        owns_fd_ = true;
+        if (fd_ < 0) {
+            std::cerr << "can't open file " << path << std::endl;
+            return false;
+        }
+    }
+    format_ = format;
+    width_ = width;
+    height_ = height;
+    frames_ = 0;
+
+    char header[64];
+    size_t pixel_bytes = 0;
+    header_bytes_ = 0;
+    if (format == PPM) {
+        header_bytes_ = std::snprintf(header, sizeof(header), "P6\n%d %d\n255\n", width, height);
+        pixel_bytes = (size_t)width * height * 3;
+    } else if (format == Y4M) {
+        // 流头只写一次，之后每帧一个 FRAME 标记
+        char stream_header[128];
+        int n = std::snprintf(stream_header, sizeof(stream_header), "YUV4MPEG2 W%d H%d F%d:1 Ip A1:1 C420jpeg\n", width, height, fps);
+        if (!write_all((const unsigned char *)stream_header, n)) {
+            close();
+            return false;
+        }
+        header_bytes_ = std::snprintf(header, sizeof(header), "FRAME\n");
+        const size_t chroma = (size_t)((width + 1) / 2) * ((height + 1) / 2);
+        pixel_bytes = (size_t)width * height + chroma * 2;
+    } else {
+        std::cerr << "raw bgra " << width << "x" << height << " " << fps << " fps" << std::endl;
+        pixel_bytes = (size_t)width * height * 4;
+    }
+    buffer_.resize(header_bytes_ + pixel_bytes);
+    memcpy(buffer_.data(), header, header_bytes_);
+    return true;
+}
+
+void FrameStream::close() {
+    if (owns_fd_ && fd_ >= 0) ::close(fd_);
+    fd_ = -1;
+    owns_fd_ = false;
+}
+
+long FrameStream::frames() const {
+    return frames_;
+}
+
+bool FrameStream::write(const TGAImage &frame) {
+    if (fd_ < 0) return false;
+    if (frame.get_width() != width_ || frame.get_height() != height_) {
+        std::cerr << "frame size " << frame.get_width() << "x" << frame.get_height() << " doesn't match the stream " << width_ << "x" << height_ << std::endl;
+        return false;
+    }
+    unsigned char *out = buffer_.data() + header_bytes_;
+    if (format_ == Y4M) {
+        convert_yuv(frame, out);
+    } else {
+        convert_rgb(frame, out, format_ == PPM ? 3 : 4);
+    }
+    if (!write_all(buffer_.data(), buffer_.size())) return false;
+    frames_++;
+    return true;
+}
+
+bool FrameStream::write_all(const unsigned char *p, size_t n) {
+    while (n > 0) {
+        ssize_t w = ::write(fd_, p, n);
+        if (w <= 0) {
+            std::cerr << "can't write frame " << frames_ << std::endl;
+            return false;
+        }
+        p += w;
+        n -= w;
+    }
+    return true;
+}
+
+// channels 为 3 时输出 RGB（PPM），为 4 时输出 BGRA
+void FrameStream::convert_rgb(const TGAImage &frame, unsigned char *out, const int channels) {
+    const int bpp = frame.get_bytespp();
+    const unsigned char *data = frame.buffer();
+    for (int y = height_ - 1; y >= 0; y--) {
+        const unsigned char *p = data + (size_t)y * width_ * bpp;
+        for (int x = 0; x < width_; x++, p += bpp, out += channels) {
+            unsigned char b = p[0], g = bpp >= 3 ? p[1] : p[0], r = bpp >= 3 ? p[2] : p[0];
+            if (channels == 3) {
+                out[0] = r; out[1] = g; out[2] = b;
+            } else {
+                out[0] = b; out[1] = g; out[2] = r; out[3] = bpp == 4 ? p[3] : 255;
+            }
+        }
+    }
+}
+
+// BT.601 有限范围的整数近似；色度取 2x2 像素的平均，奇数尺寸时最后一列/行只取存在的像素
+void FrameStream::convert_yuv(const TGAImage &frame, unsigned char *out) {
+    const int bpp = frame.get_bytespp();
+    const unsigned char *data = frame.buffer();
+    const int cw = (width_ + 1) / 2, ch = (height_ + 1) / 2;
+    unsigned char *plane_y = out;
+    unsigned char *plane_u = out + (size_t)width_ * height_;
+    unsigned char *plane_v = plane_u + (size_t)cw * ch;
+    for (int cy = 0; cy < ch; cy++) {
+        for (int cx = 0; cx < cw; cx++) {
+            int sum_u = 0, sum_v = 0, n = 0;
+            for (int j = 0; j < 2; j++) {
+                const int oy = cy * 2 + j; // 输出的行，从上往下
+                if (oy >= height_) break;
+                const unsigned char *row = data + (size_t)(height_ - 1 - oy) * width_ * bpp;
+                for (int i = 0; i < 2; i++) {
+                    const int ox = cx * 2 + i;
+                    if (ox >= width_) break;
+                    const unsigned char *p = row + ox * bpp;
+                    const int b = p[0], g = bpp >= 3 ? p[1] : p[0], r = bpp >= 3 ? p[2] : p[0];
+                    plane_y[(size_t)oy * width_ + ox] = (unsigned char)(((66 * r + 129 * g + 25 * b + 128) >> 8) + 16);
+                    sum_u += ((-38 * r - 74 * g + 112 * b + 128) >> 8) + 128;
+                    sum_v += ((112 * r - 94 * g - 18 * b + 128) >> 8) + 128;
+                    n++;
+                }
+            }
+            plane_u[(size_t)cy * cw + cx] = (unsigned char)((sum_u + n / 2) / n);
+            plane_v[(size_t)cy * cw + cx] = (unsigned char)((sum_v + n / 2) / n);
+        }
+    }
+}
@@ -0,0 +1,49 @@
+//
+//  frame_stream.h
+//  tinyrenderer
+//
+//  Created by skychx on 2021/3/28.
+//
+
+#ifndef __FRAME_STREAM_H__
+#define __FRAME_STREAM_H__
+
+#include <vector>
+#include "tgaimage.h"
+
+// 把连续的帧以未压缩的格式写到 stdout、文件或者命名管道里，可以直接喂给视频编码器，不用落地一堆 TGA
+//   PPM:  每帧一个 P6 头加 RGB 数据，ffmpeg -f image2pipe -c:v ppm -i -
+//   Y4M:  YUV4MPEG2 流，4:2:0 采样（BT.601），ffmpeg -i - 或者 x264 --demuxer y4m -
+//   BGRA: 不带帧头的 BGRA 原始数据，尺寸和帧率在 open 时打印到 stderr，ffmpeg -f rawvideo -pix_fmt bgra -s WxH -i -
+// 渲染出来的图原点在左下角，写出时直接从最后一行往前写，省掉 flip_vertically
+// 输出缓冲在 open 时按帧大小分配一次，之后每帧只做格式转换和一次 write
+class FrameStream {
+public:
+    enum Format {
+        PPM, Y4M, BGRA
+    };
+
+    FrameStream();
+    ~FrameStream();
+    // path 为 "-" 时写到 stdout；打开命名管道时会阻塞到有读者为止
+    bool open(const char *path, const Format format, const int width, const int height, const int fps=25);
+    // frame 的尺寸必须和 open 时一致，GRAYSCALE/RGB/RGBA 都可以
+    bool write(const TGAImage &frame);
+    void close();
+    long frames() const;
+    static bool parse_format(const char *name, Format &format);
+
+private:
+    int fd_;
+    bool owns_fd_;
+    Format format_;
+    int width_, height_;
+    long frames_;
+    std::vector<unsigned char> buffer_; // 一帧的输出：帧头 + 像素数据
+    size_t header_bytes_;               // buffer_ 开头的帧头长度
+    bool write_all(const unsigned char *p, size_t n);
+    void convert_rgb(const TGAImage &frame, unsigned char *out, const int channels);
+    void convert_yuv(const TGAImage &frame, unsigned char *out);
+};
+
+#endif //__FRAME_STREAM_H__
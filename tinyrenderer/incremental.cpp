@@ -0,0 +1,266 @@
+//
+//  incremental.cpp
+//  tinyrenderer
+//
+//  Created by skychx on 2021/3/30.
+//
+
+#include <cstring>
+#include <algorithm>
+#include <limits>
+#include "incremental.h"
+#include "render.h"
+
+IncrementalRenderer::IncrementalRenderer(const int width, const int height) :
+    width_(width), height_(height),
+    tiles_x_((width + TRACK_TILE - 1) / TRACK_TILE), tiles_y_((height + TRACK_TILE - 1) / TRACK_TILE),
+    frame_(width, height, TGAImage::RGB), zbuffer_(width, height, TGAImage::GRAYSCALE), shadow_(0), gbuffer_(), objects_(),
+    light_(1, 1, 1), eye_(1, 1, 3), center_(0, 0, 0), up_(0, 1, 0), light_changed_(true), full_(true), stats_() {
+    shadowbuffer_[0] = TGAImage(width, height, TGAImage::GRAYSCALE);
+    shadowbuffer_[1] = TGAImage(width, height, TGAImage::GRAYSCALE);
+    gbuffer_.resize(width, height);
+    light_.normalize();
+}
+
+int IncrementalRenderer::add(Model *model, const mat<4,4> &transform, const TGAColor tint) {
+    Object obj;
+    obj.model = model;
+    obj.transform = transform;
+    obj.tint = tint;
+    obj.tiles.assign(tiles_x_ * tiles_y_, 0);
+    obj.moved = true;
+    objects_.push_back(obj);
+    return (int)objects_.size() - 1;
+}
+
+void IncrementalRenderer::move(const int id, const mat<4,4> &transform) {
+    objects_[id].transform = transform;
+    objects_[id].moved = true;
+}
+
+void IncrementalRenderer::light(const vec3 dir) {
+    light_ = dir;
+    light_.normalize();
+    light_changed_ = true;
+}
+
+void IncrementalRenderer::camera(const vec3 eye, const vec3 center, const vec3 up) {
+    eye_ = eye;
+    center_ = center;
+    up_ = up;
+    full_ = true;
+}
+
+void IncrementalRenderer::invalidate() {
+    full_ = true;
+}
+
+const IncrementalStats &IncrementalRenderer::stats() const {
+    return stats_;
+}
+
+void IncrementalRenderer::setup_camera() {
+    lookat(eye_, center_, up_);
+    projection(-1.f / (eye_ - center_).norm());
+    viewport(width_ / 8, height_ / 8, width_ * 3/4, height_ * 3/4);
+}
+
+// 光源视角的深度图画到另一块 shadow buffer 上，返回世界坐标到 shadow buffer 屏幕坐标的矩阵
+mat<4,4> IncrementalRenderer::draw_shadow() {
+    shadow_ ^= 1;
+    TGAImage &shadowbuffer = shadowbuffer_[shadow_];
+    shadowbuffer.clear();
+    lookat(light_, center_, up_);
+    projection(0);
+    viewport(width_ / 8, height_ / 8, width_ * 3/4, height_ * 3/4);
+    const mat<4,4> M = Viewport * Projection * ModelView;
+    for (int i = 0; i < (int)objects_.size(); i++) {
+        draw_depth(*objects_[i].model, M * objects_[i].transform, shadowbuffer);
+    }
+    return M;
+}
+
+// 物体包围球的外接立方体投影到屏幕上的 tile 范围 rect = {tx0, ty0, tx1, ty1}，完全在屏幕外时返回 false
+// 立方体有角在相机后面时保守地取整个屏幕
+bool IncrementalRenderer::screen_tiles(const Object &obj, const mat<4,4> &view, int *rect) {
+    const mat<4,4> M = Viewport * Projection * view * obj.transform;
+    const vec3 c = obj.model->bound_center();
+    const double r = obj.model->bound_radius();
+    double xmin = width_, ymin = height_, xmax = -1, ymax = -1;
+    for (int k = 0; k < 8; k++) {
+        vec3 corner(c.x + (k & 1 ? r : -r), c.y + (k & 2 ? r : -r), c.z + (k & 4 ? r : -r));
+        vec4 p = M * embed<4>(corner);
+        if (p[3] <= 0) {
+            xmin = ymin = 0;
+            xmax = width_ - 1;
+            ymax = height_ - 1;
+            break;
+        }
+        xmin = std::min(xmin, p[0] / p[3]);
+        xmax = std::max(xmax, p[0] / p[3]);
+        ymin = std::min(ymin, p[1] / p[3]);
+        ymax = std::max(ymax, p[1] / p[3]);
+    }
+    // 多留一个像素，和 setup_triangle 的取整方式无关
+    const int x0 = std::max(0, (int)xmin - 1), x1 = std::min(width_ - 1, (int)xmax + 1);
+    const int y0 = std::max(0, (int)ymin - 1), y1 = std::min(height_ - 1, (int)ymax + 1);
+    if (x0 > x1 || y0 > y1) return false;
+    rect[0] = x0 / TRACK_TILE;
+    rect[1] = y0 / TRACK_TILE;
+    rect[2] = x1 / TRACK_TILE;
+    rect[3] = y1 / TRACK_TILE;
+    return true;
+}
+
+// 清掉 rect 里的 tile 并重画：画到过这些 tile 的物体和移动过的物体按添加顺序在 scissor 内重画，
+// 顺序和深度测试都和整帧绘制一样，所以结果也一样；tile 边长是 4 的倍数，粗粒度着色的块不会被 scissor 切开
+void IncrementalRenderer::redraw(const int *rect, GouraudShader &shader, const mat<4,4> &view, std::vector<unsigned char> &redrawn) {
+    const int x0 = rect[0] * TRACK_TILE, y0 = rect[1] * TRACK_TILE;
+    const int x1 = std::min(width_ - 1, (rect[2] + 1) * TRACK_TILE - 1);
+    const int y1 = std::min(height_ - 1, (rect[3] + 1) * TRACK_TILE - 1);
+    for (int y = y0; y <= y1; y++) {
+        memset(frame_.buffer() + (x0 + (size_t)y * width_) * 3, 0, (x1 - x0 + 1) * 3);
+        memset(zbuffer_.buffer() + x0 + (size_t)y * width_, 0, x1 - x0 + 1);
+    }
+    gbuffer_.clear(x0, y0, x1, y1);
+    for (int ty = rect[1]; ty <= rect[3]; ty++) {
+        for (int tx = rect[0]; tx <= rect[2]; tx++) {
+            if (!redrawn[tx + ty * tiles_x_]) stats_.redrawn_tiles++;
+            redrawn[tx + ty * tiles_x_] = 1;
+        }
+    }
+
+    scissor(x0, y0, x1 - x0 + 1, y1 - y0 + 1);
+    for (int i = 0; i < (int)objects_.size(); i++) {
+        Object &obj = objects_[i];
+        bool touches = obj.moved;
+        for (int ty = rect[1]; ty <= rect[3]; ty++) {
+            for (int tx = rect[0]; tx <= rect[2]; tx++) {
+                touches |= obj.tiles[tx + ty * tiles_x_] != 0;
+                obj.tiles[tx + ty * tiles_x_] = 0;
+            }
+        }
+        if (!touches) continue;
+
+        ModelView = view * obj.transform;
+        shader.model = obj.model;
+        shader.uniform_object = i;
+        shader.instance(obj.transform, obj.tint);
+        track_tiles(&obj.tiles);
+        draw_model(*obj.model, shader, frame_, zbuffer_);
+        track_tiles(NULL);
+    }
+    scissor(0, 0, 0, 0);
+    ModelView = view;
+}
+
+// 比较前后两帧的 shadow map，box = {xmin, ymin, xmax, ymax} 是变化的范围（shadow buffer 像素），没有变化返回 false
+bool IncrementalRenderer::shadow_changed(double *box) {
+    const unsigned char *a = shadowbuffer_[shadow_].buffer(), *b = shadowbuffer_[shadow_ ^ 1].buffer();
+    int xmin = width_, ymin = height_, xmax = -1, ymax = -1;
+    for (int y = 0; y < height_; y++) {
+        const unsigned char *ra = a + (size_t)y * width_, *rb = b + (size_t)y * width_;
+        if (!memcmp(ra, rb, width_)) continue;
+        ymin = std::min(ymin, y);
+        ymax = y;
+        for (int x = 0; x < width_; x++) {
+            if (ra[x] != rb[x]) {
+                xmin = std::min(xmin, x);
+                xmax = std::max(xmax, x);
+            }
+        }
+    }
+    if (xmax < 0) return false;
+    // shadow() 取四舍五入后的像素再做半径 1 的 PCF，放宽两个像素；图片外的查询会被夹到边上，碰到边时不设限
+    const double inf = std::numeric_limits<double>::max();
+    box[0] = xmin <= 1 ? -inf : xmin - 2;
+    box[1] = ymin <= 1 ? -inf : ymin - 2;
+    box[2] = xmax >= width_  - 2 ? inf : xmax + 2;
+    box[3] = ymax >= height_ - 2 ? inf : ymax + 2;
+    return true;
+}
+
+// 用 G-buffer 重新算没有被重画的像素的光照；box 不为 NULL 时只算阴影查询落在 box 里的像素
+void IncrementalRenderer::relight(GouraudShader &shader, const std::vector<unsigned char> &redrawn, const double *box) {
+    const vec3 l = shader.light_vector();
+
+    for (int y = 0; y < height_; y++) {
+        for (int x = 0; x < width_; x++) {
+            if (redrawn[x / TRACK_TILE + (y / TRACK_TILE) * tiles_x_]) continue;
+            const size_t idx = x + (size_t)y * width_;
+            const int obj = gbuffer_.object[idx];
+            if (obj < 0) continue;
+            const Surface &s = gbuffer_.surfaces[idx];
+            if (box) {
+                vec4 p = shader.uniform_Mshadow * embed<4>(s.pos);
+                const double sx = p[0] / p[3], sy = p[1] / p[3];
+                if (sx < box[0] || sx > box[2] || sy < box[1] || sy > box[3]) continue;
+            }
+            frame_.set(x, y, shader.lighting(s, l));
+            stats_.relit_pixels++;
+        }
+    }
+}
+
+const TGAImage &IncrementalRenderer::render() {
+    stats_ = IncrementalStats();
+    stats_.tiles = tiles_x_ * tiles_y_;
+    bool moved = false;
+    for (int i = 0; i < (int)objects_.size(); i++) moved |= objects_[i].moved;
+    if (!full_ && !moved && !light_changed_) {
+        return frame_;
+    }
+
+    // 不管是光源变了还是物体动了，阴影都要重新算
+    const mat<4,4> M_shadow = draw_shadow();
+    stats_.shadow_pass = true;
+    setup_camera();
+    const mat<4,4> view = ModelView;
+
+    GouraudShader shader(NULL, light_);
+    shader.shadowbuffer = &shadowbuffer_[shadow_];
+    shader.uniform_Mshadow = M_shadow * (Viewport * Projection * view).invert();
+    shader.gbuffer = &gbuffer_;
+
+    std::vector<unsigned char> redrawn(tiles_x_ * tiles_y_, 0);
+    if (full_) {
+        const int rect[4] = {0, 0, tiles_x_ - 1, tiles_y_ - 1};
+        for (int i = 0; i < (int)objects_.size(); i++) objects_[i].moved = true;
+        redraw(rect, shader, view, redrawn);
+    } else {
+        // 每个移动过的物体：旧位置的 tile 和新位置的包围盒合起来重画
+        for (int i = 0; i < (int)objects_.size(); i++) {
+            Object &obj = objects_[i];
+            if (!obj.moved) continue;
+            int rect[4] = {tiles_x_, tiles_y_, -1, -1};
+            for (int ty = 0; ty < tiles_y_; ty++) {
+                for (int tx = 0; tx < tiles_x_; tx++) {
+                    if (!obj.tiles[tx + ty * tiles_x_]) continue;
+                    rect[0] = std::min(rect[0], tx);
+                    rect[1] = std::min(rect[1], ty);
+                    rect[2] = std::max(rect[2], tx);
+                    rect[3] = std::max(rect[3], ty);
+                }
+            }
+            int now[4];
+            if (screen_tiles(obj, view, now)) {
+                rect[0] = std::min(rect[0], now[0]);
+                rect[1] = std::min(rect[1], now[1]);
+                rect[2] = std::max(rect[2], now[2]);
+                rect[3] = std::max(rect[3], now[3]);
+            }
+            if (rect[2] >= 0) redraw(rect, shader, view, redrawn);
+            obj.moved = false;
+        }
+        double box[4];
+        if (light_changed_) {
+            relight(shader, redrawn, NULL);
+        } else if (shadow_changed(box)) {
+            relight(shader, redrawn, box);
+        }
+    }
+    for (int i = 0; i < (int)objects_.size(); i++) objects_[i].moved = false;
+    full_ = false;
+    light_changed_ = false;
+    return frame_;
+}
@@ -0,0 +1,68 @@
+//
+//  incremental.h
+//  tinyrenderer
+//
+//  Created by skychx on 2021/3/30.
+//
+
+#ifndef __INCREMENTAL_H__
+#define __INCREMENTAL_H__
+
+#include <vector>
+#include "model.h"
+#include "shader.h"
+
+struct IncrementalStats {
+    int tiles;                  // 屏幕上 TRACK_TILE x TRACK_TILE 的 tile 数
+    int redrawn_tiles;          // 重新光栅化的 tile 数
+    unsigned long relit_pixels; // 只用 G-buffer 重新算光照的像素数
+    bool shadow_pass;           // 是否重画了 shadow map
+};
+
+// 增量渲染：帧与帧之间保留 framebuffer、zbuffer 和 G-buffer，并记住每个物体上一帧画到了哪些 tile
+//   只改光源：重画 shadow map（只写深度），再用 G-buffer 对每个像素重新算一次光照，不再光栅化
+//   移动物体：只清掉并重画它旧位置和新位置覆盖的 tile（用 scissor 裁剪），其它物体只在这些 tile 里重画；
+//            阴影可能投到别处，shadow map 变化范围内的像素再用 G-buffer 重新算光照
+//   改相机：整帧重画
+// 结果和每帧从头完整渲染完全一致
+class IncrementalRenderer {
+public:
+    IncrementalRenderer(const int width, const int height);
+    // 返回物体编号；model 由调用者持有
+    int add(Model *model, const mat<4,4> &transform, const TGAColor tint=TGAColor(255, 255, 255));
+    void move(const int id, const mat<4,4> &transform);
+    void light(const vec3 dir);
+    void camera(const vec3 eye, const vec3 center, const vec3 up);
+    void invalidate(); // 下一次 render() 整帧重画
+    // 把变化过的部分画到 frame 上，返回的图片原点在左下角（和 draw_model 一样），下次 render() 之前一直有效
+    const TGAImage &render();
+    const IncrementalStats &stats() const;
+
+private:
+    struct Object {
+        Model *model;
+        mat<4,4> transform;
+        TGAColor tint;
+        std::vector<unsigned char> tiles; // 上一帧画到的 tile
+        bool moved;
+    };
+
+    int width_, height_, tiles_x_, tiles_y_;
+    TGAImage frame_, zbuffer_;
+    TGAImage shadowbuffer_[2]; // 当前和上一帧的 shadow map，比较两者得到阴影变化的范围
+    int shadow_;               // 当前的 shadow map 是 shadowbuffer_[shadow_]
+    GBuffer gbuffer_;
+    std::vector<Object> objects_;
+    vec3 light_, eye_, center_, up_;
+    bool light_changed_, full_;
+    IncrementalStats stats_;
+
+    void setup_camera();
+    mat<4,4> draw_shadow();
+    bool screen_tiles(const Object &obj, const mat<4,4> &view, int *rect);
+    void redraw(const int *rect, GouraudShader &shader, const mat<4,4> &view, std::vector<unsigned char> &redrawn);
+    bool shadow_changed(double *box);
+    void relight(GouraudShader &shader, const std::vector<unsigned char> &redrawn, const double *box);
+};
+
+#endif //__INCREMENTAL_H__
@@ -10,10 +10,24 @@
 #include <cmath>
 #include <cstdlib>
 #include <limits>
+#include <string>
+#include <chrono>
 #include "tgaimage.h"
 #include "model.h"
 #include "geometry.h"
 #include "our_gl.h"
+#include "render.h"
+#include "model_stream.h"
+#include "fastmath.h"
+#include "pipeline.h"
+#include "shader.h"
+#include "server.h"
+#include "frame_stream.h"
+#include "incremental.h"
+#include "progressive.h"
+#include "arena.h"
+#include "wireframe.h"
+#include "scene.h"
 
 Model *model = NULL;
 const int WIDTH  = 800;
@@ -25,10 +39,14 @@ vec3 eye(1, 1, 3);       // camera position
 vec3 center(0, 0, 0);    // camera direction
 vec3 up(0, 1, 0);        // camera up vector
 
+// 流水线绘制的线程数，0 表示按 CPU 核数自动选择
+int geometry_workers = 0;
+int raster_workers = 0;
 
-extern mat<4,4> ModelView;
-extern mat<4,4> Projection;
-extern mat<4,4> Viewport;
+
+extern thread_local mat<4,4> ModelView;
+extern thread_local mat<4,4> Projection;
+extern thread_local mat<4,4> Viewport;
 
 // 思路很简单，点连成线
 void line(vec3 p0, vec3 p1, TGAImage &image, TGAColor color) {
@@ -75,91 +93,47 @@ void line(vec3 p0, vec3 p1, TGAImage &image, TGAColor color) {
 }
 
 
-struct GouraudShader : public IShader {
-    // written by vertex shader, read by fragment shader
-    vec3 l;               // light direction in normalized device coordinates
-    mat<2,3> varying_uv;  // triangle uv coordinates, written by the vertex shader, read by the fragment shader
-    mat<3,3> varying_nrm; // normal per vertex to be interpolated by FS
-    mat<3,3> ndc_tri;     // triangle in normalized device coordinates
-
-    virtual vec4 vertex(int iface, int nthvert) {
-        // 从 .obj 文件读取三角形顶点数据
-        vec4 gl_Vertex = embed<4>(model->vert(iface, nthvert));
-        // MVP & Viewport 变换
-        gl_Vertex = Viewport * Projection * ModelView * gl_Vertex;
-        // 获取顶点的贴图位置信息
-        varying_uv.set_col(nthvert, model->uv(iface, nthvert));
-        // 􏳻􏰓􏰔􏰪􏰫􏰇􏳼􏳽􏳾􏰪􏰫􏳻􏰓􏰔􏰪􏰫􏰇􏳼􏳽􏳾􏰪􏰫􏳻􏰓􏰔􏰪􏰫􏰇􏳼􏳽􏳾􏰪􏰫法线贴图读到的法线 * 变换矩阵的逆转置矩阵
-        varying_nrm.set_col(nthvert, proj<3>((Projection * ModelView).invert_transpose() * embed<4>(model->normal(iface, nthvert), 0.f)));
-        // 对 gl_Vertex 归一化
-        ndc_tri.set_col(nthvert, proj<3>(gl_Vertex / gl_Vertex[3]));
-        return gl_Vertex;
-    }
-
-    virtual bool fragment(vec3 bar, TGAColor &color) {
-        // 因为要做插值，所以光照和贴图都要乘以重心坐标（bar 是重心坐标）
-        vec2 uv = varying_uv * bar;
-        vec3 bn = (varying_nrm * bar).normalize();
-        
-        // 从切线空间贴图求解法线
-        // 数学推导可见：https://github.com/ssloy/tinyrenderer/wiki/Lesson-6bis-tangent-space-normal-mapping
-        // 用三角形的三个特殊点（三个顶点 P_0、P_1、P_2）计算出 A -> AI -> B
-        // (P_0->P_1)_x  (P_0->P_1)_y  (P_0->P_1)_z
-        // (P_0->P_2)_x  (P_0->P_2)_y  (P_0->P_2)_z
-        //         bn_x          bn_y          bn_z
-        mat<3,3> A;
-        A[0] = ndc_tri.col(1) - ndc_tri.col(0);
-        A[1] = ndc_tri.col(2) - ndc_tri.col(0);
-        A[2] = bn;
-        
-        // AI 是 A 的逆矩阵
-        mat<3,3> AI = A.invert();
-        
-        vec3 i = AI * vec3(varying_uv[0][1] - varying_uv[0][0], varying_uv[0][2] - varying_uv[0][0], 0);
-        vec3 j = AI * vec3(varying_uv[1][1] - varying_uv[1][0], varying_uv[1][2] - varying_uv[1][0], 0);
-        
-        // 切线空间的基
-        // 这里的 B 其实就是 TBN_World 矩阵
-        mat<3,3> B;
-        B.set_col(0, i.normalize());
-        B.set_col(1, j.normalize());
-        B.set_col(2, bn);
-        
-        // 光照
-        vec3 l = proj<3>(Projection * ModelView * embed<4>(light_dir)).normalize();
-        
-        // 法线（做了一个基变换，切线空间基向量 * 切线空间的法线向量，得到的是世界坐标系下的法线向量）
-        vec3 n = (B * model->normal(uv)).normalize();
-        
-        // reflected light direction
-        vec3 r = (n * (n * l * 2.f) - l).normalize();
-        
-        // 镜面高亮
-        // specular intensity, note that the camera lies on the z-axis (in ndc), therefore simple r.z
-        float spec = pow(std::max<float>(r.z, 0.0f), model->specular(uv));
-        // 漫反射
-        float diff = std::max<float>(0.f, n * l);
-        // 固有纹理
-        TGAColor c = model->diffuse(uv);
-        
-        color = c;
-        
-        // Phong reflection model
-        for (int i = 0; i < 3; i++) {
-            //   5: ambient component
-            //   1: diffuse component
-            // 0.6: specular component
-            color[i] = std::min<float>(5 + c[i] * (diff + .6 * spec), 255);
-        }
-        
-        // no, we do not discard this pixel
-        return false;
+void printRasterStats() {
+    std::cerr << "triangles " << raster_stats.triangles << " shaded fragments " << raster_stats.shaded_fragments << std::endl;
+    std::cerr << "raster paths: small " << raster_stats.small_triangles << " span " << raster_stats.span_triangles << " block " << raster_stats.block_triangles
+              << " (blocks accepted " << raster_stats.blocks_accepted << " partial " << raster_stats.blocks_partial << " rejected " << raster_stats.blocks_rejected << ")" << std::endl;
+}
+
+// 以光源为相机渲染一遍深度（只写深度，不调用着色器），返回 shadow buffer 的屏幕变换矩阵
+// 有 DRAW_AUTO_LOD 时先按相机视角选好 LOD，阴影和画面用同一级网格，否则两边的深度对不上，表面会自己挡住自己
+mat<4,4> drawShadowBuffer(TGAImage &shadowbuffer, const int mode=DRAW_DEFAULT) {
+    if (mode & DRAW_AUTO_LOD) {
+        lookat(eye, center, up);
+        projection(-1.f / (eye - center).norm());
+        viewport(WIDTH / 8, HEIGHT / 8, WIDTH * 3/4, HEIGHT * 3/4);
+        model->set_lod(select_lod(*model));
     }
-};
+    // 平行光，所以不需要透视投影
+    lookat(light_dir, center, up);
+    projection(0);
+    viewport(WIDTH / 8, HEIGHT / 8, WIDTH * 3/4, HEIGHT * 3/4);
+    mat<4,4> M = Viewport * Projection * ModelView;
+    draw_depth(*model, M, shadowbuffer);
+    return M;
+}
 
+void drawModelTriangle(const int mode, const int msaa, const bool optimize, const bool compress, const bool bc, const bool pipeline, const bool wireframe) {
+    model = new Model("obj/african_head.obj", true, bc);
+    std::cerr << "texture data " << model->texture_bytes() << " bytes" << std::endl;
+    if (optimize) {
+        model->optimize_vertex_cache();
+    }
+    if (mode & DRAW_AUTO_LOD) {
+        model->build_lods();
+    }
+    if (compress) {
+        model->compress_vertices();
+    }
+    light_dir.normalize();
 
-void drawModelTriangle() {
-    model = new Model("obj/african_head.obj");
+    // 第一遍：光源视角的深度图
+    TGAImage shadowbuffer(WIDTH, HEIGHT, TGAImage::GRAYSCALE);
+    mat<4,4> M_shadow = drawShadowBuffer(shadowbuffer, mode);
 
     // build the ModelView matrix
     lookat(eye, center, up);
@@ -170,32 +144,455 @@ void drawModelTriangle() {
     // 其实这里用 viewport(0, 0, WIDTH, HEIGHT) 就可以，这样渲染的图像会撑满整个屏幕
     // 乘以 3/4 后再平移 1/8 的距离，就可以把图像摆到图片中央
     viewport(WIDTH / 8, HEIGHT / 8, WIDTH * 3/4, HEIGHT * 3/4); // build the Viewport matrix
-    light_dir.normalize();
     
     TGAImage frame(WIDTH, HEIGHT, TGAImage::RGB);
     TGAImage zbuffer(WIDTH, HEIGHT, TGAImage::GRAYSCALE);
     
     // 遍历所有三角形
-    GouraudShader shader;
-    for (int i = 0; i < model->nfaces(); i++) {
-        vec4 screen_coords[3];
-        for (int j = 0; j < 3; j++) {
-            screen_coords[j] = shader.vertex(i, j);
-        }
-
-        triangle(screen_coords, shader, frame, zbuffer);
+    GouraudShader shader(model, light_dir);
+    shader.shadowbuffer = &shadowbuffer;
+    shader.uniform_Mshadow = M_shadow * (Viewport * Projection * ModelView).invert();
+    raster_stats = RasterStats();
+    if (msaa > 1) {
+        // 多重采样：每个像素 msaa 个样本，最后平均到 frame 上
+        MultisampleBuffer target(WIDTH, HEIGHT, msaa);
+        draw_model(*model, shader, target, mode);
+        target.resolve(frame);
+    } else if (pipeline) {
+        PipelineStats ps = draw_pipelined(*model, shader, frame, zbuffer, mode, geometry_workers, raster_workers);
+        std::cerr << "pipeline " << ps.geometry_workers << " geometry + " << ps.raster_workers << " raster workers, "
+                  << ps.batches << " batches, " << ps.culled << " culled, " << ps.seconds * 1000 << " ms" << std::endl;
+        std::cerr << "utilization geometry " << ps.geometry_busy * 100 << "% raster " << ps.raster_busy * 100 << "%, "
+                  << "stalls queue full " << ps.full_stalls << " queue empty " << ps.empty_stalls << std::endl;
+    } else {
+        draw_model(*model, shader, frame, zbuffer, mode);
+    }
+    printRasterStats();
+    if (wireframe) {
+        // 线框叠在着色结果上；MSAA 没有 8 位的 zbuffer，这时不做深度测试
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        std::vector<Edge> edges = mesh_edges(*model);
+        WireframeStats ws = draw_wireframe(*model, edges, frame, msaa > 1 ? NULL : &zbuffer, TGAColor(0, 255, 0));
+        std::cerr << "wireframe " << ws.edges << " edges, " << ws.clipped << " clipped, " << ws.pixels << " pixels, "
+                  << std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count() << " ms" << std::endl;
+    }
+    if (mode & DRAW_AUTO_LOD) {
+        std::cerr << "lod " << model->lod() << " f# " << model->nfaces() << std::endl;
+    }
+    if (mode & DRAW_MESHLET_CULLING) {
+        std::cerr << "meshlets " << meshlet_stats.meshlets << " frustum culled " << meshlet_stats.frustum_culled
+                  << " cone culled " << meshlet_stats.cone_culled << " faces culled " << meshlet_stats.faces_culled << std::endl;
     }
     
     frame.flip_vertically();
     zbuffer.flip_vertically();
-    frame.write_tga_file("output/lesson06_tangent_space_normal_mapping.tga");
+    frame.write_tga_file("output/lesson07_shadow_mapping.tga");
 //    zbuffer.write_tga_file("output/lesson06_zbuffer.tga");
+//    shadowbuffer.flip_vertically();
+//    shadowbuffer.write_tga_file("output/lesson07_shadowbuffer.tga");
     
     delete model;
 }
 
+// 流式绘制：模型按块读入，每块画完就丢掉，内存占用和模型大小无关
+// 阴影需要先完整地画一遍光源视角的深度，所以文件会被读两遍
+void drawStreamed(const char *filename, const int mode) {
+    ModelStream stream(filename);
+    if (!stream.good()) return;
+    light_dir.normalize();
+
+    TGAImage shadowbuffer(WIDTH, HEIGHT, TGAImage::GRAYSCALE);
+    lookat(light_dir, center, up);
+    projection(0);
+    viewport(WIDTH / 8, HEIGHT / 8, WIDTH * 3/4, HEIGHT * 3/4);
+    mat<4,4> M_shadow = Viewport * Projection * ModelView;
+    while ((model = stream.next_chunk())) {
+        draw_depth(*model, M_shadow, shadowbuffer);
+    }
+
+    lookat(eye, center, up);
+    projection(-1.f / (eye - center).norm());
+    viewport(WIDTH / 8, HEIGHT / 8, WIDTH * 3/4, HEIGHT * 3/4);
+
+    TGAImage frame(WIDTH, HEIGHT, TGAImage::RGB);
+    TGAImage zbuffer(WIDTH, HEIGHT, TGAImage::GRAYSCALE);
+    GouraudShader shader(model, light_dir);
+    shader.shadowbuffer = &shadowbuffer;
+    shader.uniform_Mshadow = M_shadow * (Viewport * Projection * ModelView).invert();
+    raster_stats = RasterStats();
+    stream.rewind();
+    // 块与块之间没有全局的深度信息，DRAW_DEPTH_PREPASS 只在块内生效
+    while ((model = stream.next_chunk())) {
+        shader.model = model;
+        draw_model(*model, shader, frame, zbuffer, mode & ~DRAW_AUTO_LOD);
+    }
+    model = NULL;
+    printRasterStats();
+
+    frame.flip_vertically();
+    frame.write_tga_file("output/lesson07_shadow_mapping.tga");
+}
+
+// 实例化绘制：同一个模型按网格摆放 n 份，每份有自己的大小和颜色
+void drawInstances(const int n) {
+    model = new Model("obj/african_head.obj");
+    light_dir.normalize();
+
+    lookat(eye, center, up);
+    projection(-1.f / (eye - center).norm());
+    viewport(WIDTH / 8, HEIGHT / 8, WIDTH * 3/4, HEIGHT * 3/4);
+
+    // 网格边长，模型缩小到一个格子里
+    int side = 1;
+    while (side * side < n) side++;
+    const double cell = 2. / side;
+    std::vector<Instance> instances(n);
+    for (int k = 0; k < n; k++) {
+        mat<4,4> T = mat<4,4>::identity();
+        const double s = cell / 2 * (.8 + .2 * (k % 3) / 2.);
+        T[0][0] = T[1][1] = T[2][2] = s;
+        T[0][3] = -1 + cell * (k % side + .5);
+        T[1][3] =  1 - cell * (k / side + .5);
+        instances[k].transform = T;
+        instances[k].tint = TGAColor(155 + 100 * (k % 2), 155 + 100 * (k / 2 % 2), 155 + 100 * (k / 4 % 2));
+    }
+
+    TGAImage frame(WIDTH, HEIGHT, TGAImage::RGB);
+    TGAImage zbuffer(WIDTH, HEIGHT, TGAImage::GRAYSCALE);
+    GouraudShader shader(model, light_dir);
+    raster_stats = RasterStats();
+    int drawn = draw_instanced(*model, shader, instances, frame, zbuffer);
+    std::cerr << "instances " << drawn << "/" << n << " triangles " << raster_stats.triangles << std::endl;
+
+    frame.flip_vertically();
+    frame.write_tga_file("output/lesson07_instancing.tga");
+
+    delete model;
+}
+
+// 动画：相机绕模型转一圈，每帧直接写到视频流里，不落地中间文件
+// 光源和模型不动，阴影图只画一次；frame/zbuffer 每帧清零复用
+void drawAnimation(const char *path, const FrameStream::Format format, const int frames, const int mode) {
+    model = new Model("obj/african_head.obj");
+    light_dir.normalize();
+
+    TGAImage shadowbuffer(WIDTH, HEIGHT, TGAImage::GRAYSCALE);
+    mat<4,4> M_shadow = drawShadowBuffer(shadowbuffer);
+
+    FrameStream stream;
+    if (!stream.open(path, format, WIDTH, HEIGHT)) {
+        delete model;
+        return;
+    }
+    TGAImage frame(WIDTH, HEIGHT, TGAImage::RGB);
+    TGAImage zbuffer(WIDTH, HEIGHT, TGAImage::GRAYSCALE);
+    const double radius = std::sqrt(eye.x * eye.x + eye.z * eye.z);
+    const double start = std::atan2(eye.x, eye.z);
+    for (int k = 0; k < frames; k++) {
+        const double angle = start + 2 * M_PI * k / frames;
+        const vec3 e(radius * std::sin(angle), eye.y, radius * std::cos(angle));
+        lookat(e, center, up);
+        projection(-1.f / (e - center).norm());
+        viewport(WIDTH / 8, HEIGHT / 8, WIDTH * 3/4, HEIGHT * 3/4);
+
+        frame.clear();
+        zbuffer.clear();
+        GouraudShader shader(model, light_dir);
+        shader.shadowbuffer = &shadowbuffer;
+        shader.uniform_Mshadow = M_shadow * (Viewport * Projection * ModelView).invert();
+        draw_model(*model, shader, frame, zbuffer, mode);
+        if (!stream.write(frame)) break;
+    }
+    std::cerr << "frames " << stream.frames() << "/" << frames << std::endl;
+
+    delete model;
+}
+
+// 增量渲染：三个模型，先整帧画一次，然后每一步转一下光源、再移动一个模型，只重画变化的部分
+void drawIncremental(const int steps) {
+    model = new Model("obj/african_head.obj");
+    IncrementalRenderer renderer(WIDTH, HEIGHT);
+    renderer.camera(eye, center, up);
+    renderer.light(light_dir);
+    for (int k = 0; k < 3; k++) {
+        mat<4,4> T = mat<4,4>::identity();
+        T[0][0] = T[1][1] = T[2][2] = .5;
+        T[0][3] = -.6 + .6 * k;
+        renderer.add(model, T);
+    }
+
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    renderer.render();
+    std::cerr << "full frame " << std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count() << " ms" << std::endl;
+    for (int s = 1; s <= steps; s++) {
+        const double angle = 2 * M_PI * s / steps;
+        start = std::chrono::steady_clock::now();
+        renderer.light(vec3(std::cos(angle) + light_dir.x, light_dir.y, std::sin(angle) + light_dir.z));
+        renderer.render();
+        const IncrementalStats &ls = renderer.stats();
+        std::cerr << "light step " << s << ": " << std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count()
+                  << " ms, relit " << ls.relit_pixels << " pixels, redrawn " << ls.redrawn_tiles << "/" << ls.tiles << " tiles" << std::endl;
+
+        mat<4,4> T = mat<4,4>::identity();
+        T[0][0] = T[1][1] = T[2][2] = .5;
+        T[0][3] = .6;
+        T[1][3] = .3 * std::sin(angle);
+        start = std::chrono::steady_clock::now();
+        renderer.move(2, T);
+        renderer.render();
+        const IncrementalStats &ms = renderer.stats();
+        std::cerr << "move step " << s << ": " << std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count()
+                  << " ms, relit " << ms.relit_pixels << " pixels, redrawn " << ms.redrawn_tiles << "/" << ms.tiles << " tiles" << std::endl;
+    }
+
+    TGAImage frame = renderer.render();
+    frame.flip_vertically();
+    frame.write_tga_file("output/incremental.tga");
+
+    delete model;
+}
+
+// 渐进预览：先画 1/4、1/2 分辨率，再画完整分辨率（和 MSAA），每一遍都写一张图，打印出图的时间
+void drawProgressive(const int msaa) {
+    model = new Model("obj/african_head.obj");
+    ProgressiveScene scene = {model, eye, center, up, light_dir, WIDTH, HEIGHT};
+    CancelToken token;
+    const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    render_progressive(scene, progressive_passes(msaa), token, [&](TGAImage &frame, const int pass, const ProgressivePass &p) {
+        std::cerr << "pass " << pass << " 1/" << p.scale << " msaa " << p.msaa << ": "
+                  << std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count() << " ms" << std::endl;
+        frame.flip_vertically();
+        frame.write_tga_file(("output/progressive_" + std::to_string(pass) + ".tga").c_str());
+        return true;
+    });
+
+    delete model;
+}
+
+// 基准测试：同一个画面连续渲染 n 帧，render target 从池里取，帧内存每帧重置
+// 统计每帧的耗时和堆分配次数，第一帧以后（稳定状态）应该没有堆分配
+void drawBenchmark(const int frames, const int mode, const bool optimize) {
+    model = new Model("obj/african_head.obj");
+    if (optimize) {
+        model->optimize_vertex_cache();
+    }
+    if (mode & DRAW_AUTO_LOD) {
+        model->build_lods();
+    }
+    light_dir.normalize();
+
+    RenderTargetPool pool;
+    double first_ms = 0, steady_ms = 0;
+    unsigned long first_allocations = 0, steady_allocations = 0, allocations = 0;
+    const bool counted = heap_allocations(allocations);
+    for (int k = 0; k < frames; k++) {
+        heap_allocations(allocations);
+        const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+        TGAImage &shadowbuffer = pool.acquire(WIDTH, HEIGHT, TGAImage::GRAYSCALE);
+        TGAImage &frame = pool.acquire(WIDTH, HEIGHT, TGAImage::RGB);
+        TGAImage &zbuffer = pool.acquire(WIDTH, HEIGHT, TGAImage::GRAYSCALE);
+        mat<4,4> M_shadow = drawShadowBuffer(shadowbuffer, mode);
+        lookat(eye, center, up);
+        projection(-1.f / (eye - center).norm());
+        viewport(WIDTH / 8, HEIGHT / 8, WIDTH * 3/4, HEIGHT * 3/4);
+        GouraudShader shader(model, light_dir);
+        shader.shadowbuffer = &shadowbuffer;
+        shader.uniform_Mshadow = M_shadow * (Viewport * Projection * ModelView).invert();
+        draw_model(*model, shader, frame, zbuffer, mode);
+        frame.flip_vertically();
+        pool.release(shadowbuffer);
+        pool.release(frame);
+        pool.release(zbuffer);
+        frame_arena().reset();
+
+        const double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+        unsigned long n = allocations;
+        heap_allocations(n);
+        n -= allocations;
+        if (k == 0) {
+            first_ms = ms;
+            first_allocations = n;
+        } else {
+            steady_ms += ms;
+            steady_allocations += n;
+        }
+    }
+    std::cerr << "first frame " << first_ms << " ms";
+    if (counted) std::cerr << ", " << first_allocations << " heap allocations";
+    std::cerr << std::endl;
+    if (frames > 1) {
+        std::cerr << "steady state " << steady_ms / (frames - 1) << " ms/frame";
+        if (counted) std::cerr << ", " << steady_allocations << " heap allocations";
+        std::cerr << " in " << frames - 1 << " frames, frame arena " << frame_arena().capacity() << " bytes" << std::endl;
+    }
+    if (!counted) {
+        std::cerr << "heap allocations are only counted in builds with COUNT_HEAP_ALLOCATIONS defined" << std::endl;
+    }
+
+    delete model;
+}
+
+// 多物体场景：从场景文件读模型、物体、光源和相机，BVH 剔除视锥外的物体后再画
+// cull 为 false 时每个物体都走完整的绘制流程，用来对比耗时
+void drawScene(const char *filename, const int mode, const bool cull) {
+    Scene scene;
+    if (!scene.load(filename)) {
+        return;
+    }
+    TGAImage shadowbuffer(WIDTH, HEIGHT, TGAImage::GRAYSCALE);
+    TGAImage frame(WIDTH, HEIGHT, TGAImage::RGB);
+    TGAImage zbuffer(WIDTH, HEIGHT, TGAImage::GRAYSCALE);
+    raster_stats = RasterStats();
+    const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    scene.render(frame, zbuffer, shadowbuffer, mode & ~DRAW_AUTO_LOD, cull);
+    const double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    const SceneStats &st = scene.stats();
+    std::cerr << "scene " << st.objects << " objects, " << st.drawn << " drawn, " << st.culled << " culled, "
+              << st.shadow_drawn << " in shadow pass, " << st.nodes_visited << " BVH nodes visited, "
+              << raster_stats.triangles << " triangles, " << ms << " ms" << std::endl;
+
+    frame.flip_vertically();
+    frame.write_tga_file("output/scene.tga");
+}
+
+// 注视点着色率图：屏幕中间全速率着色，往外依次是 2x2 和 4x4
+void foveatedRateImage(TGAImage &rate_image) {
+    const int w = rate_image.get_width(), h = rate_image.get_height();
+    for (int y = 0; y < h; y++) {
+        for (int x = 0; x < w; x++) {
+            double dx = (x + .5) / w - .5, dy = (y + .5) / h - .5;
+            double r = std::sqrt(dx * dx + dy * dy);
+            rate_image.set(x, y, TGAColor(r < .2 ? 1 : (r < .35 ? 2 : 4)));
+        }
+    }
+}
+
 int main(int argc, char** argv) {
-    drawModelTriangle();
+    // --front-to-back: 按深度从近到远绘制；--prepass: 先做 Z-prepass 再着色；--meshlets: 按 meshlet 剔除
+    // --lod: 根据屏幕大小自动选择 LOD
+    // --msaa N: N 倍多重采样抗锯齿（2/4/8）
+    // --instances N: 实例化绘制 N 个模型
+    // --stream FILE: 流式读取并绘制（超过内存大小的）OBJ 文件
+    // --optimize: 加载后按顶点缓存重排三角形和顶点；--compress: 量化压缩顶点属性
+    // --bc: 贴图按块压缩（BC1/BC4/BC5）存储
+    // --pipeline: 几何和光栅化分到多个线程流水线执行；--workers G R: 几何/光栅线程数
+    // --fastmath-check: 检查近似数学函数的精度；--stream-check FILE: 检查流式读取和整个加载的结果一致
+    // --coarse N: 每 NxN 个像素着色一次（2/4）；--vrs: 按注视点着色率图降低屏幕边缘的着色率
+    // --frames N --video PATH [--video-format ppm|y4m|bgra]: 渲染 N 帧环绕动画，写成视频流（PATH 为 - 时写到 stdout）
+    // --incremental N: 增量渲染演示，N 步改光源和移动模型，只重画变化的部分
+    // --progressive: 渐进预览，1/4 -> 1/2 -> 完整分辨率（有 --msaa N 时最后再做一遍多重采样）
+    // --wireframe: 在着色结果上叠加深度测试过的线框
+    // --bench N: 连续渲染 N 帧，统计耗时和稳定状态下的堆分配次数（可以和 --optimize 一起用）
+    // --scene FILE: 渲染多物体场景（格式见 scene.h），按 BVH 剔除视锥外的物体；--no-cull: 不剔除，对比用
+    // --server [SOCKET]: 常驻的渲染服务，从 stdin 或 Unix socket 读请求（协议见 server.h）；--server-workers N: 渲染线程数
+    int mode = DRAW_DEFAULT;
+    int msaa = 1;
+    int instances = 0;
+    const char *stream = NULL;
+    bool optimize = false;
+    bool compress = false;
+    bool bc = false;
+    bool pipeline = false;
+    bool server = false;
+    const char *server_socket = NULL;
+    int server_workers = 0;
+    int frames = 0;
+    int incremental = 0;
+    bool progressive = false;
+    int bench = 0;
+    bool wireframe = false;
+    const char *scene = NULL;
+    bool cull = true;
+    const char *video = NULL;
+    FrameStream::Format video_format = FrameStream::Y4M;
+    TGAImage rate_image;
+    for (int i = 1; i < argc; i++) {
+        std::string arg(argv[i]);
+        if (arg == "--front-to-back") mode |= DRAW_FRONT_TO_BACK;
+        if (arg == "--prepass")       mode |= DRAW_DEPTH_PREPASS;
+        if (arg == "--meshlets")      mode |= DRAW_MESHLET_CULLING;
+        if (arg == "--lod")           mode |= DRAW_AUTO_LOD;
+        if (arg == "--msaa" && i + 1 < argc) msaa = std::atoi(argv[++i]);
+        if (arg == "--instances" && i + 1 < argc) instances = std::atoi(argv[++i]);
+        if (arg == "--stream" && i + 1 < argc) stream = argv[++i];
+        if (arg == "--optimize") optimize = true;
+        if (arg == "--compress") compress = true;
+        if (arg == "--bc")       bc = true;
+        if (arg == "--pipeline") pipeline = true;
+        if (arg == "--workers" && i + 2 < argc) {
+            geometry_workers = std::atoi(argv[++i]);
+            raster_workers = std::atoi(argv[++i]);
+        }
+        if (arg == "--coarse" && i + 1 < argc) {
+            int rate = std::atoi(argv[++i]);
+            mode |= rate >= 4 ? DRAW_COARSE_4X4 : (rate >= 2 ? DRAW_COARSE_2X2 : 0);
+        }
+        if (arg == "--server") {
+            server = true;
+            if (i + 1 < argc && argv[i + 1][0] != '-') server_socket = argv[++i];
+        }
+        if (arg == "--progressive") progressive = true;
+        if (arg == "--wireframe") wireframe = true;
+        if (arg == "--scene" && i + 1 < argc) scene = argv[++i];
+        if (arg == "--no-cull") cull = false;
+        if (arg == "--bench" && i + 1 < argc) bench = std::atoi(argv[++i]);
+        if (arg == "--incremental" && i + 1 < argc) incremental = std::atoi(argv[++i]);
+        if (arg == "--frames" && i + 1 < argc) frames = std::atoi(argv[++i]);
+        if (arg == "--video" && i + 1 < argc) video = argv[++i];
+        if (arg == "--video-format" && i + 1 < argc && !FrameStream::parse_format(argv[++i], video_format)) {
+            std::cerr << "video format must be ppm, y4m or bgra" << std::endl;
+            return 1;
+        }
+        if (arg == "--server-workers" && i + 1 < argc) server_workers = std::atoi(argv[++i]);
+        if (arg == "--fastmath-check") return fastmath_accuracy() ? 0 : 1;
+        if (arg == "--stream-check" && i + 1 < argc) return stream_matches_model(argv[++i]) ? 0 : 1;
+        if (arg == "--vrs") {
+            rate_image = TGAImage((WIDTH + 3) / 4, (HEIGHT + 3) / 4, TGAImage::GRAYSCALE);
+            foveatedRateImage(rate_image);
+            shading_rate_image(&rate_image);
+        }
+    }
+    if (server) {
+        return run_server(server_socket, server_workers);
+    }
+    if (bench > 0) {
+        drawBenchmark(bench, mode, optimize);
+        return 0;
+    }
+    if (scene) {
+        drawScene(scene, mode, cull);
+        return 0;
+    }
+    if (incremental > 0) {
+        drawIncremental(incremental);
+        return 0;
+    }
+    if (video) {
+        drawAnimation(video, video_format, frames > 0 ? frames : 1, mode & ~DRAW_AUTO_LOD);
+        return 0;
+    }
+    if (stream) {
+        drawStreamed(stream, mode);
+        return 0;
+    }
+    if (instances > 0) {
+        drawInstances(instances);
+        return 0;
+    }
+    if (msaa != 1 && msaa != 2 && msaa != 4 && msaa != 8) {
+        std::cerr << "msaa must be 1, 2, 4 or 8" << std::endl;
+        return 1;
+    }
+    if (msaa > 1 && (mode & (DRAW_DEPTH_PREPASS | DRAW_COARSE_2X2 | DRAW_COARSE_4X4))) {
+        std::cerr << "--msaa can't be combined with --prepass or --coarse" << std::endl;
+        return 1;
+    }
+    if (progressive) {
+        drawProgressive(msaa);
+        return 0;
+    }
+    drawModelTriangle(mode, msaa, optimize, compress, bc, pipeline, wireframe);
 
     return 0;
 }
@@ -10,14 +10,23 @@
 #include <fstream>
 #include <sstream>
 #include <vector>
+#include <algorithm>
+#include <queue>
+#include <map>
+#include <utility>
+#include <cmath>
+#include <sys/stat.h>
 #include "model.h"
 
-Model::Model(const char *filename) : verts_(), faces_(), norms_(), uv_(), diffusemap_(), normalmap_(), specularmap_() {
+Model::Model(const char *filename, const bool geometry, const bool compressed_textures) : verts_(), faces_(), norms_(), uv_(), diffusemap_(), normalmap_(), specularmap_(), compressed_textures_(compressed_textures), diffuse_bc_(), normal_bc_(), specular_bc_(), bound_center_(), bound_radius_(0), meshlets_(), meshlet_faces_(), lods_(), lod_(0), compressed_(false), qverts_(), qnorms_(), quv_(), qvert_offset_(), qvert_scale_(), quv_offset_(), quv_scale_() {
     std::ifstream in;
-    in.open (filename, std::ifstream::in);
-    if (in.fail()) return;
+    // geometry 为 false 时只加载贴图，几何数据由 ModelStream 分批填进来
+    if (geometry) {
+        in.open (filename, std::ifstream::in);
+        if (in.fail()) return;
+    }
     std::string line;
-    while (!in.eof()) {
+    while (in.is_open() && !in.eof()) {
         std::getline(in, line);
         
         // istringstream 可以用于分割被空格、制表符等符号分割的字符串
@@ -56,21 +65,48 @@ Model::Model(const char *filename) : verts_(), faces_(), norms_(), uv_(), diffus
             std::vector<vec3> f;
             vec3 tmp;
             iss >> trash;
+            // 负数是相对下标，从这个面之前已经读到的记录往回数
+            const double seen[3] = {(double)verts_.size(), (double)uv_.size(), (double)norms_.size()};
             while (iss >> tmp[0] >> trash >> tmp[1] >> trash >> tmp[2]) {
                 for (int i = 0; i < 3; i++) {
                     // in wavefront obj all indices start at 1, not zero
                     // 索引从 1 开始
-                    tmp[i]--;
+                    tmp[i] = tmp[i] > 0 ? tmp[i] - 1 : seen[i] + tmp[i];
                 }
                 f.push_back(tmp);
             }
             faces_.push_back(f);
         }
     }
+    // 包围球：用包围盒的中心做球心，半径取离球心最远的顶点
+    if (!verts_.empty()) {
+        vec3 bmin = verts_[0], bmax = verts_[0];
+        for (int i = 0; i < (int)verts_.size(); i++) {
+            for (int j = 0; j < 3; j++) {
+                bmin[j] = std::min(bmin[j], verts_[i][j]);
+                bmax[j] = std::max(bmax[j], verts_[i][j]);
+            }
+        }
+        bound_center_ = (bmin + bmax) / 2.;
+        for (int i = 0; i < (int)verts_.size(); i++) {
+            bound_radius_ = std::max(bound_radius_, (verts_[i] - bound_center_).norm());
+        }
+    }
+    build_meshlets();
     std::cerr << "# v# " << verts_.size() << " f# "  << faces_.size() << " vt# " << uv_.size() << " vn# " << norms_.size() << std::endl;
-    load_texture(filename, "_diffuse.tga", diffusemap_);
-    load_texture(filename, "_nm_tangent.tga", normalmap_);
-    load_texture(filename, "_spec.tga", specularmap_);
+    if (compressed_textures_) {
+        load_texture(filename, "_diffuse.tga", diffuse_bc_, CompressedTexture::BC1);
+        load_texture(filename, "_nm_tangent.tga", normal_bc_, CompressedTexture::BC5);
+        load_texture(filename, "_spec.tga", specular_bc_, CompressedTexture::BC4);
+    } else {
+        // 三张贴图先一起交给后台线程解码，再依次等待；其他 Model 已经加载过的贴图直接共享
+        TextureCache &cache = TextureCache::instance();
+        std::string maps[3] = {texture_path(filename, "_diffuse.tga"), texture_path(filename, "_nm_tangent.tga"), texture_path(filename, "_spec.tga")};
+        for (int i = 0; i < 3; i++) cache.prefetch(maps[i]);
+        diffusemap_  = cache.get(maps[0]);
+        normalmap_   = cache.get(maps[1]);
+        specularmap_ = cache.get(maps[2]);
+    }
 }
 
 Model::~Model() {
@@ -78,17 +114,22 @@ Model::~Model() {
 
 // 计算顶点数
 int Model::nverts() {
-    return (int)verts_.size();
+    return (int)(compressed_ ? qverts_.size() / 3 : verts_.size());
 }
 
 // 计算三角形面数
 int Model::nfaces() {
-    return (int)faces_.size();
+    return (int)(lod_ ? lods_[lod_ - 1].size() : faces_.size());
+}
+
+// 当前 LOD 下某个三角形的三个角（顶点/uv/法线下标）
+const std::vector<vec3> &Model::corners(int iface) {
+    return lod_ ? lods_[lod_ - 1][iface] : faces_[iface];
 }
 
 // 通过法线贴图获取某个纹理坐标的法线
 vec3 Model::normal(vec2 uvf) {
-    TGAColor c = normalmap_.get(uvf.x, uvf.y);
+    TGAColor c = compressed_textures_ ? normal_bc_.get(uvf.x, uvf.y) : normalmap_->get(uvf.x, uvf.y);
     vec3 res;
     for (int i=0; i<3; i++)
         res[2-i] = (float)c[i]/255.f*2.f - 1.f;
@@ -97,61 +138,763 @@ vec3 Model::normal(vec2 uvf) {
 
 // 获取某个三角形面的某个顶点的法线
 vec3 Model::normal(int iface, int nvert) {
-    int idx = faces_[iface][nvert][2];
-    return norms_[idx].normalize();
+    int idx = corners(iface)[nvert][2];
+    if (compressed_) return decode_normal(idx);
+    vec3 n = norms_[idx]; // 不能原地归一化，多个线程可能同时读
+    return n.normalize();
 }
 
 float Model::specular(vec2 uvf) {
-    return specularmap_.get(uvf.x, uvf.y)[0]/1.f;
+    return (compressed_textures_ ? specular_bc_.get(uvf.x, uvf.y) : specularmap_->get(uvf.x, uvf.y))[0]/1.f;
 }
 
 
 // 获取某个三角形的三个顶点
-std::vector<int> Model::face(int idx) {
-    std::vector<int> face;
-    for (int i = 0; i < (int)faces_[idx].size(); i++) {
-        face.push_back(faces_[idx][i][0]);
+void Model::face(int idx, int *out) {
+    const std::vector<vec3> &c = corners(idx);
+    for (int i = 0; i < (int)c.size(); i++) {
+        out[i] = c[i][0];
     }
-
-    return face;
 }
 
 // 获取某个顶点
 vec3 Model::vert(int i) {
-    return verts_[i];
+    return compressed_ ? decode_vert(i) : verts_[i];
 }
 
 // 获取某个三角形面的某个顶点
 vec3 Model::vert(int iface, int nvert) {
-    return verts_[faces_[iface][nvert][0]];
+    return vert((int)corners(iface)[nvert][0]);
+}
+
+// 批量获取顶点 [first, first + count)，压缩存储时在一个紧凑的循环里解码，编译器可以向量化
+void Model::verts(const int first, const int count, vec3 *out) {
+    if (!compressed_) {
+        std::copy(verts_.begin() + first, verts_.begin() + first + count, out);
+        return;
+    }
+    const unsigned short *q = &qverts_[first * 3];
+    const double sx = qvert_scale_.x, sy = qvert_scale_.y, sz = qvert_scale_.z;
+    const double ox = qvert_offset_.x, oy = qvert_offset_.y, oz = qvert_offset_.z;
+    for (int i = 0; i < count; i++) {
+        out[i].x = ox + q[i*3 + 0] * sx;
+        out[i].y = oy + q[i*3 + 1] * sy;
+        out[i].z = oz + q[i*3 + 2] * sz;
+    }
+}
+
+// 获取某个三角形面的某个顶点在顶点数组里的下标
+int Model::vert_index(int iface, int nvert) {
+    return (int)corners(iface)[nvert][0];
+}
+
+vec3 Model::bound_center() {
+    return bound_center_;
 }
 
-// 加载纹理贴图
-void Model::load_texture(std::string filename, const char *suffix, TGAImage &img) {
-    std::string texfile(filename);
-    size_t dot = texfile.find_last_of(".");
+double Model::bound_radius() {
+    return bound_radius_;
+}
+
+// 由模型文件名拼出贴图路径
+std::string Model::texture_path(std::string filename, const char *suffix) {
+    size_t dot = filename.find_last_of(".");
     // 判断 filename 是否非空
-    if (dot != std::string::npos) {
-        texfile = texfile.substr(0,dot) + std::string(suffix); // 拼接出纹理路径
-        std::cerr << "texture file " << texfile << " loading " << (img.read_tga_file(texfile.c_str()) ? "ok" : "failed") << std::endl;
-        img.flip_vertically();
+    if (dot == std::string::npos) return std::string();
+    return filename.substr(0,dot) + std::string(suffix); // 拼接出纹理路径
+}
+
+// 加载块压缩的贴图：贴图旁边有比它新的 .bc 缓存就直接读缓存，否则解码 tga、压缩并写出缓存
+void Model::load_texture(std::string filename, const char *suffix, CompressedTexture &tex, const CompressedTexture::Format format) {
+    std::string texfile = texture_path(filename, suffix);
+    if (texfile.empty()) return;
+    std::string cachefile = texfile + ".bc";
+
+    struct stat src, cache;
+    if (stat(texfile.c_str(), &src) == 0 && stat(cachefile.c_str(), &cache) == 0 && cache.st_mtime >= src.st_mtime && tex.read_file(cachefile.c_str())) {
+        std::cerr << "texture file " << cachefile << " loading ok" << std::endl;
+        return;
+    }
+    TGAImage img;
+    bool ok = img.read_tga_file(texfile.c_str());
+    std::cerr << "texture file " << texfile << " loading " << (ok ? "ok" : "failed") << std::endl;
+    if (!ok) return;
+    img.flip_vertically();
+    if (tex.compress(img, format)) {
+        tex.write_file(cachefile.c_str());
     }
 }
 
 // 获取某个纹理坐标对应的纹理颜色
 TGAColor Model::diffuse(vec2 uv) {
-    return diffusemap_.get(uv.x, uv.y);
+    return compressed_textures_ ? diffuse_bc_.get(uv.x, uv.y) : diffusemap_->get(uv.x, uv.y);
 }
 
 // uv_ 映射到纹理贴图中的真实位置
 vec2 Model::uv(int iface, int nvert) {
-    int idx = faces_[iface][nvert][1];
-    return vec2(uv_[idx].x * diffusemap_.get_width(), uv_[idx].y * diffusemap_.get_height());
+    int idx = corners(iface)[nvert][1];
+    vec2 t = compressed_ ? decode_uv(idx) : uv_[idx];
+    if (compressed_textures_) {
+        return vec2(t.x * diffuse_bc_.get_width(), t.y * diffuse_bc_.get_height());
+    }
+    return vec2(t.x * diffusemap_->get_width(), t.y * diffusemap_->get_height());
 }
 
 // 获取某个三角形面的某个顶点的法线
 vec3 Model::norm(int iface, int nvert) {
-    int idx = faces_[iface][nvert][2];
-    return norms_[idx].normalize();
+    return normal(iface, nvert);
+}
+
+
+// 把网格切成 meshlet：从还没分配的三角形开始，沿着共享顶点做广度优先扩展，直到三角形数达到上限
+// 这样每个 meshlet 都是一块空间上紧凑的网格，包围球和法线锥都比较小
+void Model::build_meshlets(const int max_triangles) {
+    meshlets_.clear();
+    meshlet_faces_.clear();
+    const int nfaces = (int)faces_.size();
+
+    // 顶点 -> 使用这个顶点的三角形（CSR 格式）
+    std::vector<int> vstart(verts_.size() + 1, 0);
+    for (int i = 0; i < nfaces; i++)
+        for (int j = 0; j < 3; j++) vstart[vert_index(i, j) + 1]++;
+    for (int v = 0; v < (int)verts_.size(); v++) vstart[v + 1] += vstart[v];
+    std::vector<int> vfaces(vstart.back());
+    std::vector<int> fill(vstart.begin(), vstart.end() - 1);
+    for (int i = 0; i < nfaces; i++)
+        for (int j = 0; j < 3; j++) vfaces[fill[vert_index(i, j)]++] = i;
+
+    std::vector<bool> used(nfaces, false);
+    for (int seed = 0; seed < nfaces; seed++) {
+        if (used[seed]) continue;
+        Meshlet m;
+        m.first = (int)meshlet_faces_.size();
+        m.count = 0;
+        std::queue<int> q;
+        q.push(seed);
+        used[seed] = true;
+        while (!q.empty() && m.count < max_triangles) {
+            int f = q.front();
+            q.pop();
+            meshlet_faces_.push_back(f);
+            m.count++;
+            for (int j = 0; j < 3; j++) {
+                int v = vert_index(f, j);
+                for (int k = vstart[v]; k < vstart[v + 1]; k++) {
+                    if (!used[vfaces[k]]) {
+                        used[vfaces[k]] = true;
+                        q.push(vfaces[k]);
+                    }
+                }
+            }
+        }
+        // 队列里剩下的三角形放回去，留给后面的 meshlet
+        while (!q.empty()) {
+            used[q.front()] = false;
+            q.pop();
+        }
+
+        // 包围球：顶点的平均位置做球心
+        vec3 c;
+        for (int k = 0; k < m.count; k++)
+            for (int j = 0; j < 3; j++) c = c + vert(meshlet_faces_[m.first + k], j);
+        m.center = c / (3. * m.count);
+        m.radius = 0;
+        for (int k = 0; k < m.count; k++)
+            for (int j = 0; j < 3; j++) m.radius = std::max(m.radius, (vert(meshlet_faces_[m.first + k], j) - m.center).norm());
+
+        // 法线锥：轴是三角形法线的平均方向，alpha 是最大夹角
+        std::vector<vec3> normals(m.count);
+        vec3 axis;
+        for (int k = 0; k < m.count; k++) {
+            int f = meshlet_faces_[m.first + k];
+            vec3 n = cross(vert(f, 1) - vert(f, 0), vert(f, 2) - vert(f, 0));
+            double len = n.norm();
+            normals[k] = len > 0 ? n / len : n;
+            axis = axis + normals[k];
+        }
+        double axislen = axis.norm();
+        m.cone_axis = axislen > 0 ? axis / axislen : vec3(0, 0, 1);
+        double mindot = axislen > 0 ? 1 : -1;
+        for (int k = 0; k < m.count; k++) {
+            if (normals[k].norm2() > 0) mindot = std::min(mindot, normals[k] * m.cone_axis);
+        }
+        // alpha 超过 90 度时整个锥体没有意义
+        m.cone_cutoff = mindot <= 0 ? 2 : std::sqrt(1 - mindot * mindot);
+        meshlets_.push_back(m);
+    }
+}
+
+const std::vector<Meshlet> &Model::meshlets() {
+    return meshlets_;
+}
+
+const std::vector<int> &Model::meshlet_faces() {
+    return meshlet_faces_;
+}
+
+/////////////////////////////////////////////////////////////////////////////////
+// LOD：用二次误差度量（quadric error metric）做边折叠简化
+// 采用半边折叠，折叠后的顶点用原有顶点的位置，所以所有 LOD 共用 verts_/uv_/norms_
+// 贴图接缝（同一个顶点有多个 uv 或法线）和网格边界上的顶点被锁定，不会被折叠掉，这样 uv 接缝不会被撕开
+
+// 对称 4x4 矩阵，存 10 个数
+struct Quadric {
+    double a[10];
+    Quadric() { for (int i = 0; i < 10; i++) a[i] = 0; }
+    // 平面 nx*x + ny*y + nz*z + d = 0 的二次误差
+    Quadric(const vec3 n, const double d) {
+        a[0] = n.x*n.x; a[1] = n.x*n.y; a[2] = n.x*n.z; a[3] = n.x*d;
+        a[4] = n.y*n.y; a[5] = n.y*n.z; a[6] = n.y*d;
+        a[7] = n.z*n.z; a[8] = n.z*d;
+        a[9] = d*d;
+    }
+    Quadric & operator+=(const Quadric &q) { for (int i = 0; i < 10; i++) a[i] += q.a[i]; return *this; }
+    // v^T Q v
+    double error(const vec3 &v) const {
+        return a[0]*v.x*v.x + 2*a[1]*v.x*v.y + 2*a[2]*v.x*v.z + 2*a[3]*v.x
+             + a[4]*v.y*v.y + 2*a[5]*v.y*v.z + 2*a[6]*v.y
+             + a[7]*v.z*v.z + 2*a[8]*v.z + a[9];
+    }
+};
+
+// 候选的折叠：把顶点 from 合并到顶点 to
+struct Collapse {
+    double cost;
+    int from, to;
+    int version; // from 的版本号，顶点的邻域变化后旧的候选就失效了
+    bool operator<(const Collapse &c) const { return cost > c.cost; } // 小顶堆
+};
+
+void Model::build_lods(const int levels, const double ratio) {
+    if (compressed_) {
+        std::cerr << "build_lods must be called before compress_vertices" << std::endl;
+        return;
+    }
+    lods_.clear();
+    const int nverts = (int)verts_.size();
+    std::vector<int> fv(faces_.size() * 3), fuv(faces_.size() * 3), fn(faces_.size() * 3);
+    for (int i = 0; i < (int)faces_.size(); i++) {
+        for (int j = 0; j < 3; j++) {
+            fv [i*3 + j] = (int)faces_[i][j][0];
+            fuv[i*3 + j] = (int)faces_[i][j][1];
+            fn [i*3 + j] = (int)faces_[i][j][2];
+        }
+    }
+    const int nfaces = (int)faces_.size();
+    std::vector<bool> dead(nfaces, false);
+
+    // 顶点的 uv / 法线下标，-1 表示还没见过，-2 表示有多个（接缝）
+    std::vector<int> vuv(nverts, -1), vn(nverts, -1);
+    std::vector<std::vector<int> > vfaces(nverts);
+    std::vector<Quadric> quadrics(nverts);
+    for (int i = 0; i < nfaces; i++) {
+        vec3 p0 = verts_[fv[i*3]], p1 = verts_[fv[i*3 + 1]], p2 = verts_[fv[i*3 + 2]];
+        vec3 n = cross(p1 - p0, p2 - p0);
+        double area = n.norm();
+        Quadric q;
+        if (area > 0) {
+            n = n / area;
+            // 按面积加权，大三角形的平面更重要
+            Quadric plane(n, -(n * p0));
+            for (int k = 0; k < 10; k++) q.a[k] = plane.a[k] * area;
+        }
+        for (int j = 0; j < 3; j++) {
+            int v = fv[i*3 + j];
+            quadrics[v] += q;
+            vfaces[v].push_back(i);
+            vuv[v] = (vuv[v] == -1 || vuv[v] == fuv[i*3 + j]) ? fuv[i*3 + j] : -2;
+            vn[v]  = (vn[v]  == -1 || vn[v]  == fn[i*3 + j])  ? fn[i*3 + j]  : -2;
+        }
+    }
+
+    // 只被一个三角形使用的边是网格边界
+    std::map<std::pair<int, int>, int> edges;
+    for (int i = 0; i < nfaces; i++) {
+        for (int j = 0; j < 3; j++) {
+            int a = fv[i*3 + j], b = fv[i*3 + (j + 1) % 3];
+            edges[std::make_pair(std::min(a, b), std::max(a, b))]++;
+        }
+    }
+    std::vector<bool> locked(nverts, false);
+    for (int v = 0; v < nverts; v++) {
+        locked[v] = vuv[v] < 0 || vn[v] < 0;
+    }
+    for (std::map<std::pair<int, int>, int>::iterator it = edges.begin(); it != edges.end(); ++it) {
+        if (it->second != 2) {
+            locked[it->first.first] = locked[it->first.second] = true;
+        }
+    }
+
+    std::vector<int> version(nverts, 0);
+    std::priority_queue<Collapse> heap;
+    // 把顶点 v 往所有邻居折叠的候选放进堆里
+    auto push_candidates = [&](const int v) {
+        if (locked[v]) return;
+        for (int k = 0; k < (int)vfaces[v].size(); k++) {
+            int f = vfaces[v][k];
+            if (dead[f]) continue;
+            for (int j = 0; j < 3; j++) {
+                int to = fv[f*3 + j];
+                if (to == v) continue;
+                Quadric q = quadrics[v];
+                q += quadrics[to];
+                Collapse c = {q.error(verts_[to]), v, to, version[v]};
+                heap.push(c);
+            }
+        }
+    };
+    for (int v = 0; v < nverts; v++) {
+        push_candidates(v);
+    }
+
+    int alive = nfaces;
+    int target = (int)(nfaces * ratio);
+    while ((int)lods_.size() < levels && !heap.empty()) {
+        while (alive > target && !heap.empty()) {
+            Collapse c = heap.top();
+            heap.pop();
+            if (c.version != version[c.from] || locked[c.from]) continue;
+            const int from = c.from, to = c.to;
+
+            // to 必须还是 from 的邻居，并且 to 的 uv/法线是唯一的，from 的角才能直接换成 to 的属性
+            bool adjacent = false, flips = false;
+            for (int k = 0; k < (int)vfaces[from].size() && !flips; k++) {
+                int f = vfaces[from][k];
+                if (dead[f]) continue;
+                int *v = &fv[f*3];
+                if (v[0] == to || v[1] == to || v[2] == to) {
+                    adjacent = true;
+                    continue;
+                }
+                // 折叠后剩下的三角形不能翻面
+                vec3 p[3], q[3];
+                for (int j = 0; j < 3; j++) {
+                    p[j] = verts_[v[j]];
+                    q[j] = v[j] == from ? verts_[to] : p[j];
+                }
+                vec3 n0 = cross(p[1] - p[0], p[2] - p[0]);
+                vec3 n1 = cross(q[1] - q[0], q[2] - q[0]);
+                flips = n0 * n1 <= 0;
+            }
+            if (!adjacent || flips || vuv[to] < 0 || vn[to] < 0) continue;
+
+            for (int k = 0; k < (int)vfaces[from].size(); k++) {
+                int f = vfaces[from][k];
+                if (dead[f]) continue;
+                int *v = &fv[f*3];
+                if (v[0] == to || v[1] == to || v[2] == to) {
+                    // 同时包含 from 和 to 的三角形退化了
+                    dead[f] = true;
+                    alive--;
+                    continue;
+                }
+                for (int j = 0; j < 3; j++) {
+                    if (v[j] == from) {
+                        v[j] = to;
+                        fuv[f*3 + j] = vuv[to];
+                        fn [f*3 + j] = vn[to];
+                    }
+                }
+                vfaces[to].push_back(f);
+            }
+            vfaces[from].clear();
+            quadrics[to] += quadrics[from];
+            locked[from] = true; // 已经被折叠掉了
+
+            // to 和它的邻居的候选都要重新计算
+            std::vector<int> touched(1, to);
+            for (int k = 0; k < (int)vfaces[to].size(); k++) {
+                int f = vfaces[to][k];
+                if (dead[f]) continue;
+                for (int j = 0; j < 3; j++) touched.push_back(fv[f*3 + j]);
+            }
+            std::sort(touched.begin(), touched.end());
+            touched.erase(std::unique(touched.begin(), touched.end()), touched.end());
+            for (int k = 0; k < (int)touched.size(); k++) {
+                version[touched[k]]++;
+                push_candidates(touched[k]);
+            }
+        }
+
+        // 保存一级 LOD
+        std::vector<std::vector<vec3> > level;
+        for (int i = 0; i < nfaces; i++) {
+            if (dead[i]) continue;
+            std::vector<vec3> f(3);
+            for (int j = 0; j < 3; j++) {
+                f[j] = vec3(fv[i*3 + j], fuv[i*3 + j], fn[i*3 + j]);
+            }
+            level.push_back(f);
+        }
+        // 简化不动了（剩下的都是锁定的顶点），就不再继续生成
+        if (!lods_.empty() && level.size() == lods_.back().size()) break;
+        std::cerr << "lod " << lods_.size() + 1 << " f# " << level.size() << std::endl;
+        lods_.push_back(level);
+        target = (int)(alive * ratio);
+    }
+}
+
+int Model::nlods() {
+    return (int)lods_.size() + 1;
+}
+
+int Model::lod() {
+    return lod_;
+}
+
+void Model::set_lod(const int level) {
+    lod_ = std::max(0, std::min(level, (int)lods_.size()));
+}
+
+int Model::lod_nfaces(const int level) {
+    return (int)(level ? lods_[level - 1].size() : faces_.size());
+}
+
+/////////////////////////////////////////////////////////////////////////////////
+// 顶点缓存优化，参考 Tom Forsyth 的 Linear-Speed Vertex Cache Optimisation
+
+// 顶点的分数：在缓存里越靠前分数越高，剩下的三角形越少分数越高（尽快把它用完）
+static float forsyth_score(const int cache_pos, const int remaining) {
+    if (remaining == 0) return -1.f;
+    float score = 0.f;
+    if (cache_pos >= 0) {
+        if (cache_pos < 3) {
+            // 刚用过的三角形的三个顶点，分数固定，避免总是选相邻的三角形造成长条
+            score = .75f;
+        } else {
+            score = std::pow(1.f - (cache_pos - 3) / float(VERTEX_CACHE_SIZE - 3), 1.5f);
+        }
+    }
+    return score + 2.f * std::pow((float)remaining, -.5f);
+}
+
+// 访问一次 LRU 缓存里的顶点 v（最近用过的在前面），没命中时返回 true
+static bool lru_touch(std::vector<int> &cache, const int v, const int cache_size) {
+    std::vector<int>::iterator it = std::find(cache.begin(), cache.end(), v);
+    const bool miss = it == cache.end();
+    if (miss) {
+        if ((int)cache.size() < cache_size) cache.push_back(v);
+        it = cache.end() - 1;
+        *it = v;
+    }
+    std::rotate(cache.begin(), it, it + 1);
+    return miss;
+}
+
+double Model::acmr(const int cache_size) {
+    std::vector<int> cache;
+    long misses = 0;
+    for (int i = 0; i < (int)faces_.size(); i++) {
+        for (int j = 0; j < 3; j++) misses += lru_touch(cache, vert_index(i, j), cache_size);
+    }
+    return faces_.empty() ? 0 : misses / (double)faces_.size();
+}
+
+// Tipsify 的第二步：缓存顺序切成块的条件，块里的 ACMR 降到 TIPSIFY_LAMBDA 以下就可以切
+// 越小块越大、越接近纯缓存顺序，越大块越小、越能按遮挡排序
+const double TIPSIFY_LAMBDA = .7;
+const int TIPSIFY_MIN_CLUSTER = 16;
+
+// 把按缓存优化好的 order 切成块，块内保持原顺序，块之间按遮挡潜力从大到小排：
+// 块的中心离网格中心越远、法线越朝外，越可能挡住别的块，先画它，后面被挡住的片元会被深度测试拒绝
+// 和视角无关，对凸的、朝外的表面最有效
+void Model::sort_clusters(std::vector<int> &order) {
+    const int nfaces = (int)order.size();
+    std::vector<int> starts;
+    std::vector<int> cache;
+    long misses = 0;
+    for (int i = 0, start = 0; i < nfaces; i++) {
+        if (i == 0 || (i - start >= TIPSIFY_MIN_CLUSTER && misses <= TIPSIFY_LAMBDA * (i - start))) {
+            starts.push_back(i);
+            start = i;
+            misses = 0;
+            cache.clear();
+        }
+        for (int j = 0; j < 3; j++) misses += lru_touch(cache, vert_index(order[i], j), VERTEX_CACHE_SIZE);
+    }
+    starts.push_back(nfaces);
+
+    // 面积加权的中心和法线
+    const int nclusters = (int)starts.size() - 1;
+    std::vector<vec3> centers(nclusters), normals(nclusters);
+    vec3 mesh_center(0, 0, 0);
+    double mesh_area = 0;
+    for (int c = 0; c < nclusters; c++) {
+        vec3 center(0, 0, 0), normal(0, 0, 0);
+        double area = 0;
+        for (int i = starts[c]; i < starts[c + 1]; i++) {
+            const vec3 a = vert(vert_index(order[i], 0)), b = vert(vert_index(order[i], 1)), d = vert(vert_index(order[i], 2));
+            const vec3 n = cross(b - a, d - a);
+            const double s = n.norm() / 2;
+            center = center + (a + b + d) * (s / 3);
+            normal = normal + n;
+            area += s;
+        }
+        mesh_center = mesh_center + center;
+        mesh_area += area;
+        centers[c] = area > 0 ? center / area : center;
+        normals[c] = normal.norm() > 0 ? normal.normalize() : normal;
+    }
+    if (mesh_area > 0) mesh_center = mesh_center / mesh_area;
+
+    std::vector<std::pair<double, int> > keys(nclusters);
+    for (int c = 0; c < nclusters; c++) keys[c] = std::make_pair(-((centers[c] - mesh_center) * normals[c]), c);
+    std::stable_sort(keys.begin(), keys.end());
+    std::vector<int> sorted;
+    sorted.reserve(nfaces);
+    for (int k = 0; k < nclusters; k++) {
+        const int c = keys[k].second;
+        sorted.insert(sorted.end(), order.begin() + starts[c], order.begin() + starts[c + 1]);
+    }
+    order.swap(sorted);
+}
+
+void Model::optimize_vertex_cache() {
+    if (compressed_) {
+        std::cerr << "optimize_vertex_cache must be called before compress_vertices" << std::endl;
+        return;
+    }
+    const int nfaces = (int)faces_.size();
+    const int nverts = (int)verts_.size();
+    const double before = acmr();
+
+    // 顶点 -> 三角形（CSR）
+    std::vector<int> remaining(nverts, 0);
+    for (int i = 0; i < nfaces; i++)
+        for (int j = 0; j < 3; j++) remaining[vert_index(i, j)]++;
+    std::vector<int> vstart(nverts + 1, 0);
+    for (int v = 0; v < nverts; v++) vstart[v + 1] = vstart[v] + remaining[v];
+    std::vector<int> vfaces(vstart.back());
+    std::vector<int> fill(vstart.begin(), vstart.end() - 1);
+    for (int i = 0; i < nfaces; i++)
+        for (int j = 0; j < 3; j++) vfaces[fill[vert_index(i, j)]++] = i;
+
+    std::vector<int> cache_pos(nverts, -1);
+    std::vector<float> vscore(nverts);
+    for (int v = 0; v < nverts; v++) vscore[v] = forsyth_score(-1, remaining[v]);
+    std::vector<float> fscore(nfaces);
+    for (int i = 0; i < nfaces; i++)
+        fscore[i] = vscore[vert_index(i, 0)] + vscore[vert_index(i, 1)] + vscore[vert_index(i, 2)];
+
+    std::vector<bool> emitted(nfaces, false);
+    std::vector<int> order;
+    order.reserve(nfaces);
+    std::vector<int> cache; // LRU，最近用过的在前面
+    int best = -1;
+    int scan = 0;           // 缓存里找不到候选时，从这里开始线性找下一个没输出的三角形
+    while ((int)order.size() < nfaces) {
+        if (best < 0) {
+            // 找不到好的候选（比如网格不连通），挑分数最高的剩余三角形
+            float best_score = -1e30f;
+            for (int i = scan; i < nfaces; i++) {
+                if (!emitted[i] && fscore[i] > best_score) {
+                    best_score = fscore[i];
+                    best = i;
+                }
+            }
+            while (scan < nfaces && emitted[scan]) scan++;
+        }
+        emitted[best] = true;
+        order.push_back(best);
+
+        // 更新 LRU 缓存：三个顶点移到最前面
+        std::vector<int> next;
+        for (int j = 0; j < 3; j++) {
+            int v = vert_index(best, j);
+            next.push_back(v);
+            remaining[v]--;
+            for (int k = vstart[v]; k < vstart[v + 1]; k++) {
+                if (vfaces[k] == best) {
+                    std::swap(vfaces[k], vfaces[vstart[v] + remaining[v]]);
+                    break;
+                }
+            }
+        }
+        for (int k = 0; k < (int)cache.size(); k++) {
+            if (std::find(next.begin(), next.end(), cache[k]) == next.end()) next.push_back(cache[k]);
+        }
+        // 被挤出缓存的顶点
+        for (int k = VERTEX_CACHE_SIZE; k < (int)next.size(); k++) {
+            cache_pos[next[k]] = -1;
+        }
+        next.resize(std::min((int)next.size(), VERTEX_CACHE_SIZE + 3));
+        cache.swap(next);
+
+        // 重新计算缓存里顶点的分数，以及它们的三角形的分数，顺便找下一个最好的三角形
+        for (int k = 0; k < (int)cache.size(); k++) {
+            int v = cache[k];
+            cache_pos[v] = k < VERTEX_CACHE_SIZE ? k : -1;
+            float score = forsyth_score(cache_pos[v], remaining[v]);
+            float delta = score - vscore[v];
+            vscore[v] = score;
+            for (int t = vstart[v]; t < vstart[v] + remaining[v]; t++) fscore[vfaces[t]] += delta;
+        }
+        best = -1;
+        float best_score = -1e30f;
+        for (int k = 0; k < (int)cache.size(); k++) {
+            int v = cache[k];
+            for (int t = vstart[v]; t < vstart[v] + remaining[v]; t++) {
+                if (fscore[vfaces[t]] > best_score) {
+                    best_score = fscore[vfaces[t]];
+                    best = vfaces[t];
+                }
+            }
+        }
+        if (cache.size() > (size_t)VERTEX_CACHE_SIZE) cache.resize(VERTEX_CACHE_SIZE);
+    }
+
+    sort_clusters(order);
+
+    std::vector<std::vector<vec3> > faces(nfaces);
+    for (int i = 0; i < nfaces; i++) faces[i] = faces_[order[i]];
+    faces_.swap(faces);
+
+    // 顶点、uv、法线数组按第一次被使用的顺序重排，顺序访问三角形时内存访问也是顺序的
+    for (int k = 0; k < 3; k++) {
+        const int n = k == 0 ? nverts : (k == 1 ? (int)uv_.size() : (int)norms_.size());
+        std::vector<int> remap(n, -1);
+        int next = 0;
+        for (int i = 0; i < nfaces; i++)
+            for (int j = 0; j < 3; j++) {
+                int idx = (int)faces_[i][j][k];
+                if (remap[idx] < 0) remap[idx] = next++;
+                faces_[i][j][k] = remap[idx];
+            }
+        // 没被任何三角形用到的放在最后
+        for (int i = 0; i < n; i++) if (remap[i] < 0) remap[i] = next++;
+        if (k == 0) {
+            std::vector<vec3> verts(n);
+            for (int i = 0; i < n; i++) verts[remap[i]] = verts_[i];
+            verts_.swap(verts);
+        } else if (k == 1) {
+            std::vector<vec2> uv(n);
+            for (int i = 0; i < n; i++) uv[remap[i]] = uv_[i];
+            uv_.swap(uv);
+        } else {
+            std::vector<vec3> norms(n);
+            for (int i = 0; i < n; i++) norms[remap[i]] = norms_[i];
+            norms_.swap(norms);
+        }
+    }
+
+    lods_.clear();
+    lod_ = 0;
+    build_meshlets();
+    std::cerr << "vertex cache ACMR " << before << " -> " << acmr() << " (LRU " << VERTEX_CACHE_SIZE << ")" << std::endl;
+}
+
+/////////////////////////////////////////////////////////////////////////////////
+// 顶点属性量化：位置按包围盒量化成 16 位，法线用八面体映射压缩成两个 16 位，uv 量化成 16 位
+
+// 把 [-1, 1] 的浮点数转成 16 位有符号整数，存进无符号整数的高/低 16 位
+static unsigned int pack_snorm16x2(const double x, const double y) {
+    int qx = (int)std::lround(std::max(-1., std::min(1., x)) * 32767.);
+    int qy = (int)std::lround(std::max(-1., std::min(1., y)) * 32767.);
+    return ((unsigned int)(qx & 0xffff) << 16) | (unsigned int)(qy & 0xffff);
+}
+
+static double sign_not_zero(const double v) {
+    return v < 0 ? -1. : 1.;
+}
+
+// 八面体映射：单位球面投影到八面体 |x|+|y|+|z|=1 上，下半球折到上半球的外侧，再展开成正方形
+static unsigned int encode_octahedral(vec3 n) {
+    n = n / (std::abs(n.x) + std::abs(n.y) + std::abs(n.z));
+    double x = n.x, y = n.y;
+    if (n.z < 0) {
+        x = (1. - std::abs(n.y)) * sign_not_zero(n.x);
+        y = (1. - std::abs(n.x)) * sign_not_zero(n.y);
+    }
+    return pack_snorm16x2(x, y);
+}
+
+vec3 Model::decode_vert(const int i) {
+    const unsigned short *q = &qverts_[i * 3];
+    return vec3(qvert_offset_.x + q[0] * qvert_scale_.x, qvert_offset_.y + q[1] * qvert_scale_.y, qvert_offset_.z + q[2] * qvert_scale_.z);
+}
+
+vec3 Model::decode_normal(const int i) {
+    const unsigned int q = qnorms_[i];
+    double x = (short)(q >> 16) / 32767.;
+    double y = (short)(q & 0xffff) / 32767.;
+    vec3 n(x, y, 1. - std::abs(x) - std::abs(y));
+    if (n.z < 0) {
+        n.x = (1. - std::abs(y)) * sign_not_zero(x);
+        n.y = (1. - std::abs(x)) * sign_not_zero(y);
+    }
+    return n.normalize();
+}
+
+vec2 Model::decode_uv(const int i) {
+    return vec2(quv_offset_.x + quv_[i*2] * quv_scale_.x, quv_offset_.y + quv_[i*2 + 1] * quv_scale_.y);
+}
+
+size_t Model::vertex_bytes() {
+    if (compressed_) {
+        return qverts_.size() * sizeof(unsigned short) + qnorms_.size() * sizeof(unsigned int) + quv_.size() * sizeof(unsigned short);
+    }
+    return verts_.size() * sizeof(vec3) + norms_.size() * sizeof(vec3) + uv_.size() * sizeof(vec2);
 }
 
+size_t Model::texture_bytes() {
+    if (compressed_textures_) {
+        return diffuse_bc_.size_bytes() + normal_bc_.size_bytes() + specular_bc_.size_bytes();
+    }
+    const TGAImage *maps[3] = {diffusemap_.get(), normalmap_.get(), specularmap_.get()};
+    size_t bytes = 0;
+    for (int i = 0; i < 3; i++) {
+        bytes += (size_t)maps[i]->get_width() * maps[i]->get_height() * maps[i]->get_bytespp();
+    }
+    return bytes;
+}
+
+void Model::compress_vertices() {
+    if (compressed_ || verts_.empty()) return;
+    const size_t before = vertex_bytes();
+
+    // 位置：包围盒内均匀量化
+    vec3 bmin = verts_[0], bmax = verts_[0];
+    for (int i = 0; i < (int)verts_.size(); i++) {
+        for (int j = 0; j < 3; j++) {
+            bmin[j] = std::min(bmin[j], verts_[i][j]);
+            bmax[j] = std::max(bmax[j], verts_[i][j]);
+        }
+    }
+    qvert_offset_ = bmin;
+    for (int j = 0; j < 3; j++) qvert_scale_[j] = bmax[j] > bmin[j] ? (bmax[j] - bmin[j]) / 65535. : 0;
+    qverts_.resize(verts_.size() * 3);
+    for (int i = 0; i < (int)verts_.size(); i++) {
+        for (int j = 0; j < 3; j++) {
+            qverts_[i*3 + j] = qvert_scale_[j] > 0 ? (unsigned short)std::lround((verts_[i][j] - bmin[j]) / qvert_scale_[j]) : 0;
+        }
+    }
+
+    qnorms_.resize(norms_.size());
+    for (int i = 0; i < (int)norms_.size(); i++) {
+        qnorms_[i] = encode_octahedral(norms_[i]);
+    }
+
+    // uv 可能超出 [0, 1]（平铺的贴图），同样按包围盒量化
+    vec2 tmin(0, 0), tmax(1, 1);
+    for (int i = 0; i < (int)uv_.size(); i++) {
+        for (int j = 0; j < 2; j++) {
+            tmin[j] = std::min(tmin[j], uv_[i][j]);
+            tmax[j] = std::max(tmax[j], uv_[i][j]);
+        }
+    }
+    quv_offset_ = tmin;
+    quv_scale_ = vec2((tmax.x - tmin.x) / 65535., (tmax.y - tmin.y) / 65535.);
+    quv_.resize(uv_.size() * 2);
+    for (int i = 0; i < (int)uv_.size(); i++) {
+        for (int j = 0; j < 2; j++) {
+            quv_[i*2 + j] = (unsigned short)std::lround((uv_[i][j] - tmin[j]) / quv_scale_[j]);
+        }
+    }
+
+    // 释放原来的 double 数组
+    std::vector<vec3>().swap(verts_);
+    std::vector<vec3>().swap(norms_);
+    std::vector<vec2>().swap(uv_);
+    compressed_ = true;
+    std::cerr << "vertex data " << before << " -> " << vertex_bytes() << " bytes" << std::endl;
+}
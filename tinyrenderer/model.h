@@ -11,6 +11,20 @@
 #include <vector>
 #include "geometry.h"
 #include "tgaimage.h"
+#include "texture.h"
+
+// optimize_vertex_cache 和 acmr 模拟的 LRU 顶点缓存的大小
+const int VERTEX_CACHE_SIZE = 32;
+
+// 网格簇：一小块相邻的三角形，带包围球和法线锥，可以整块剔除
+struct Meshlet {
+    int first;          // 在 meshlet_faces 里的起始位置
+    int count;          // 三角形个数
+    vec3 center;        // 包围球
+    double radius;
+    vec3 cone_axis;     // 法线锥的轴，所有三角形法线和它的夹角都不超过 alpha
+    double cone_cutoff; // sin(alpha)，大于 1 表示法线太分散，不能做背面剔除
+};
 
 class Model {
 private:
@@ -18,24 +32,75 @@ private:
     std::vector<std::vector<vec3> > faces_; // attention, this Vec3i means vertex/uv/normal
     std::vector<vec3> norms_; // 法线
     std::vector<vec2> uv_;    // uv 贴图向量
-    TGAImage diffusemap_;      // 纹理 map
-    TGAImage normalmap_;       // 法线贴图
-    TGAImage specularmap_;     // 镜面贴图
-    void load_texture(std::string filename, const char *suffix, TGAImage &img);
+    TextureCache::Texture diffusemap_;  // 纹理 map，贴图都从 TextureCache 里共享
+    TextureCache::Texture normalmap_;   // 法线贴图
+    TextureCache::Texture specularmap_; // 镜面贴图
+    // 块压缩的贴图，compressed_textures_ 为 true 时代替上面三张贴图
+    bool compressed_textures_;
+    CompressedTexture diffuse_bc_;
+    CompressedTexture normal_bc_;
+    CompressedTexture specular_bc_;
+    vec3 bound_center_;        // 包围球球心
+    double bound_radius_;      // 包围球半径
+    std::vector<Meshlet> meshlets_;
+    std::vector<int> meshlet_faces_; // 按 meshlet 排列的三角形下标
+    std::vector<std::vector<std::vector<vec3> > > lods_; // 简化后的各级三角形，lods_[k] 是第 k+1 级
+    int lod_;                  // 当前使用的 LOD，0 是原始网格
+    const std::vector<vec3> &corners(int iface);
+    // 压缩存储的顶点属性，compressed_ 为 true 时 verts_/norms_/uv_ 是空的
+    bool compressed_;
+    std::vector<unsigned short> qverts_; // 每个顶点 3 个 16 位整数，相对包围盒
+    std::vector<unsigned int> qnorms_;   // 八面体映射后的两个 16 位有符号整数
+    std::vector<unsigned short> quv_;    // 每个 uv 2 个 16 位整数
+    vec3 qvert_offset_, qvert_scale_;
+    vec2 quv_offset_, quv_scale_;
+    vec3 decode_vert(const int i);
+    vec3 decode_normal(const int i);
+    vec2 decode_uv(const int i);
+    void sort_clusters(std::vector<int> &order); // optimize_vertex_cache 的第二步，按遮挡潜力给缓存顺序的块排序
+    std::string texture_path(std::string filename, const char *suffix);
+    void load_texture(std::string filename, const char *suffix, CompressedTexture &tex, const CompressedTexture::Format format);
+    friend class ModelStream;
 public:
-    Model(const char *filename);
+    // compressed_textures 为 true 时贴图按块压缩存储，压缩结果缓存在贴图旁边的 .bc 文件里
+    Model(const char *filename, const bool geometry=true, const bool compressed_textures=false);
     ~Model();
     int nverts();
-    int nfaces();
+    int nfaces(); // 当前 LOD 的三角形数
     vec3 normal(int iface, int nvert);
     vec3 normal(vec2 uv);
     vec3 norm(int iface, int nvert);
     vec3 vert(int i);
     vec3 vert(int iface, int nvert);
+    void verts(const int first, const int count, vec3 *out); // 批量获取顶点
+    int vert_index(int iface, int nvert);
+    vec3 bound_center();
+    double bound_radius();
     vec2 uv(int iface, int nvert);
     TGAColor diffuse(vec2 uv);
     float specular(vec2 uv);
-    std::vector<int> face(int idx);
+    void face(int idx, int *out); // 三个顶点的下标写进 out
+    void build_meshlets(const int max_triangles=64);
+    const std::vector<Meshlet> &meshlets();
+    const std::vector<int> &meshlet_faces();
+    // 生成 LOD 链，每一级的三角形数大约是上一级的 ratio 倍
+    void build_lods(const int levels=4, const double ratio=.5);
+    int nlods();                        // 包括原始网格在内的级数
+    int lod();
+    void set_lod(const int level);      // 之后的三角形访问都针对这一级
+    int lod_nfaces(const int level);
+    // 按顶点缓存的命中率重排三角形（Forsyth 算法），再把结果切成小块，块之间按遮挡潜力从外到内排序（Tipsify），
+    // 减少任意视角下被覆盖的片元；最后按第一次使用的顺序重排顶点/uv/法线数组
+    // 注意 draw_model 每个角都调用一次顶点着色器，没有变换后的顶点缓存，ACMR 只对有这种缓存的使用者有意义；
+    // 对这里的光栅化有影响的是提交顺序带来的 overdraw
+    // 会重建 meshlet，已经生成的 LOD 会被清掉，所以要在 build_lods 之前调用
+    void optimize_vertex_cache();
+    double acmr(const int cache_size=VERTEX_CACHE_SIZE); // 平均每个三角形的缓存未命中数（LRU 缓存，和优化时的模型一样）
+    // 压缩顶点属性：位置 16 位 x3、法线 32 位八面体编码、uv 16 位 x2，访问时实时解码
+    // 之后不能再调用 build_lods / optimize_vertex_cache
+    void compress_vertices();
+    size_t vertex_bytes(); // 顶点属性占用的内存
+    size_t texture_bytes(); // 贴图占用的内存
 };
 
 #endif //__MODEL_H__
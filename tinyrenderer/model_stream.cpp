@@ -0,0 +1,242 @@
+//
+//  model_stream.cpp
+//  tinyrenderer
+//
+//  Created by skychx on 2021/3/9.
+//
+
+#include <iostream>
+#include <fstream>
+#include <cstdlib>
+#include <algorithm>
+#include "model_stream.h"
+
+// 每页的记录数
+const long PAGE_RECORDS = 4096;
+
+// 解析一行里的 n 个浮点数，s 指向第一个数前面
+static void parse_floats(const char *s, float *out, const int n) {
+    char *end;
+    for (int i = 0; i < n; i++) {
+        out[i] = std::strtof(s, &end);
+        s = end;
+    }
+}
+
+// 解析 "v/vt/vn" 形式的一个角，缺省的下标记为 0；OBJ 的下标从 1 开始，
+// 负数是相对下标，从这个面之前已经读到的记录往回数，seen 是到这一行为止每种属性的记录数
+static const char *parse_corner(const char *s, const long seen[3], long idx[3]) {
+    char *end;
+    for (int k = 0; k < 3; k++) idx[k] = 0;
+    for (int k = 0; k < 3; k++) {
+        long v = std::strtol(s, &end, 10);
+        if (end != s) {
+            idx[k] = v > 0 ? v - 1 : seen[k] + v;
+        }
+        s = end;
+        if (*s != '/') break;
+        s++;
+    }
+    return s;
+}
+
+ModelStream::ModelStream(const char *filename, const size_t cache_bytes, const int chunk_faces)
+    : filename_(filename), in_(), good_(false), nfaces_(0), chunk_faces_(chunk_faces), chunk_(filename, false), line_() {
+    const int ncomp[3] = {3, 2, 3};
+    const int total = ncomp[0] + ncomp[1] + ncomp[2];
+    for (int k = 0; k < 3; k++) {
+        attribs_[k].file = std::tmpfile();
+        attribs_[k].ncomp = ncomp[k];
+        attribs_[k].count = 0;
+        // 缓存按每条记录的大小分给三种属性（3:2:3），每种至少两页
+        // 页的字节数也和记录大小成正比，所以三种属性分到的页数是一样的，加起来正好是 cache_bytes
+        const size_t bytes = cache_bytes / total * ncomp[k];
+        const size_t page_bytes = PAGE_RECORDS * ncomp[k] * sizeof(float);
+        attribs_[k].max_pages = std::max<size_t>(2, bytes / page_bytes);
+        if (!attribs_[k].file) return;
+    }
+
+    // 第一遍：顺序扫描，把顶点属性写进临时文件
+    std::ifstream in(filename, std::ifstream::in);
+    if (in.fail()) {
+        std::cerr << "can't open file " << filename << std::endl;
+        return;
+    }
+    float buf[3];
+    while (std::getline(in, line_)) {
+        const char *s = line_.c_str();
+        int k = -1;
+        if (!line_.compare(0, 2, "v "))  { k = 0; s += 2; }
+        if (!line_.compare(0, 3, "vt ")) { k = 1; s += 3; }
+        if (!line_.compare(0, 3, "vn ")) { k = 2; s += 3; }
+        if (k >= 0) {
+            parse_floats(s, buf, attribs_[k].ncomp);
+            std::fwrite(buf, sizeof(float), attribs_[k].ncomp, attribs_[k].file);
+            attribs_[k].count++;
+        } else if (!line_.compare(0, 2, "f ")) {
+            nfaces_++;
+        }
+    }
+    // 没有 uv 或法线的网格补一条默认记录，缺省的下标 0 就指向它
+    const float zero[3] = {0, 0, 1};
+    for (int k = 1; k < 3; k++) {
+        if (attribs_[k].count == 0) {
+            std::fwrite(zero + 3 - attribs_[k].ncomp, sizeof(float), attribs_[k].ncomp, attribs_[k].file);
+            attribs_[k].count = 1;
+        }
+    }
+    for (int k = 0; k < 3; k++) std::fflush(attribs_[k].file);
+    std::cerr << "# streaming v# " << attribs_[0].count << " f# " << nfaces_ << " vt# " << attribs_[1].count << " vn# " << attribs_[2].count << std::endl;
+
+    good_ = true;
+    rewind();
+}
+
+ModelStream::~ModelStream() {
+    for (int k = 0; k < 3; k++) {
+        if (attribs_[k].file) std::fclose(attribs_[k].file);
+    }
+}
+
+bool ModelStream::good() {
+    return good_;
+}
+
+long ModelStream::nfaces() {
+    return nfaces_;
+}
+
+void ModelStream::rewind() {
+    for (int k = 0; k < 3; k++) seen_[k] = 0;
+    in_.close();
+    in_.clear();
+    in_.open(filename_.c_str(), std::ifstream::in);
+}
+
+const float *ModelStream::Attribute::get(const long i) {
+    const long page = i / PAGE_RECORDS;
+    std::unordered_map<long, std::list<std::pair<long, std::vector<float> > >::iterator>::iterator it = index.find(page);
+    if (it != index.end()) {
+        // 命中：移到链表头
+        pages.splice(pages.begin(), pages, it->second);
+    } else {
+        // 未命中：淘汰最久没用过的页，复用它的内存
+        std::vector<float> data;
+        if (pages.size() >= max_pages) {
+            index.erase(pages.back().first);
+            data.swap(pages.back().second);
+            pages.pop_back();
+        }
+        const long first = page * PAGE_RECORDS;
+        const long n = std::min(PAGE_RECORDS, count - first);
+        data.resize(PAGE_RECORDS * ncomp);
+        std::fseek(file, first * ncomp * (long)sizeof(float), SEEK_SET);
+        if (std::fread(data.data(), sizeof(float), n * ncomp, file) != (size_t)(n * ncomp)) {
+            std::cerr << "can't read the vertex cache" << std::endl;
+        }
+        pages.push_front(std::make_pair(page, std::vector<float>()));
+        pages.front().second.swap(data);
+        index[page] = pages.begin();
+    }
+    return pages.front().second.data() + (i % PAGE_RECORDS) * ncomp;
+}
+
+Model *ModelStream::next_chunk() {
+    if (!good_ || !in_.is_open()) return NULL;
+
+    chunk_.verts_.clear();
+    chunk_.uv_.clear();
+    chunk_.norms_.clear();
+    chunk_.faces_.clear();
+    chunk_.lods_.clear();
+    chunk_.lod_ = 0;
+
+    // 全局下标 -> 块内下标，块内只保存用到的顶点
+    std::unordered_map<long, int> remap[3];
+    const long count[3] = {attribs_[0].count, attribs_[1].count, attribs_[2].count};
+    while ((int)chunk_.faces_.size() < chunk_faces_ && std::getline(in_, line_)) {
+        // 相对下标要知道这个面之前有多少条记录，顺着文件数一遍
+        if (!line_.compare(0, 2, "v "))  { seen_[0]++; continue; }
+        if (!line_.compare(0, 3, "vt ")) { seen_[1]++; continue; }
+        if (!line_.compare(0, 3, "vn ")) { seen_[2]++; continue; }
+        if (line_.compare(0, 2, "f ")) continue;
+
+        const char *s = line_.c_str() + 2;
+        std::vector<vec3> poly;
+        long idx[3];
+        while (*s) {
+            while (*s == ' ' || *s == '\t' || *s == '\r') s++;
+            if (!*s) break;
+            const char *next = parse_corner(s, seen_, idx);
+            if (next == s) break;
+            s = next;
+
+            vec3 corner;
+            for (int k = 0; k < 3; k++) {
+                if (idx[k] < 0 || idx[k] >= count[k]) idx[k] = 0;
+                std::unordered_map<long, int>::iterator it = remap[k].find(idx[k]);
+                int local;
+                if (it == remap[k].end()) {
+                    const float *p = attribs_[k].get(idx[k]);
+                    if (k == 0) chunk_.verts_.push_back(vec3(p[0], p[1], p[2]));
+                    if (k == 1) chunk_.uv_.push_back(vec2(p[0], p[1]));
+                    if (k == 2) chunk_.norms_.push_back(vec3(p[0], p[1], p[2]));
+                    local = (int)remap[k].size();
+                    remap[k][idx[k]] = local;
+                } else {
+                    local = it->second;
+                }
+                corner[k] = local;
+            }
+            poly.push_back(corner);
+        }
+        // 多边形按扇形拆成三角形
+        for (int j = 2; j < (int)poly.size(); j++) {
+            std::vector<vec3> f(3);
+            f[0] = poly[0];
+            f[1] = poly[j - 1];
+            f[2] = poly[j];
+            chunk_.faces_.push_back(f);
+        }
+    }
+
+    if (chunk_.faces_.empty()) {
+        in_.close();
+        return NULL;
+    }
+    // meshlet 按块内的下标划分，每块重新建一次，否则 DRAW_MESHLET_CULLING 拿到的是空列表，一个三角形都画不出来
+    chunk_.build_meshlets();
+    return &chunk_;
+}
+
+bool stream_matches_model(const char *filename) {
+    Model model(filename);
+    ModelStream stream(filename, 1 << 10, 100);
+    if (!model.nfaces() || !stream.good()) return false;
+    long face = 0, mismatches = 0;
+    double err = 0;
+    Model *chunk;
+    while ((chunk = stream.next_chunk())) {
+        for (int i = 0; i < chunk->nfaces(); i++, face++) {
+            if (face >= model.nfaces()) {
+                mismatches++;
+                continue;
+            }
+            // 流式读取的记录是 float，比较相对误差（uv 已经乘上了贴图尺寸）
+            double e = 0;
+            for (int j = 0; j < 3; j++) {
+                const vec3 v = model.vert((int)face, j), n = model.normal((int)face, j);
+                const vec2 t = model.uv((int)face, j);
+                e = std::max(e, (chunk->vert(i, j) - v).norm() / std::max(1., v.norm()));
+                e = std::max(e, (chunk->uv(i, j) - t).norm() / std::max(1., t.norm()));
+                e = std::max(e, (chunk->normal(i, j) - n).norm());
+            }
+            if (e > 1e-6) mismatches++;
+            err = std::max(err, e);
+        }
+    }
+    if (face != model.nfaces()) mismatches++;
+    const bool ok = mismatches == 0;
+    std::cerr << "stream " << filename << ": " << face << " faces, max error " << err << (ok ? "" : " FAILED") << std::endl;
+    return ok;
+}
@@ -0,0 +1,58 @@
+//
+//  model_stream.h
+//  tinyrenderer
+//
+//  Created by skychx on 2021/3/9.
+//
+
+#ifndef __MODEL_STREAM_H__
+#define __MODEL_STREAM_H__
+
+#include <cstdio>
+#include <list>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "model.h"
+
+// 流式读取比内存还大的 OBJ 文件
+// 第一遍扫描时把 v/vt/vn 写进临时的二进制文件，之后按块读取三角形，
+// 三角形引用到的顶点从临时文件里按页读取，页用 LRU 缓存，所以内存占用和网格大小无关
+class ModelStream {
+public:
+    // cache_bytes 是顶点缓存的上限，chunk_faces 是每一块最多的三角形数
+    ModelStream(const char *filename, const size_t cache_bytes=64 << 20, const int chunk_faces=1 << 16);
+    ~ModelStream();
+    bool good();
+    void rewind();       // 回到第一个三角形，开始新的一遍绘制
+    Model *next_chunk(); // 读入下一块三角形，读完了返回 NULL；返回的 Model 在下一次调用前有效
+    long nfaces();       // 第一遍扫描统计出的三角形数
+
+private:
+    // 一种顶点属性（位置、uv 或法线）：临时文件 + 按页的 LRU 缓存
+    struct Attribute {
+        FILE *file;
+        int ncomp;       // 每个记录的 float 个数
+        long count;      // 记录数
+        size_t max_pages;
+        std::list<std::pair<long, std::vector<float> > > pages; // 最近用过的页在前面
+        std::unordered_map<long, std::list<std::pair<long, std::vector<float> > >::iterator> index;
+        const float *get(const long i);
+    };
+
+    std::string filename_;
+    std::ifstream in_;
+    bool good_;
+    long nfaces_;
+    int chunk_faces_;
+    Attribute attribs_[3]; // 位置、uv、法线
+    long seen_[3];         // 第二遍读到当前行为止每种属性的记录数，用来解析相对下标
+    Model chunk_;
+    std::string line_;
+};
+
+// 用很小的缓存和块流式读取 filename，逐个三角形和整个加载进内存的 Model 比较位置、uv 和法线
+// 文件里的面要是三角形，每个角都写全 v/vt/vn；结果写到 std::cerr，全部一致时返回 true
+bool stream_matches_model(const char *filename);
+
+#endif //__MODEL_STREAM_H__
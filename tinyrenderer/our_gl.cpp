@@ -5,11 +5,126 @@
 //  Created by skychx on 2020/12/6.
 //
 
+#include <cassert>
+#include <algorithm>
 #include "our_gl.h"
 
-mat<4,4> ModelView;
-mat<4,4> Projection;
-mat<4,4> Viewport;
+// 绘制状态都是线程局部的，不同线程可以同时绘制不同的画面
+thread_local mat<4,4> ModelView;
+thread_local mat<4,4> Projection;
+thread_local mat<4,4> Viewport;
+
+thread_local RasterStats raster_stats = RasterStats();
+
+void add_raster_stats(RasterStats &to, const RasterStats &from) {
+    to.triangles        += from.triangles;
+    to.shaded_fragments += from.shaded_fragments;
+    to.small_triangles  += from.small_triangles;
+    to.span_triangles   += from.span_triangles;
+    to.block_triangles  += from.block_triangles;
+    to.blocks_accepted  += from.blocks_accepted;
+    to.blocks_partial   += from.blocks_partial;
+    to.blocks_rejected  += from.blocks_rejected;
+}
+
+static thread_local int band_index = 0;
+static thread_local int band_count = 1;
+// 条带由整行的快速清除 tile 组成，第一次写 tile 时填满它的线程就是唯一会写这个 tile 的线程
+static_assert(RASTER_BAND_ROWS % TGAImage::CLEAR_TILE == 0, "raster bands must cover whole clear tiles");
+
+void raster_band(const int index, const int count) {
+    assert(count >= 1 && index >= 0 && index < count);
+    band_index = index;
+    band_count = count;
+}
+
+static inline bool owns_row(const int y) {
+    return band_count == 1 || (y / RASTER_BAND_ROWS) % band_count == band_index;
+}
+
+bool band_overlaps(const int ymin, const int ymax, const int index, const int count) {
+    const int b0 = ymin / RASTER_BAND_ROWS, b1 = ymax / RASTER_BAND_ROWS;
+    if (b1 - b0 + 1 >= count) return true;
+    for (int b = b0; b <= b1; b++) {
+        if (b % count == index) return true;
+    }
+    return false;
+}
+static thread_local DepthFunc depth_test = DEPTH_GEQUAL;
+
+void depth_func(const DepthFunc func) {
+    depth_test = func;
+}
+
+static thread_local int *id_buffer = NULL;
+static thread_local int current_id = 0;
+
+void primitive_ids(int *ids) {
+    id_buffer = ids;
+}
+
+void primitive_id(const int id) {
+    current_id = id;
+}
+
+// DEPTH_EQUAL 时片元是否就是 Z-prepass 里最终留下的那个
+static inline bool depth_rejects(const int zvalue, const int depth, const int x, const int y, const int width) {
+    if (zvalue > depth) return true;
+    if (depth_test != DEPTH_EQUAL) return false;
+    return zvalue != depth || (id_buffer && id_buffer[x + (size_t)y * width] != current_id);
+}
+
+// 三角形的分类阈值
+static const int SMALL_TRIANGLE_PIXELS = 64; // 包围盒不超过这么多像素的走逐像素路径
+static const int RASTER_BLOCK = 8;           // 大三角形按 8x8 的块遍历
+
+static thread_local int coarse_rate = 1;
+static thread_local const TGAImage *rate_map = NULL;
+
+void shading_rate(const int rate) {
+    assert(rate == 1 || rate == 2 || rate == 4);
+    coarse_rate = rate;
+}
+
+int shading_rate() {
+    return coarse_rate;
+}
+
+void shading_rate_image(const TGAImage *rate_image) {
+    rate_map = rate_image;
+}
+
+static thread_local int scissor_rect[4] = {0, 0, 0, 0};
+
+void scissor(const int x, const int y, const int w, const int h) {
+    scissor_rect[0] = x;
+    scissor_rect[1] = y;
+    scissor_rect[2] = std::max(0, w);
+    scissor_rect[3] = std::max(0, h);
+}
+
+static thread_local std::vector<unsigned char> *tile_mask = NULL;
+
+void track_tiles(std::vector<unsigned char> *mask) {
+    tile_mask = mask;
+}
+
+RasterState raster_state() {
+    RasterState state = {ModelView, Projection, Viewport, depth_test, coarse_rate, rate_map,
+                         {scissor_rect[0], scissor_rect[1], scissor_rect[2], scissor_rect[3]}, id_buffer};
+    return state;
+}
+
+void raster_state(const RasterState &state) {
+    ModelView  = state.model_view;
+    Projection = state.projection;
+    Viewport   = state.viewport;
+    depth_test = state.depth;
+    coarse_rate = state.rate;
+    rate_map   = state.rate_image;
+    scissor(state.scissor[0], state.scissor[1], state.scissor[2], state.scissor[3]);
+    id_buffer  = state.ids;
+}
 
 
 // 计算 ModelView 矩阵，实现坐标系的转换
@@ -80,47 +195,526 @@ vec3 barycentric(vec2 A, vec2 B, vec2 C, vec2 P) {
     return vec3(-1, 1, 1);
 }
 
+// 三角形的屏幕空间数据
+// triangle() 和 triangle_depth() 共用同一份 setup，保证两者算出的覆盖范围和深度完全一致（Z-prepass 依赖这一点）
+struct TriangleSetup {
+    vec3 c0, dcdx, dcdy;        // 重心坐标是屏幕坐标的线性函数：c(P) = c0 + P.x * dcdx + P.y * dcdy
+    int xmin, xmax, ymin, ymax; // 裁剪到图片范围后的包围盒
+    double area;                // 三角形的面积（像素）
+};
+
+// 预计算重心坐标的增量，公式和 barycentric() 一致，只是把对 P 的依赖拆出来
+// 返回 false 表示三角形退化或者完全在图片外
+static bool setup_triangle(const vec4 *pts, const int width, const int height, TriangleSetup &ts) {
+    vec2 A = proj<2>(pts[0] / pts[0][3]);
+    vec2 B = proj<2>(pts[1] / pts[1][3]);
+    vec2 C = proj<2>(pts[2] / pts[2][3]);
+
+    double uz = (C.x - A.x) * (B.y - A.y) - (B.x - A.x) * (C.y - A.y);
+    if (std::abs(uz) <= 1e-2) {
+        return false;
+    }
+
+    // u.x = (B.x - A.x) * (A.y - P.y) - (A.x - P.x) * (B.y - A.y)
+    // u.y = (A.x - P.x) * (C.y - A.y) - (C.x - A.x) * (A.y - P.y)
+    vec3 ux((B.x - A.x) * A.y - A.x * (B.y - A.y), B.y - A.y, -(B.x - A.x));
+    vec3 uy(A.x * (C.y - A.y) - (C.x - A.x) * A.y, -(C.y - A.y), C.x - A.x);
+    // 重心坐标 (1 - (u.x + u.y) / u.z, u.y / u.z, u.x / u.z)，ux/uy 的三项分别是常数项、x 系数、y 系数
+    ts.c0   = vec3(1. - (ux.x + uy.x) / uz, uy.x / uz, ux.x / uz);
+    ts.dcdx = vec3(   -(ux.y + uy.y) / uz, uy.y / uz, ux.y / uz);
+    ts.dcdy = vec3(   -(ux.z + uy.z) / uz, uy.z / uz, ux.z / uz);
+
+    double boxmin[2] = {std::min(A.x, std::min(B.x, C.x)), std::min(A.y, std::min(B.y, C.y))};
+    double boxmax[2] = {std::max(A.x, std::max(B.x, C.x)), std::max(A.y, std::max(B.y, C.y))};
+    // 这里注意要强制指定 int 类型，不然 P 坐标转为浮点数时绘制会出现边界着色失败的现象
+    ts.xmin = std::max(0, (int)boxmin[0]);
+    ts.ymin = std::max(0, (int)boxmin[1]);
+    ts.xmax = std::min(width  - 1, (int)boxmax[0]);
+    ts.ymax = std::min(height - 1, (int)boxmax[1]);
+    if (scissor_rect[2] > 0 && scissor_rect[3] > 0) {
+        ts.xmin = std::max(ts.xmin, scissor_rect[0]);
+        ts.ymin = std::max(ts.ymin, scissor_rect[1]);
+        ts.xmax = std::min(ts.xmax, scissor_rect[0] + scissor_rect[2] - 1);
+        ts.ymax = std::min(ts.ymax, scissor_rect[1] + scissor_rect[3] - 1);
+    }
+    ts.area = std::abs(uz) / 2.;
+    return ts.xmin <= ts.xmax && ts.ymin <= ts.ymax;
+}
+
+bool triangle_rows(const vec4 *pts, const int width, const int height, int &ymin, int &ymax) {
+    TriangleSetup ts;
+    if (!setup_triangle(pts, width, height, ts)) {
+        return false;
+    }
+    ymin = ts.ymin;
+    ymax = ts.ymax;
+    return true;
+}
+
+// 某一行起点的重心坐标，行内按 dcdx 递增
+static inline vec3 row_start(const TriangleSetup &ts, const int y) {
+    return ts.c0 + ts.dcdy * y;
+}
+
+// 根据重心坐标插值出 [0, 255] 的深度值
+static inline int frag_depth(const vec4 *pts, const vec3 &c) {
+    float z = pts[0][2] * c.x + pts[1][2] * c.y + pts[2][2] * c.z;
+    float w = pts[0][3] * c.x + pts[1][3] * c.y + pts[2][3] * c.z;
+    return std::max(0, std::min(255, int(z/w + .5)));
+}
+
+// 透视校正的 varying 插值：v/w 和 1/w 在屏幕空间里是线性的，每个三角形算一次它们的平面方程
+// 片元的 varying = (v/w)(P) / (1/w)(P)，w 是顶点裁剪空间的 w（pts[i][3]）
+struct VaryingSetup {
+    int n;                                 // 最后一个平面（下标 n）是 1/w
+    double a0[MAX_VARYINGS + 1], dx[MAX_VARYINGS + 1], dy[MAX_VARYINGS + 1];
+};
+
+static void setup_varyings(const vec4 *pts, const TriangleSetup &ts, const IVaryingShader &shader, VaryingSetup &vs) {
+    assert(shader.nvaryings <= MAX_VARYINGS);
+    vs.n = shader.nvaryings;
+    for (int k = 0; k <= vs.n; k++) {
+        double q[3];
+        for (int i = 0; i < 3; i++) q[i] = (k < vs.n ? shader.varying[i][k] : 1.) / pts[i][3];
+        vs.a0[k] = q[0] * ts.c0.x   + q[1] * ts.c0.y   + q[2] * ts.c0.z;
+        vs.dx[k] = q[0] * ts.dcdx.x + q[1] * ts.dcdx.y + q[2] * ts.dcdx.z;
+        vs.dy[k] = q[0] * ts.dcdy.x + q[1] * ts.dcdy.y + q[2] * ts.dcdy.z;
+    }
+}
+
+// 某一行起点的平面值，之后每行加 dy
+static inline void row_varyings(const VaryingSetup &vs, const int y, double *row) {
+    for (int k = 0; k <= vs.n; k++) row[k] = vs.a0[k] + vs.dy[k] * y;
+}
+
+static inline void pixel_varyings(const VaryingSetup &vs, const double *row, const double x, float *out) {
+    const double w = 1. / (row[vs.n] + vs.dx[vs.n] * x);
+    for (int k = 0; k < vs.n; k++) out[k] = (float)((row[k] + vs.dx[k] * x) * w);
+}
+
+// 屏幕上任意一点的 varying（粗粒度着色和 MSAA 的着色点不在整数像素上）
+static inline void point_varyings(const VaryingSetup &vs, const double x, const double y, float *out) {
+    double row[MAX_VARYINGS + 1];
+    row_varyings(vs, 0, row);
+    for (int k = 0; k <= vs.n; k++) row[k] += vs.dy[k] * y;
+    pixel_varyings(vs, row, x, out);
+}
+
+// 调用片元着色器，支持 varying 的着色器先插值
+static inline bool shade(IShader &shader, IVaryingShader *vshader, const VaryingSetup &vs, const vec3 &bar, const double x, const double y, TGAColor &color) {
+    if (!vshader) {
+        return shader.fragment(bar, color);
+    }
+    float varyings[MAX_VARYINGS];
+    point_varyings(vs, x, y, varyings);
+    return vshader->fragment(bar, varyings, color);
+}
+
+// 某个 4x4 tile 的着色率
+static inline int tile_rate(const int tx, const int ty) {
+    if (!rate_map) return coarse_rate;
+    int v = rate_map->get(tx >> 2, ty >> 2)[0];
+    if (v == 0) return coarse_rate;
+    return v >= 4 ? 4 : (v >= 2 ? 2 : 1);
+}
+
+// 粗粒度着色的光栅化：按对齐的 4x4 tile 遍历，tile 内再按着色率分成 r x r 的块
+// 块里被覆盖且通过深度测试的像素共用一次着色，着色点取这些像素重心坐标的平均值，保证落在三角形内
+static void triangle_coarse(vec4 *pts, const TriangleSetup &ts, IShader &shader, IVaryingShader *vshader, const VaryingSetup &vs, TGAImage &image, TGAImage &zbuffer) {
+    TGAColor color;
+    int xs[16], ys[16], depths[16];
+    for (int ty = ts.ymin & ~3; ty <= ts.ymax; ty += 4) {
+        if (!owns_row(ty)) continue; // 条带高度是 4 的倍数，整个 tile 属于同一条带
+        for (int tx = ts.xmin & ~3; tx <= ts.xmax; tx += 4) {
+            const int r = tile_rate(tx, ty);
+            for (int by = ty; by < ty + 4; by += r) {
+                for (int bx = tx; bx < tx + 4; bx += r) {
+                    int n = 0;
+                    vec3 sum(0, 0, 0);
+                    int sumx = 0, sumy = 0;
+                    for (int y = std::max(by, ts.ymin); y < std::min(by + r, ts.ymax + 1); y++) {
+                        vec3 crow = row_start(ts, y);
+                        for (int x = std::max(bx, ts.xmin); x < std::min(bx + r, ts.xmax + 1); x++) {
+                            vec3 c = crow + ts.dcdx * x;
+                            if (c.x < 0 || c.y < 0 || c.z < 0) {
+                                continue;
+                            }
+                            int depth = frag_depth(pts, c);
+                            int zvalue = zbuffer.get(x, y)[0];
+                            if (depth_rejects(zvalue, depth, x, y, zbuffer.get_width())) {
+                                continue;
+                            }
+                            xs[n] = x;
+                            ys[n] = y;
+                            depths[n] = depth;
+                            sum = sum + c;
+                            sumx += x;
+                            sumy += y;
+                            n++;
+                        }
+                    }
+                    if (!n) continue;
+
+                    raster_stats.shaded_fragments++;
+                    if (shade(shader, vshader, vs, sum / n, (double)sumx / n, (double)sumy / n, color)) continue;
+                    for (int i = 0; i < n; i++) {
+                        zbuffer.set(xs[i], ys[i], TGAColor(depths[i]));
+                        image.set(xs[i], ys[i], color);
+                        shader.store(xs[i], ys[i]);
+                    }
+                }
+            }
+        }
+    }
+}
+
+// 逐像素的深度测试和着色，几种遍历方式共用
+struct FragmentContext {
+    vec4 *pts;
+    IShader &shader;
+    IVaryingShader *vshader;
+    const VaryingSetup &vs;
+    TGAImage &image;
+    TGAImage &zbuffer;
+    TGAColor color;
+};
+
+// vrow 是这一行的 varying 平面值（row_varyings），没有 varying 时不会被读
+static inline void shade_pixel(FragmentContext &fc, const int x, const int y, const vec3 &c, const double *vrow) {
+    // zbuffer 里存的是离屏幕最近的深度，比它远的像素会被挡住
+    // DEPTH_EQUAL 时 zbuffer 已经是最终深度（Z-prepass），只有恰好可见的片元才着色
+    int depth = frag_depth(fc.pts, c);
+    int zvalue = fc.zbuffer.get(x, y)[0];
+    if (depth_rejects(zvalue, depth, x, y, fc.zbuffer.get_width())) {
+        return;
+    }
+
+    raster_stats.shaded_fragments++;
+    bool discard;
+    if (fc.vshader) {
+        float varyings[MAX_VARYINGS];
+        pixel_varyings(fc.vs, vrow, x, varyings);
+        discard = fc.vshader->fragment(c, varyings, fc.color);
+    } else {
+        discard = fc.shader.fragment(c, fc.color);
+    }
+    if (!discard) {
+        fc.zbuffer.set(x, y, TGAColor(depth));
+        fc.image.set(x, y, fc.color);
+        fc.shader.store(x, y);
+    }
+}
+
+// 对 [x0, x1] 这一段像素做覆盖测试和着色；test 为 false 时已知整段都在三角形内
+static inline void raster_row(FragmentContext &fc, const TriangleSetup &ts, const int y, const int x0, const int x1, const bool test) {
+    if (!owns_row(y)) {
+        return;
+    }
+    vec3 crow = row_start(ts, y);
+    double vrow[MAX_VARYINGS + 1];
+    if (fc.vshader) {
+        row_varyings(fc.vs, y, vrow);
+    }
+    for (int x = x0; x <= x1; x++) {
+        // c 是根据三个顶点坐标计算出的重心坐标
+        vec3 c = crow + ts.dcdx * x;
+        // 重心坐标某一项小于 0，说明在三角形外，跳过不绘制
+        if (test && (c.x < 0 || c.y < 0 || c.z < 0)) {
+            continue;
+        }
+        shade_pixel(fc, x, y, c, vrow);
+    }
+}
+
+// 小三角形：包围盒只有几个像素，逐个测试比任何额外的 setup 都便宜
+static void raster_bbox(FragmentContext &fc, const TriangleSetup &ts) {
+    for (int y = ts.ymin; y <= ts.ymax; y++) {
+        raster_row(fc, ts, y, ts.xmin, ts.xmax, true);
+    }
+}
+
+// 细长的三角形：每一行解析地求出三条边界之间的区间，只遍历这一段
+// 区间两端各放宽一个像素，仍然逐像素测试，保证覆盖结果和 triangle_depth 完全一致
+static void raster_spans(FragmentContext &fc, const TriangleSetup &ts) {
+    for (int y = ts.ymin; y <= ts.ymax; y++) {
+        vec3 crow = row_start(ts, y);
+        double lo = ts.xmin, hi = ts.xmax;
+        bool empty = false;
+        for (int k = 0; k < 3; k++) {
+            // c_k(x) = crow[k] + dcdx[k] * x >= 0
+            if (ts.dcdx[k] > 0) {
+                lo = std::max(lo, -crow[k] / ts.dcdx[k]);
+            } else if (ts.dcdx[k] < 0) {
+                hi = std::min(hi, -crow[k] / ts.dcdx[k]);
+            } else if (crow[k] < 0) {
+                empty = true;
+            }
+        }
+        if (empty || lo > hi + 1) continue;
+        const int x0 = std::max(ts.xmin, (int)std::ceil(lo) - 1);
+        const int x1 = std::min(ts.xmax, (int)std::floor(hi) + 1);
+        raster_row(fc, ts, y, x0, x1, true);
+    }
+}
+
+// 大三角形：按 8x8 的块遍历，用块四个角上的重心坐标判断整块在外面（跳过）还是整块在里面（不用逐像素测试）
+// 重心坐标是线性函数，块内的极值一定在角上；留一点余量，避免浮点误差让边界像素和 triangle_depth 不一致
+static void raster_blocks(FragmentContext &fc, const TriangleSetup &ts) {
+    const double eps = 1e-9;
+    for (int by = ts.ymin; by <= ts.ymax; by += RASTER_BLOCK) {
+        const int y1 = std::min(by + RASTER_BLOCK - 1, ts.ymax);
+        for (int bx = ts.xmin; bx <= ts.xmax; bx += RASTER_BLOCK) {
+            const int x1 = std::min(bx + RASTER_BLOCK - 1, ts.xmax);
+            vec3 corners[4] = {
+                row_start(ts, by) + ts.dcdx * bx, row_start(ts, by) + ts.dcdx * x1,
+                row_start(ts, y1) + ts.dcdx * bx, row_start(ts, y1) + ts.dcdx * x1
+            };
+            bool outside = false, inside = true;
+            for (int k = 0; k < 3; k++) {
+                double cmin = corners[0][k], cmax = corners[0][k];
+                for (int i = 1; i < 4; i++) {
+                    cmin = std::min(cmin, corners[i][k]);
+                    cmax = std::max(cmax, corners[i][k]);
+                }
+                outside |= cmax < -eps;
+                inside &= cmin > eps;
+            }
+            if (outside) {
+                raster_stats.blocks_rejected++;
+                continue;
+            }
+            if (inside) {
+                raster_stats.blocks_accepted++;
+            } else {
+                raster_stats.blocks_partial++;
+            }
+            for (int y = by; y <= y1; y++) {
+                raster_row(fc, ts, y, bx, x1, !inside);
+            }
+        }
+    }
+}
+
 // 自己实现的三角形光栅化函数
 // 主要思路是利用重心坐标判断点是否在三角形内
 void triangle(vec4 *pts, IShader &shader, TGAImage &image, TGAImage &zbuffer) {
-    // 步骤 1: 找出包围盒
-    vec2 boxmin( std::numeric_limits<float>::max(),  std::numeric_limits<float>::max());
-    vec2 boxmax(-std::numeric_limits<float>::max(), -std::numeric_limits<float>::max());
-    // 查找包围盒边界
-    for (int i = 0; i < 3; i++) {
-        // 第一层循环，遍历 pts
-        for (int j = 0; j < 2; j++) {
-            // 第二层循环，遍历 Vec2i
-            boxmin[j] = std::min(boxmin[j], pts[i][j] / pts[i][3]);
-            boxmax[j] = std::max(boxmax[j], pts[i][j] / pts[i][3]);
+    raster_stats.triangles++;
+
+    // 步骤 1: 找出包围盒，并预计算重心坐标的增量
+    TriangleSetup ts;
+    if (!setup_triangle(pts, zbuffer.get_width(), zbuffer.get_height(), ts)) {
+        return;
+    }
+    if (tile_mask) {
+        const int columns = (zbuffer.get_width() + TRACK_TILE - 1) / TRACK_TILE;
+        for (int ty = ts.ymin / TRACK_TILE; ty <= ts.ymax / TRACK_TILE; ty++) {
+            for (int tx = ts.xmin / TRACK_TILE; tx <= ts.xmax / TRACK_TILE; tx++) {
+                (*tile_mask)[tx + ty * columns] = 1;
+            }
+        }
+    }
+    IVaryingShader *vshader = dynamic_cast<IVaryingShader *>(&shader);
+    VaryingSetup vs;
+    if (vshader) {
+        setup_varyings(pts, ts, *vshader, vs);
+    }
+    if (coarse_rate > 1 || rate_map) {
+        triangle_coarse(pts, ts, shader, vshader, vs, image, zbuffer);
+        return;
+    }
+
+    // 步骤二：按三角形的大小和形状选择遍历方式
+    FragmentContext fc = {pts, shader, vshader, vs, image, zbuffer, TGAColor()};
+    const int bw = ts.xmax - ts.xmin + 1, bh = ts.ymax - ts.ymin + 1;
+    if (bw * bh <= SMALL_TRIANGLE_PIXELS) {
+        raster_stats.small_triangles++;
+        raster_bbox(fc, ts);
+    } else if (bw >= RASTER_BLOCK * 4 && bh >= RASTER_BLOCK * 4 && ts.area >= .25 * bw * bh) {
+        raster_stats.block_triangles++;
+        raster_blocks(fc, ts);
+    } else {
+        raster_stats.span_triangles++;
+        raster_spans(fc, ts);
+    }
+}
+
+// 只写深度的光栅化：没有片元着色器，也不写颜色，用于 shadow map 和 Z-prepass
+// zbuffer 必须是 GRAYSCALE 格式，直接按行写 buffer，内层循环没有分支，编译器可以向量化
+void triangle_depth(vec4 *pts, TGAImage &zbuffer) {
+    assert(zbuffer.get_bytespp() == TGAImage::GRAYSCALE);
+    TriangleSetup ts;
+    if (!setup_triangle(pts, zbuffer.get_width(), zbuffer.get_height(), ts)) {
+        return;
+    }
+
+    // 只填满包围盒碰到的快速清除 tile
+    unsigned char *data = zbuffer.buffer(ts.xmin, ts.ymin, ts.xmax, ts.ymax);
+    const int width = zbuffer.get_width();
+    for (int y = ts.ymin; y <= ts.ymax; y++) {
+        vec3 crow = row_start(ts, y);
+        unsigned char *zrow = data + y * width;
+        if (id_buffer) {
+            // Z-prepass：深度相等时后画的覆盖先画的，和不做 prepass 时留下的是同一个三角形
+            int *idrow = id_buffer + (size_t)y * width;
+            for (int x = ts.xmin; x <= ts.xmax; x++) {
+                vec3 c = crow + ts.dcdx * x;
+                int depth = frag_depth(pts, c);
+                if (c.x >= 0 && c.y >= 0 && c.z >= 0 && depth >= zrow[x]) {
+                    zrow[x] = (unsigned char)depth;
+                    idrow[x] = current_id;
+                }
+            }
+            continue;
+        }
+        for (int x = ts.xmin; x <= ts.xmax; x++) {
+            vec3 c = crow + ts.dcdx * x;
+            int depth = frag_depth(pts, c);
+            bool inside = c.x >= 0 && c.y >= 0 && c.z >= 0 && depth >= zrow[x];
+            zrow[x] = inside ? (unsigned char)depth : zrow[x];
         }
     }
+}
+
+// 标准的多重采样位置（D3D 标准样式），单位是 1/16 像素，相对于像素中心
+static const int SAMPLE_PATTERN_1[1][2] = {{0, 0}};
+static const int SAMPLE_PATTERN_2[2][2] = {{4, 4}, {-4, -4}};
+static const int SAMPLE_PATTERN_4[4][2] = {{-2, -6}, {6, -2}, {-6, 2}, {2, 6}};
+static const int SAMPLE_PATTERN_8[8][2] = {{1, -3}, {-1, 3}, {5, 1}, {-3, -5}, {-5, 5}, {-7, -1}, {3, 7}, {7, -7}};
+
+MultisampleBuffer::MultisampleBuffer(const int w, const int h, const int n) : width(w), height(h), nsamples(n), color(), depth() {
+    assert(n == 1 || n == 2 || n == 4 || n == 8);
+    const int (*pattern)[2] = n == 8 ? SAMPLE_PATTERN_8 : (n == 4 ? SAMPLE_PATTERN_4 : (n == 2 ? SAMPLE_PATTERN_2 : SAMPLE_PATTERN_1));
+    for (int s = 0; s < n; s++) {
+        offsets[s] = vec2(pattern[s][0] / 16., pattern[s][1] / 16.);
+    }
+    color.resize((size_t)w * h * 3 * n);
+    depth.resize((size_t)w * h * n);
+    clear();
+}
+
+void MultisampleBuffer::clear() {
+    std::fill(color.begin(), color.end(), 0);
+    std::fill(depth.begin(), depth.end(), 0.f);
+}
+
+void MultisampleBuffer::resolve(TGAImage &image) {
+    assert(image.get_bytespp() == TGAImage::RGB && image.get_width() == width && image.get_height() == height);
+    // nsamples 是 2 的幂，求平均可以用移位；样本平面是连续的，内层循环编译器会展开成 SIMD
+    int shift = 0;
+    while ((1 << shift) < nsamples) shift++;
+    const size_t nbytes = (size_t)width * height * 3;
+    unsigned char *out = image.buffer();
+    const unsigned char *planes = color.data();
+    const size_t CHUNK = 1024;
+    unsigned short sum[CHUNK];
+    for (size_t base = 0; base < nbytes; base += CHUNK) {
+        const size_t n = std::min(CHUNK, nbytes - base);
+        for (size_t i = 0; i < n; i++) sum[i] = planes[base + i];
+        for (int s = 1; s < nsamples; s++) {
+            const unsigned char *plane = planes + s * nbytes + base;
+            for (size_t i = 0; i < n; i++) sum[i] += plane[i];
+        }
+        // 加上 nsamples/2 做四舍五入
+        const unsigned short round = (unsigned short)(nsamples >> 1);
+        for (size_t i = 0; i < n; i++) out[base + i] = (unsigned char)((sum[i] + round) >> shift);
+    }
+}
+
+// 和 frag_depth 一样，只是不做 8 位量化
+static inline float frag_depthf(const vec4 *pts, const vec3 &c) {
+    float z = pts[0][2] * c.x + pts[1][2] * c.y + pts[2][2] * c.z;
+    float w = pts[0][3] * c.x + pts[1][3] * c.y + pts[2][3] * c.z;
+    return z / w;
+}
+
+void triangle(vec4 *pts, IShader &shader, MultisampleBuffer &target) {
+    raster_stats.triangles++;
+
+    TriangleSetup ts;
+    if (!setup_triangle(pts, target.width, target.height, ts)) {
+        return;
+    }
+
+    // 每个样本的重心坐标 = 像素中心的重心坐标 + 固定偏移，偏移每个三角形只算一次
+    // 和 1x 的光栅化一样，像素中心就是整数坐标 (x, y)，否则打开 MSAA 整幅图会偏移半个像素
+    const int n = target.nsamples;
+    vec3 offset[8];
+    for (int s = 0; s < n; s++) {
+        offset[s] = ts.dcdx * target.offsets[s].x + ts.dcdy * target.offsets[s].y;
+    }
+    const size_t npixels = (size_t)target.width * target.height;
+    IVaryingShader *vshader = dynamic_cast<IVaryingShader *>(&shader);
+    VaryingSetup vs;
+    if (vshader) {
+        setup_varyings(pts, ts, *vshader, vs);
+    }
 
-    // 步骤二：对包围盒里的每一个像素进行遍历
-    vec2 P;
     TGAColor color;
-    // 这里注意要强制指定 int 类型，不然 P 坐标转为浮点数时绘制会出现边界着色失败的现象
-    for (P.x = (int)boxmin.x; P.x <= (int)boxmax.x; P.x++) {
-        for (P.y = (int)boxmin.y; P.y <= (int)boxmax.y; P.y++) {
-            // c 是根据三个顶点坐标计算出的重心坐标
-            vec3 c = barycentric(proj<2>(pts[0] / pts[0][3]), proj<2>(pts[1] / pts[1][3]), proj<2>(pts[2] / pts[2][3]), proj<2>(P));
-            
-            // TODO: 这里感觉是在做 zbuffer 记录，没太看懂明天看吧
-            float z = pts[0][2] * c.x + pts[1][2] * c.y + pts[2][2] * c.z;
-            float w = pts[0][3] * c.x + pts[1][3] * c.y + pts[2][3] * c.z;
-            int frag_depth = std::max(0, std::min(255, int(z/w + .5)));
-            
-            // 重心坐标某一项小于 0，说明在三角形外，跳过不绘制
-            if (c.x < 0 || c.y < 0 || c.z < 0 ||
-                zbuffer.get(P.x, P.y)[0] > frag_depth) {
+    for (int y = ts.ymin; y <= ts.ymax; y++) {
+        vec3 crow = row_start(ts, y);
+        for (int x = ts.xmin; x <= ts.xmax; x++) {
+            vec3 c = crow + ts.dcdx * x;
+            const size_t idx = x + (size_t)y * target.width;
+
+            // 覆盖 + 深度测试都是逐样本做的
+            int mask = 0;
+            int first = -1;
+            float depth[8];
+            for (int s = 0; s < n; s++) {
+                vec3 cs = c + offset[s];
+                if (cs.x < 0 || cs.y < 0 || cs.z < 0) continue;
+                depth[s] = frag_depthf(pts, cs);
+                if (target.depth[s * npixels + idx] > depth[s]) continue;
+                mask |= 1 << s;
+                if (first < 0) first = s;
+            }
+            if (!mask) {
                 continue;
             }
-            
-            bool discard = shader.fragment(c, color);
-            if (!discard) {
-                zbuffer.set(P.x, P.y, TGAColor(frag_depth));
-                image.set(P.x, P.y, color);
+
+            // 着色每个像素只做一次：像素中心在三角形内就用中心，否则用第一个被覆盖的样本，避免外插出三角形
+            const bool inside = c.x >= 0 && c.y >= 0 && c.z >= 0;
+            vec3 bar = inside ? c : c + offset[first];
+            const double sx = x + (inside ? 0. : target.offsets[first].x);
+            const double sy = y + (inside ? 0. : target.offsets[first].y);
+            raster_stats.shaded_fragments++;
+            if (shade(shader, vshader, vs, bar, sx, sy, color)) {
+                continue;
             }
+
+            for (int s = 0; s < n; s++) {
+                if (!(mask & (1 << s))) continue;
+                target.depth[s * npixels + idx] = depth[s];
+                unsigned char *dst = &target.color[(s * npixels + idx) * 3];
+                dst[0] = color[0];
+                dst[1] = color[1];
+                dst[2] = color[2];
+            }
+        }
+    }
+}
+
+// 阴影查询：p 是片元在 shadow buffer 屏幕空间里的坐标（x, y 为像素，z 为 [0, 255] 的深度）
+// 返回被光照到的比例，1 表示完全照亮，0 表示完全在阴影里
+// pcf 为采样半径，0 时只采一个点，否则在 (2*pcf+1)^2 的邻域里做 percentage-closer filtering 得到软边缘
+float shadow(TGAImage &shadowbuffer, const vec3 p, const int pcf, const int bias) {
+    const int width  = shadowbuffer.get_width();
+    const int height = shadowbuffer.get_height();
+    const int px = int(p.x + .5);
+    const int py = int(p.y + .5);
+    const int depth = int(p.z + .5) + bias;
+
+    int lit = 0;
+    int total = 0;
+    for (int dy = -pcf; dy <= pcf; dy++) {
+        for (int dx = -pcf; dx <= pcf; dx++) {
+            int x = std::max(0, std::min(width  - 1, px + dx));
+            int y = std::max(0, std::min(height - 1, py + dy));
+            // 片元比 shadow buffer 里记录的最近深度还要近（或相等），说明没有被遮挡
+            // 用 pixel() 读，光栅线程之间共享 shadow buffer，不能去填快速清除的 tile
+            lit += depth >= shadowbuffer.pixel(x, y)[0];
+            total++;
         }
     }
+    return lit / (float)total;
 }
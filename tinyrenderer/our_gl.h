@@ -8,6 +8,7 @@
 #ifndef __OUR_GL_H__
 #define __OUR_GL_H__
 //
+#include <vector>
 #include "tgaimage.h"
 #include "geometry.h"
 //
@@ -15,11 +16,128 @@ void viewport(const int x, const int y, const int w, const int h);
 void projection(const double coeff=0); // coeff = -1/c
 void lookat(const vec3 eye, const vec3 center, const vec3 up);
 
+// 深度测试函数，zbuffer 里的值越大离屏幕越近
+enum DepthFunc {
+    DEPTH_GEQUAL, // 默认：深度大于等于 zbuffer 才通过
+    DEPTH_EQUAL,  // Z-prepass 之后的着色 pass 用，只有最终可见的片元才通过（设置了 primitive_ids 时还要编号相同）
+};
+void depth_func(const DepthFunc func);
+
+// 图元编号缓冲：8 位深度下相邻的三角形经常深度相同，DEPTH_EQUAL 会让同一个像素着色不止一次
+// ids 不为 NULL 时 triangle_depth 把最后通过深度测试的三角形编号（primitive_id）写进 ids[x + y * width]，
+// DEPTH_EQUAL 的着色 pass 只让编号相同的片元通过，每个像素正好着色一次；ids 由调用者持有，传 NULL 关闭
+void primitive_ids(int *ids);
+void primitive_id(const int id); // 接下来画的三角形的编号，Z-prepass 和着色 pass 要一致
+
+// 粗粒度着色：片元着色器每 rate x rate 个像素只调用一次，覆盖和深度测试仍然逐像素进行
+// rate 只能是 1/2/4，只对 triangle(..., TGAImage &image, TGAImage &zbuffer) 生效
+void shading_rate(const int rate);
+int shading_rate();
+// 屏幕空间的着色率图：GRAYSCALE 格式，每个像素对应屏幕上 4x4 的 tile，值为 1/2/4，0 表示使用 shading_rate()
+// 传 NULL 取消；图片由调用者持有
+void shading_rate_image(const TGAImage *rate_image);
+
+// 裁剪矩形：只光栅化 [x, x+w) x [y, y+h) 里的像素，w 或 h 为 0 时关闭（默认）
+// 对所有 triangle*() 都生效，包括只写深度的版本
+void scissor(const int x, const int y, const int w, const int h);
+
+// 记录绘制碰到的屏幕 tile：triangle(..., TGAImage &image, TGAImage &zbuffer) 把三角形裁剪后的包围盒
+// 覆盖的 TRACK_TILE x TRACK_TILE 的 tile 在 mask 里置 1，mask 按行存储，每行 (width + TRACK_TILE - 1) / TRACK_TILE 个
+// 传 NULL 关闭；mask 由调用者持有，不会被复制给多线程绘制的工作线程
+#define TRACK_TILE 16
+void track_tiles(std::vector<unsigned char> *mask);
+
+// 当前线程的全部绘制状态：矩阵、深度测试、着色率和裁剪矩形
+// 这些状态都是线程局部的，多线程绘制时由发起绘制的线程取出来，复制给每个工作线程
+struct RasterState {
+    mat<4,4> model_view, projection, viewport;
+    DepthFunc depth;
+    int rate;
+    const TGAImage *rate_image;
+    int scissor[4]; // x, y, w, h
+    int *ids;       // primitive_ids，编号本身每个三角形各自设置
+};
+RasterState raster_state();
+void raster_state(const RasterState &state);
+
+// 光栅化统计，用来衡量 overdraw
+struct RasterStats {
+    unsigned long triangles;        // 提交的三角形数
+    unsigned long shaded_fragments; // 调用片元着色器的次数
+    // triangle() 按三角形大小选择的遍历方式
+    unsigned long small_triangles;  // 包围盒很小，直接逐像素
+    unsigned long span_triangles;   // 逐行求出覆盖区间
+    unsigned long block_triangles;  // 大三角形，按 8x8 块遍历
+    unsigned long blocks_accepted;  // 整块在三角形内，不用逐像素测试覆盖
+    unsigned long blocks_partial;   // 块跨过三角形的边
+    unsigned long blocks_rejected;  // 整块在三角形外
+};
+extern thread_local RasterStats raster_stats; // 每个线程各自统计
+void add_raster_stats(RasterStats &to, const RasterStats &from);
+
+// 多线程光栅化时按行分工：屏幕按 RASTER_BAND_ROWS 行一条带交错分给 count 个线程，
+// 当前线程只画第 index, index + count, ... 条带，其余的行直接跳过。设置是线程局部的，默认 (0, 1) 画所有行
+#define RASTER_BAND_ROWS 16
+void raster_band(const int index, const int count);
+bool band_overlaps(const int ymin, const int ymax, const int index, const int count);
+// 三角形覆盖的屏幕行范围，退化或者完全在图片外时返回 false（这时 triangle() 什么也不会画）
+bool triangle_rows(const vec4 *pts, const int width, const int height, int &ymin, int &ymax);
+
 struct IShader {
     virtual vec4 vertex(const int iface, const int nthvert) = 0; // 顶点着色器
     virtual bool fragment(const vec3 bar, TGAColor &color) = 0;  // 片元着色器
+
+    // 顶点位置已经批量变换好了（实例化绘制），着色器只需要计算 varying
+    // 默认实现忽略传进来的位置，退回到普通的顶点着色器
+    virtual vec4 vertex(const int iface, const int nthvert, const vec4) { return vertex(iface, nthvert); }
+    // 切换实例时调用，ModelView 已经包含了实例的模型矩阵，着色器可以在这里更新 uniform
+    virtual void instance(const mat<4,4> &, const TGAColor &) {}
+    // 片元颜色写进 (x, y) 以后调用（粗粒度着色时一次着色会写多个像素，每个像素调用一次）
+    // 延迟着色的着色器在这里把最近一次 fragment() 算出的表面属性存进 G-buffer
+    virtual void store(const int, const int) {}
+};
+
+// 由管线负责插值 varying 的着色器
+// 顶点着色器把每个顶点的 nvaryings 个 float 写进 varying[nthvert]，光栅化时每个三角形算一次透视校正的插值平面，
+// 片元着色器直接拿到插值好的值，不用自己拿重心坐标去乘
+#define MAX_VARYINGS 16
+struct IVaryingShader : public IShader {
+    const int nvaryings;
+    float varying[3][MAX_VARYINGS];
+
+    IVaryingShader(const int n) : nvaryings(n), varying() {}
+    virtual ~IVaryingShader() {}
+    // 多线程绘制时每个线程要一份自己的着色器，这时片元着色器只能依赖 varying 和 uniform
+    // 返回 NULL 表示不支持（只能单线程绘制）
+    virtual IVaryingShader *clone() const { return NULL; }
+    virtual bool fragment(const vec3 bar, const float *varyings, TGAColor &color) = 0;
+    // 不经过 triangle() 的调用者用：按重心坐标线性插值（不做透视校正）
+    virtual bool fragment(const vec3 bar, TGAColor &color) {
+        float v[MAX_VARYINGS];
+        for (int k = 0; k < nvaryings; k++) v[k] = varying[0][k] * bar.x + varying[1][k] * bar.y + varying[2][k] * bar.z;
+        return fragment(bar, v, color);
+    }
 };
 
 void triangle(vec4 *pts, IShader &shader, TGAImage &image, TGAImage &zbuffer);
+void triangle_depth(vec4 *pts, TGAImage &zbuffer); // 只写深度，用于 shadow map 和 Z-prepass
+
+// 多重采样（MSAA）的 render target，每个像素有 nsamples 个颜色和深度样本
+// 样本按平面存储：第 s 个样本的所有像素是连续的一块，resolve 时可以按字节向量化求平均
+class MultisampleBuffer {
+public:
+    MultisampleBuffer(const int w, const int h, const int nsamples); // nsamples 只能是 1/2/4/8
+    void clear();
+    void resolve(TGAImage &image); // 把样本平均成最终的颜色，image 必须是 RGB 格式，尺寸相同
+
+    int width, height, nsamples;
+    vec2 offsets[8];                   // 样本相对像素中心的偏移
+    std::vector<unsigned char> color;  // nsamples 个 RGB 平面
+    std::vector<float> depth;          // nsamples 个深度平面，和 zbuffer 一样越大越近
+};
+
+// 每个被覆盖的像素只调用一次片元着色器，颜色写入所有被覆盖且通过深度测试的样本
+void triangle(vec4 *pts, IShader &shader, MultisampleBuffer &target);
+float shadow(TGAImage &shadowbuffer, const vec3 p, const int pcf=0, const int bias=5); // 返回光照比例 [0, 1]
 
 #endif /* our_gl_hpp */
@@ -0,0 +1,201 @@
+//
+//  pipeline.cpp
+//  tinyrenderer
+//
+//  Created by skychx on 2021/3/24.
+//
+
+#include <atomic>
+#include <thread>
+#include <chrono>
+#include <vector>
+#include <cstring>
+#include <algorithm>
+#include "pipeline.h"
+#include "arena.h"
+
+extern thread_local mat<4,4> ModelView;
+extern thread_local mat<4,4> Projection;
+extern thread_local mat<4,4> Viewport;
+
+// 几何阶段的输出：一个准备好光栅化的三角形
+struct PipelineTriangle {
+    vec4 pts[3];
+    int ymin, ymax;                     // 覆盖的屏幕行，用来分给光栅线程
+    int id;                             // 提交顺序里的位置，Z-prepass 的图元编号
+    float varying[3][MAX_VARYINGS];
+};
+
+// 环形队列的一个槽
+// 几何线程拿到批次号 seq 后等 free_for == seq 再写入，写完把 ready 设为 seq
+// 每个光栅线程按顺序等 ready == seq，读完把 pending 减一，最后一个读完的把槽让给 seq + 槽数
+struct PipelineSlot {
+    std::atomic<long> free_for;
+    std::atomic<long> ready;
+    std::atomic<int> pending;
+    PipelineTriangle *tris; // BATCH_TRIANGLES 个，分配在发起绘制的线程的帧内存上
+    int ntris;
+};
+
+static const int BATCH_TRIANGLES = 64;
+
+typedef std::chrono::steady_clock Clock;
+
+static double seconds_since(const Clock::time_point &t) {
+    return std::chrono::duration<double>(Clock::now() - t).count();
+}
+
+PipelineStats draw_pipelined(Model &model, IVaryingShader &shader, TGAImage &image, TGAImage &zbuffer, const int mode,
+                             int geometry_workers, int raster_workers) {
+    PipelineStats stats = PipelineStats();
+    const Clock::time_point start = Clock::now();
+
+    IVaryingShader *probe = shader.clone();
+    if (!probe) {
+        draw_model(model, shader, image, zbuffer, mode);
+        stats.geometry_workers = stats.raster_workers = 1;
+        stats.seconds = seconds_since(start);
+        return stats;
+    }
+    delete probe;
+
+    if (geometry_workers <= 0 || raster_workers <= 0) {
+        int ncpu = std::max(2, (int)std::thread::hardware_concurrency());
+        if (geometry_workers <= 0) geometry_workers = std::max(1, ncpu / 4);
+        if (raster_workers <= 0)   raster_workers   = std::max(1, ncpu - geometry_workers);
+    }
+    stats.geometry_workers = geometry_workers;
+    stats.raster_workers = raster_workers;
+
+    // 三角形顺序、环形队列和统计数组都是这一帧的临时数据，画完一起还给帧内存
+    FrameArena &arena = frame_arena();
+    ArenaScope scope(arena);
+    const int width = image.get_width(), height = image.get_height();
+    int nfaces;
+    const int *order = draw_order(model, mode, width, height, nfaces);
+    const bool ordered = order != NULL;
+
+    // Z-prepass 和着色率在启动线程之前设置好，连同矩阵一起复制给每个线程
+    if (mode & DRAW_DEPTH_PREPASS) {
+        primitive_ids(prepass_ids(zbuffer));
+        draw_depth(model, Viewport * Projection * ModelView, zbuffer, order, nfaces);
+        depth_func(DEPTH_EQUAL);
+    }
+    const int rate = shading_rate();
+    if (mode & (DRAW_COARSE_2X2 | DRAW_COARSE_4X4)) {
+        shading_rate(mode & DRAW_COARSE_4X4 ? 4 : 2);
+    }
+
+    const RasterState state = raster_state();
+
+    const long nbatches = (nfaces + BATCH_TRIANGLES - 1) / BATCH_TRIANGLES;
+    const int nslots = 4 * std::max(geometry_workers, raster_workers);
+    PipelineSlot *slots = arena.make<PipelineSlot>(nslots);
+    for (int s = 0; s < nslots; s++) {
+        slots[s].free_for.store(s);
+        slots[s].ready.store(-1);
+        slots[s].pending.store(0);
+        slots[s].tris = arena.allocate<PipelineTriangle>(BATCH_TRIANGLES);
+        slots[s].ntris = 0;
+    }
+
+    std::atomic<long> next_batch(0);
+    std::atomic<unsigned long> culled(0), full_stalls(0), empty_stalls(0);
+    double *geometry_time = arena.make<double>(geometry_workers);
+    double *raster_time = arena.make<double>(raster_workers);
+    RasterStats *worker_stats = arena.make<RasterStats>(raster_workers);
+
+    // 几何阶段：顶点着色 + 剔除，输出按批次号放进对应的槽
+    auto geometry = [&](const int id) {
+        IVaryingShader *sh = shader.clone();
+        raster_state(state);
+        double busy = 0;
+        for (long seq = next_batch.fetch_add(1); seq < nbatches; seq = next_batch.fetch_add(1)) {
+            PipelineSlot &slot = slots[seq % nslots];
+            if (slot.free_for.load(std::memory_order_acquire) != seq) {
+                full_stalls++;
+                while (slot.free_for.load(std::memory_order_acquire) != seq) std::this_thread::yield();
+            }
+            const Clock::time_point t = Clock::now();
+            slot.ntris = 0;
+            const int first = (int)seq * BATCH_TRIANGLES, last = std::min(nfaces, first + BATCH_TRIANGLES);
+            for (int k = first; k < last; k++) {
+                const int i = ordered ? order[k] : k;
+                PipelineTriangle &tri = slot.tris[slot.ntris];
+                for (int j = 0; j < 3; j++) {
+                    tri.pts[j] = sh->vertex(i, j);
+                }
+                if (!triangle_rows(tri.pts, width, height, tri.ymin, tri.ymax)) {
+                    culled++;
+                    continue;
+                }
+                memcpy(tri.varying, sh->varying, sizeof(tri.varying));
+                tri.id = k;
+                slot.ntris++;
+            }
+            busy += seconds_since(t);
+            slot.pending.store(raster_workers, std::memory_order_relaxed);
+            slot.ready.store(seq, std::memory_order_release);
+        }
+        geometry_time[id] = busy;
+        delete sh;
+    };
+
+    // 光栅阶段：按批次顺序消费，只画自己条带上的行
+    auto raster = [&](const int id) {
+        IVaryingShader *sh = shader.clone();
+        raster_state(state);
+        raster_band(id, raster_workers);
+        raster_stats = RasterStats();
+        double busy = 0;
+        for (long seq = 0; seq < nbatches; seq++) {
+            PipelineSlot &slot = slots[seq % nslots];
+            if (slot.ready.load(std::memory_order_acquire) != seq) {
+                empty_stalls++;
+                while (slot.ready.load(std::memory_order_acquire) != seq) std::this_thread::yield();
+            }
+            const Clock::time_point t = Clock::now();
+            for (int k = 0; k < slot.ntris; k++) {
+                PipelineTriangle &tri = slot.tris[k];
+                if (!band_overlaps(tri.ymin, tri.ymax, id, raster_workers)) continue;
+                memcpy(sh->varying, tri.varying, sizeof(tri.varying));
+                primitive_id(tri.id);
+                triangle(tri.pts, *sh, image, zbuffer);
+            }
+            busy += seconds_since(t);
+            if (slot.pending.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+                slot.ready.store(-1, std::memory_order_relaxed);
+                slot.free_for.store(seq + nslots, std::memory_order_release);
+            }
+        }
+        raster_time[id] = busy;
+        worker_stats[id] = raster_stats;
+        raster_band(0, 1);
+        delete sh;
+    };
+
+    std::vector<std::thread> threads;
+    for (int i = 0; i < geometry_workers; i++) threads.push_back(std::thread(geometry, i));
+    for (int i = 0; i < raster_workers; i++)   threads.push_back(std::thread(raster, i));
+    for (size_t i = 0; i < threads.size(); i++) threads[i].join();
+
+    shading_rate(rate);
+    depth_func(DEPTH_GEQUAL);
+    primitive_ids(NULL);
+
+    // 跨多个条带的三角形每个光栅线程都会算一次，提交的三角形数按模型算；各条路径的计数是所有线程的总和
+    for (int i = 0; i < raster_workers; i++) {
+        RasterStats s = worker_stats[i];
+        s.triangles = 0;
+        add_raster_stats(raster_stats, s);
+    }
+    raster_stats.triangles += nfaces;
+    stats.batches = nbatches;
+    stats.culled = culled;
+    stats.full_stalls = full_stalls;
+    stats.empty_stalls = empty_stalls;
+    stats.seconds = seconds_since(start);
+    for (int i = 0; i < geometry_workers; i++) stats.geometry_busy += geometry_time[i] / stats.seconds / geometry_workers;
+    for (int i = 0; i < raster_workers; i++)   stats.raster_busy   += raster_time[i] / stats.seconds / raster_workers;
+    return stats;
+}
@@ -0,0 +1,36 @@
+//
+//  pipeline.h
+//  tinyrenderer
+//
+//  Created by skychx on 2021/3/24.
+//
+
+#ifndef __PIPELINE_H__
+#define __PIPELINE_H__
+
+#include "model.h"
+#include "our_gl.h"
+#include "render.h"
+
+// 流水线绘制的统计
+struct PipelineStats {
+    int geometry_workers;
+    int raster_workers;
+    unsigned long batches;     // 几何阶段产生的三角形批次
+    unsigned long culled;      // 几何阶段剔除的三角形（退化或在屏幕外）
+    double seconds;            // 整个绘制的墙上时间
+    double geometry_busy;      // 几何线程忙碌时间占比，所有几何线程的平均值
+    double raster_busy;        // 光栅线程忙碌时间占比
+    unsigned long full_stalls; // 几何线程因为队列满而等待的次数
+    unsigned long empty_stalls; // 光栅线程因为队列空而等待的次数
+};
+
+// 流水线绘制：几何线程做顶点着色和剔除，把三角形按批放进有界的无锁环形队列，光栅线程并行消费
+// 屏幕按行条带交错分给光栅线程，每个线程按提交顺序画完所有批次里落在自己条带上的三角形，
+// 所以每个像素上的绘制顺序和单线程完全一样，结果逐字节一致
+// 着色器必须实现 IVaryingShader::clone()，否则退回单线程的 draw_model；不支持 MSAA
+// workers 为 0 时按 CPU 核数自动选择
+PipelineStats draw_pipelined(Model &model, IVaryingShader &shader, TGAImage &image, TGAImage &zbuffer, const int mode=DRAW_DEFAULT,
+                             int geometry_workers=0, int raster_workers=0);
+
+#endif //__PIPELINE_H__
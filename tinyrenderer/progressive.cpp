@@ -0,0 +1,132 @@
+//
+//  progressive.cpp
+//  tinyrenderer
+//
+//  Created by skychx on 2021/4/1.
+//
+
+#include <cstring>
+#include "progressive.h"
+#include "render.h"
+#include "shader.h"
+
+std::vector<ProgressivePass> progressive_passes(const int msaa) {
+    std::vector<ProgressivePass> passes;
+    const ProgressivePass quarter = {4, 1}, half = {2, 1}, full = {1, 1}, smooth = {1, msaa};
+    passes.push_back(quarter);
+    passes.push_back(half);
+    passes.push_back(full);
+    if (msaa > 1) passes.push_back(smooth);
+    return passes;
+}
+
+// 和 draw_model 一样按顺序提交三角形，每 128 个检查一次是否被取消；target 是 TGAImage 或 MultisampleBuffer
+template <typename... Target>
+static bool draw_cancellable(Model &model, GouraudShader &shader, const CancelToken &token, Target&... target) {
+    const int nfaces = model.nfaces();
+    for (int i = 0; i < nfaces; i++) {
+        if (!(i & 127) && token.cancelled()) return false;
+        vec4 screen_coords[3];
+        for (int j = 0; j < 3; j++) {
+            screen_coords[j] = shader.vertex(i, j);
+        }
+        triangle(screen_coords, shader, target...);
+    }
+    return true;
+}
+
+// 最近邻放大，low 的尺寸是 frame 的 1/scale（向上取整）
+static void upscale(const TGAImage &low, const int scale, TGAImage &frame) {
+    const int w = frame.get_width(), h = frame.get_height(), lw = low.get_width();
+    const unsigned char *src = low.buffer();
+    unsigned char *dst = frame.buffer();
+    for (int y = 0; y < h; y++) {
+        const unsigned char *srow = src + (size_t)(y / scale) * lw * 3;
+        unsigned char *drow = dst + (size_t)y * w * 3;
+        if (y % scale) {
+            memcpy(drow, drow - (size_t)w * 3, (size_t)w * 3); // 和上一行一样
+            continue;
+        }
+        for (int x = 0; x < w; x++) {
+            memcpy(drow + x * 3, srow + (x / scale) * 3, 3);
+        }
+    }
+}
+
+// 尺寸和格式都没变时只清零，否则重新分配
+static void prepare(TGAImage &img, const int w, const int h, const int bpp) {
+    if (img.get_width() == w && img.get_height() == h && img.get_bytespp() == bpp) {
+        img.clear();
+    } else {
+        img = TGAImage(w, h, bpp);
+    }
+}
+
+static void prepare(MultisampleBuffer &target, const int w, const int h, const int nsamples) {
+    if (target.width == w && target.height == h && target.nsamples == nsamples) {
+        target.clear();
+    } else {
+        target = MultisampleBuffer(w, h, nsamples);
+    }
+}
+
+int render_progressive(const ProgressiveScene &scene, const std::vector<ProgressivePass> &passes, const CancelToken &token, ProgressiveCallback emit,
+                       ProgressiveTargets *targets) {
+    ProgressiveTargets scratch;
+    ProgressiveTargets &t = targets ? *targets : scratch;
+    if (t.passes.size() < passes.size()) t.passes.resize(passes.size());
+    TGAImage &frame = t.frame;
+    prepare(frame, scene.width, scene.height, TGAImage::RGB);
+    vec3 light = scene.light;
+    light.normalize();
+    int done = 0;
+    for (int k = 0; k < (int)passes.size(); k++) {
+        if (token.cancelled()) break;
+        const ProgressivePass &p = passes[k];
+        ProgressiveTargets::Pass &rt = t.passes[k];
+        const int w = (scene.width + p.scale - 1) / p.scale, h = (scene.height + p.scale - 1) / p.scale;
+
+        // 阴影和画面用同样的分辨率
+        TGAImage &shadowbuffer = rt.shadowbuffer;
+        prepare(shadowbuffer, w, h, TGAImage::GRAYSCALE);
+        lookat(light, scene.center, scene.up);
+        projection(0);
+        viewport(w / 8, h / 8, w * 3/4, h * 3/4);
+        mat<4,4> M_shadow = Viewport * Projection * ModelView;
+        draw_depth(*scene.model, M_shadow, shadowbuffer);
+
+        lookat(scene.eye, scene.center, scene.up);
+        projection(-1.f / (scene.eye - scene.center).norm());
+        viewport(w / 8, h / 8, w * 3/4, h * 3/4);
+        GouraudShader shader(scene.model, light);
+        shader.shadowbuffer = &shadowbuffer;
+        shader.uniform_Mshadow = M_shadow * (Viewport * Projection * ModelView).invert();
+
+        bool finished;
+        if (p.msaa > 1) {
+            MultisampleBuffer &target = rt.msaa;
+            prepare(target, w, h, p.msaa);
+            finished = draw_cancellable(*scene.model, shader, token, target);
+            if (finished && p.scale > 1) {
+                prepare(rt.low, w, h, TGAImage::RGB);
+                target.resolve(rt.low);
+                upscale(rt.low, p.scale, frame);
+            } else if (finished) {
+                target.resolve(frame);
+            }
+        } else if (p.scale > 1) {
+            prepare(rt.low, w, h, TGAImage::RGB);
+            prepare(rt.zbuffer, w, h, TGAImage::GRAYSCALE);
+            finished = draw_cancellable(*scene.model, shader, token, rt.low, rt.zbuffer);
+            if (finished) upscale(rt.low, p.scale, frame);
+        } else {
+            prepare(rt.zbuffer, w, h, TGAImage::GRAYSCALE);
+            frame.clear();
+            finished = draw_cancellable(*scene.model, shader, token, frame, rt.zbuffer);
+        }
+        if (!finished) break;
+        done++;
+        if (!emit(frame, k, p)) break;
+    }
+    return done;
+}
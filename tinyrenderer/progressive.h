@@ -0,0 +1,64 @@
+//
+//  progressive.h
+//  tinyrenderer
+//
+//  Created by skychx on 2021/4/1.
+//
+
+#ifndef __PROGRESSIVE_H__
+#define __PROGRESSIVE_H__
+
+#include <atomic>
+#include <functional>
+#include <vector>
+#include "model.h"
+#include "tgaimage.h"
+#include "our_gl.h"
+
+// 取消标记：其它线程调用 cancel() 以后，正在进行的渐进渲染在下一个检查点（每 128 个三角形）放弃
+class CancelToken {
+public:
+    CancelToken() : cancelled_(false) {}
+    void cancel() { cancelled_ = true; }
+    bool cancelled() const { return cancelled_; }
+
+private:
+    std::atomic<bool> cancelled_;
+};
+
+// 渐进渲染的一遍
+struct ProgressivePass {
+    int scale; // 分辨率是完整尺寸的 1/scale
+    int msaa;  // 每像素样本数，1 表示不做多重采样
+};
+
+// 默认的细化顺序：1/4 -> 1/2 -> 完整分辨率，msaa > 1 时最后再加一遍多重采样
+std::vector<ProgressivePass> progressive_passes(const int msaa=1);
+
+struct ProgressiveScene {
+    Model *model;
+    vec3 eye, center, up, light;
+    int width, height;
+};
+
+// 渐进渲染用到的 render target，每一遍一组；调用者留着它反复传进来时，尺寸不变就只清零，不重新分配
+struct ProgressiveTargets {
+    struct Pass {
+        TGAImage low, zbuffer, shadowbuffer; // low 是缩小的画面，完整分辨率的一遍直接画到 frame 上
+        MultisampleBuffer msaa = MultisampleBuffer(0, 0, 1);
+    };
+    TGAImage frame;
+    std::vector<Pass> passes;
+};
+
+// 每一遍画完调用一次：frame 是放大到完整尺寸的结果（最近邻），原点在左下角，回调可以随意修改（比如 flip 后写出），
+// 下一遍会整个覆盖它；回调返回 false 时停止后续的细化
+typedef std::function<bool(TGAImage &frame, const int pass, const ProgressivePass &p)> ProgressiveCallback;
+
+// 按 passes 的顺序一遍遍重画整个画面，每一遍都带阴影；返回完成的遍数，被取消时小于 passes.size()
+// 第一遍只有 1/scale^2 的像素要着色，可以很快给出预览；完整分辨率、不做 MSAA 的一遍和 draw_model 的结果完全一样
+// targets 为 NULL 时每次调用都临时分配 render target
+int render_progressive(const ProgressiveScene &scene, const std::vector<ProgressivePass> &passes, const CancelToken &token, ProgressiveCallback emit,
+                       ProgressiveTargets *targets=NULL);
+
+#endif //__PROGRESSIVE_H__
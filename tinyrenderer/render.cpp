@@ -0,0 +1,292 @@
+//
+//  render.cpp
+//  tinyrenderer
+//
+//  Created by skychx on 2021/3/2.
+//
+
+#include <algorithm>
+#include <limits>
+#include <cmath>
+#include "render.h"
+#include "arena.h"
+
+extern thread_local mat<4,4> ModelView;
+extern thread_local mat<4,4> Projection;
+extern thread_local mat<4,4> Viewport;
+
+thread_local MeshletStats meshlet_stats = {0, 0, 0, 0};
+
+// 桶的数量，精度够用就行，排序是 O(n) 的
+const int DEPTH_BUCKETS = 256;
+
+const int *front_to_back_order(Model &model, const mat<4,4> &modelview) {
+    FrameArena &arena = frame_arena();
+    const int nfaces = model.nfaces();
+    int *order = arena.allocate<int>(nfaces);
+    // 中间数组在返回前就释放了，order 留给调用者
+    ArenaScope scope(arena);
+    double *depth = arena.allocate<double>(nfaces);
+    double zmin =  std::numeric_limits<double>::max();
+    double zmax = -std::numeric_limits<double>::max();
+    for (int i = 0; i < nfaces; i++) {
+        // 只需要视空间的 z，相机朝向 -z，所以 z 越大离相机越近
+        vec3 centroid = (model.vert(i, 0) + model.vert(i, 1) + model.vert(i, 2)) / 3.;
+        depth[i] = modelview[2] * embed<4>(centroid);
+        zmin = std::min(zmin, depth[i]);
+        zmax = std::max(zmax, depth[i]);
+    }
+
+    // 计数排序：先统计每个桶里有多少个三角形，再算出每个桶的起始位置
+    int *bucket = arena.allocate<int>(nfaces);
+    int start[DEPTH_BUCKETS + 1] = {0};
+    const double scale = zmax > zmin ? (DEPTH_BUCKETS - 1) / (zmax - zmin) : 0;
+    for (int i = 0; i < nfaces; i++) {
+        // 近的放前面
+        bucket[i] = int((zmax - depth[i]) * scale);
+        start[bucket[i] + 1]++;
+    }
+    for (int b = 0; b < DEPTH_BUCKETS; b++) {
+        start[b + 1] += start[b];
+    }
+    for (int i = 0; i < nfaces; i++) {
+        order[start[bucket[i]]++] = i;
+    }
+    return order;
+}
+
+// 包围球是否和屏幕空间的视锥相交，M 是模型坐标到屏幕坐标（除以 w 之前）的矩阵
+// 平面从 M 的行里直接提取出来：x >= 0, x <= width, y >= 0, y <= height, w > 0
+static bool sphere_visible(const mat<4,4> &M, const vec3 center, const double radius, const int width, const int height) {
+    vec4 planes[5] = {
+        M[0],
+        M[3] * width - M[0],
+        M[1],
+        M[3] * height - M[1],
+        M[3],
+    };
+    vec4 c = embed<4>(center);
+    for (int i = 0; i < 5; i++) {
+        double len = proj<3>(planes[i]).norm();
+        if (len > 0 && planes[i] * c < -radius * len) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// meshlet 的法线锥是否完全背对相机，在视空间里测试（ModelView 只有旋转平移和等比缩放）
+// 相机在视空间的 z = c 处（projection 的 coeff = -1/c），coeff 为 0 时是平行投影
+static bool cone_backfacing(const Meshlet &m, const mat<4,4> &modelview, const double coeff) {
+    if (m.cone_cutoff > 1) {
+        return false;
+    }
+    vec3 center = proj<3>(modelview * embed<4>(m.center));
+    vec3 axis   = proj<3>(modelview * embed<4>(m.cone_axis, 0.));
+    double scale = axis.norm();
+    axis = axis / scale;
+    if (coeff == 0) {
+        return -axis.z >= m.cone_cutoff;
+    }
+    vec3 d = center - vec3(0, 0, -1. / coeff);
+    return d * axis >= m.cone_cutoff * d.norm() + m.radius * scale;
+}
+
+const int *visible_meshlet_faces(Model &model, const int width, const int height, const bool sort, int &count) {
+    const std::vector<Meshlet> &meshlets = model.meshlets();
+    const std::vector<int> &faces = model.meshlet_faces();
+    const mat<4,4> M = Viewport * Projection * ModelView;
+    meshlet_stats.meshlets += meshlets.size();
+
+    FrameArena &arena = frame_arena();
+    int *order = arena.allocate<int>(model.nfaces());
+    ArenaScope scope(arena);
+    std::pair<double, int> *visible = arena.allocate<std::pair<double, int> >(meshlets.size());
+    int nvisible = 0;
+    for (int i = 0; i < (int)meshlets.size(); i++) {
+        const Meshlet &m = meshlets[i];
+        if (!sphere_visible(M, m.center, m.radius, width, height)) {
+            meshlet_stats.frustum_culled++;
+            continue;
+        }
+        if (cone_backfacing(m, ModelView, Projection[3][2])) {
+            meshlet_stats.cone_culled++;
+            continue;
+        }
+        // 排序用视空间深度，z 越大越近，取负号让近的排在前面
+        visible[nvisible++] = std::make_pair(sort ? -(ModelView[2] * embed<4>(m.center)) : 0., i);
+    }
+    if (sort) {
+        // 下标各不相同，std::sort 的结果和稳定排序一样，而且不需要临时缓冲
+        std::sort(visible, visible + nvisible);
+    }
+
+    count = 0;
+    for (int k = 0; k < nvisible; k++) {
+        const Meshlet &m = meshlets[visible[k].second];
+        std::copy(faces.begin() + m.first, faces.begin() + m.first + m.count, order + count);
+        count += m.count;
+    }
+    meshlet_stats.faces_culled += model.nfaces() - count;
+    return order;
+}
+
+int select_lod(Model &model, const double pixels_per_triangle) {
+    // 包围球投影到屏幕上的半径（像素），ModelView 的缩放取第一列的长度
+    vec4 c = Projection * ModelView * embed<4>(model.bound_center());
+    if (c[3] <= 0) {
+        return model.nlods() - 1;
+    }
+    double scale = proj<3>(ModelView.col(0)).norm();
+    double r = model.bound_radius() * scale * std::abs(Viewport[0][0]) / c[3];
+    double area = M_PI * r * r;
+    // 选三角形数不超过像素预算的最精细的一级
+    for (int k = 0; k < model.nlods(); k++) {
+        if (model.lod_nfaces(k) * pixels_per_triangle <= area) {
+            return k;
+        }
+    }
+    return model.nlods() - 1;
+}
+
+// 根据绘制模式算出三角形的提交顺序，返回 NULL 表示按原顺序绘制所有三角形
+// DRAW_AUTO_LOD 会切换模型当前的 LOD
+const int *draw_order(Model &model, const int mode, const int width, const int height, int &count) {
+    if (mode & DRAW_AUTO_LOD) {
+        model.set_lod(select_lod(model));
+    }
+    count = model.nfaces();
+    // meshlet 是在原始网格上划分的，简化后的 LOD 不能用
+    if ((mode & DRAW_MESHLET_CULLING) && model.lod() == 0) {
+        return visible_meshlet_faces(model, width, height, mode & DRAW_FRONT_TO_BACK, count);
+    }
+    if (mode & DRAW_FRONT_TO_BACK) {
+        return front_to_back_order(model, ModelView);
+    }
+    return NULL;
+}
+
+int *prepass_ids(const TGAImage &zbuffer) {
+    const size_t n = (size_t)zbuffer.get_width() * zbuffer.get_height();
+    int *ids = frame_arena().allocate<int>(n);
+    std::fill(ids, ids + n, -1);
+    return ids;
+}
+
+void draw_depth(Model &model, const mat<4,4> &M, TGAImage &zbuffer, const int *order, const int count) {
+    const int nfaces = order ? count : model.nfaces();
+    for (int k = 0; k < nfaces; k++) {
+        int i = order ? order[k] : k;
+        vec4 screen_coords[3];
+        for (int j = 0; j < 3; j++) {
+            screen_coords[j] = M * embed<4>(model.vert(i, j));
+        }
+        primitive_id(k);
+        triangle_depth(screen_coords, zbuffer);
+    }
+}
+
+void draw_model(Model &model, IShader &shader, TGAImage &image, TGAImage &zbuffer, const int mode) {
+    ArenaScope scope;
+    int nfaces;
+    const int *order = draw_order(model, mode, image.get_width(), image.get_height(), nfaces);
+
+    // Z-prepass：先把最终的深度和留下的三角形编号写好，着色时只有深度相等、编号也相同的片元才能通过
+    if (mode & DRAW_DEPTH_PREPASS) {
+        primitive_ids(prepass_ids(zbuffer));
+        draw_depth(model, Viewport * Projection * ModelView, zbuffer, order, nfaces);
+        depth_func(DEPTH_EQUAL);
+    }
+
+    // 只在这次绘制里降低着色率，画完恢复全局设置
+    const int rate = shading_rate();
+    if (mode & (DRAW_COARSE_2X2 | DRAW_COARSE_4X4)) {
+        shading_rate(mode & DRAW_COARSE_4X4 ? 4 : 2);
+    }
+
+    for (int k = 0; k < nfaces; k++) {
+        int i = order ? order[k] : k;
+        vec4 screen_coords[3];
+        for (int j = 0; j < 3; j++) {
+            screen_coords[j] = shader.vertex(i, j);
+        }
+        primitive_id(k);
+        triangle(screen_coords, shader, image, zbuffer);
+    }
+
+    shading_rate(rate);
+    depth_func(DEPTH_GEQUAL);
+    primitive_ids(NULL);
+}
+
+void draw_model(Model &model, IShader &shader, MultisampleBuffer &target, const int mode) {
+    ArenaScope scope;
+    int nfaces;
+    const int *order = draw_order(model, mode, target.width, target.height, nfaces);
+
+    for (int k = 0; k < nfaces; k++) {
+        int i = order ? order[k] : k;
+        vec4 screen_coords[3];
+        for (int j = 0; j < 3; j++) {
+            screen_coords[j] = shader.vertex(i, j);
+        }
+        triangle(screen_coords, shader, target);
+    }
+}
+
+int draw_instanced(Model &model, IShader &shader, const std::vector<Instance> &instances, TGAImage &image, TGAImage &zbuffer) {
+    const mat<4,4> view = ModelView;
+    const int width  = image.get_width();
+    const int height = image.get_height();
+    const int nverts = model.nverts();
+    const int nfaces = model.nfaces();
+    ArenaScope scope;
+    vec4 *screen = frame_arena().allocate<vec4>(nverts); // 变换后的顶点，所有实例复用同一块内存
+    int drawn = 0;
+
+    for (int k = 0; k < (int)instances.size(); k++) {
+        const Instance &inst = instances[k];
+        ModelView = view * inst.transform;
+        mat<4,4> M = Viewport * Projection * ModelView;
+        if (!sphere_visible(M, model.bound_center(), model.bound_radius(), width, height)) {
+            continue;
+        }
+        drawn++;
+        shader.instance(inst.transform, inst.tint);
+
+        // 顶点只变换一次，而不是每个三角形的每个角各变换一次
+        // 按块批量取顶点（压缩存储时顺便解码），再做矩阵变换
+        const int BATCH = 256;
+        vec3 batch[BATCH];
+        for (int first = 0; first < nverts; first += BATCH) {
+            const int count = std::min(BATCH, nverts - first);
+            model.verts(first, count, batch);
+            for (int v = 0; v < count; v++) {
+                screen[first + v] = M * embed<4>(batch[v]);
+            }
+        }
+
+        for (int i = 0; i < nfaces; i++) {
+            vec4 screen_coords[3];
+            int outside[4] = {0, 0, 0, 0}; // 在屏幕左、右、下、上外侧的顶点数
+            for (int j = 0; j < 3; j++) {
+                const vec4 &p = screen[model.vert_index(i, j)];
+                outside[0] += p[0] < 0;
+                outside[1] += p[0] > width * p[3];
+                outside[2] += p[1] < 0;
+                outside[3] += p[1] > height * p[3];
+            }
+            // 三个顶点都在同一侧的外面，整个三角形都看不见
+            if (outside[0] == 3 || outside[1] == 3 || outside[2] == 3 || outside[3] == 3) {
+                continue;
+            }
+            for (int j = 0; j < 3; j++) {
+                screen_coords[j] = shader.vertex(i, j, screen[model.vert_index(i, j)]);
+            }
+            triangle(screen_coords, shader, image, zbuffer);
+        }
+    }
+
+    ModelView = view;
+    return drawn;
+}
@@ -0,0 +1,72 @@
+//
+//  render.h
+//  tinyrenderer
+//
+//  Created by skychx on 2021/3/2.
+//
+
+#ifndef __RENDER_H__
+#define __RENDER_H__
+
+#include <vector>
+#include "model.h"
+#include "our_gl.h"
+
+// 绘制模式，可以按位组合
+enum DrawMode {
+    DRAW_DEFAULT       = 0,      // 按 OBJ 文件里的顺序提交三角形
+    DRAW_FRONT_TO_BACK = 1 << 0, // 按视空间深度从近到远粗排序，减少被覆盖的片元
+    DRAW_DEPTH_PREPASS = 1 << 1, // 先只写深度和图元编号，再用 DEPTH_EQUAL 着色，每个像素只着色一次
+    DRAW_MESHLET_CULLING = 1 << 2, // 按 meshlet 整块剔除屏幕外和完全背对相机的三角形，和 DRAW_FRONT_TO_BACK 一起用时按 meshlet 排序
+    DRAW_AUTO_LOD      = 1 << 3, // 根据模型在屏幕上的大小选择 LOD（需要先调用 Model::build_lods）
+    DRAW_COARSE_2X2    = 1 << 4, // 这次绘制每 2x2 个像素着色一次（见 shading_rate），只对非 MSAA 的 draw_model 生效
+    DRAW_COARSE_4X4    = 1 << 5, // 每 4x4 个像素着色一次
+};
+
+// meshlet 剔除的统计
+struct MeshletStats {
+    unsigned long meshlets;       // 测试过的 meshlet 数
+    unsigned long frustum_culled; // 在视锥外的 meshlet 数
+    unsigned long cone_culled;    // 完全背对相机的 meshlet 数
+    unsigned long faces_culled;   // 因此跳过的三角形数
+};
+extern thread_local MeshletStats meshlet_stats;
+
+// 实例化绘制的每个实例：模型矩阵和颜色
+struct Instance {
+    mat<4,4> transform;
+    TGAColor tint;
+};
+
+// 下面几个函数返回的三角形顺序都分配在当前线程的帧内存上（frame_arena()），调用者用 ArenaScope 决定它们活多久
+
+// 按三角形重心的视空间深度从近到远排序（桶排序，只是粗排序），返回 nfaces 个下标
+const int *front_to_back_order(Model &model, const mat<4,4> &modelview);
+
+// 根据包围球在屏幕上的投影面积选择 LOD，保证每个三角形平均至少覆盖 pixels_per_triangle 个像素
+int select_lod(Model &model, const double pixels_per_triangle=2.);
+
+// 剔除 meshlet 后剩下的三角形，个数写进 count，sort 为 true 时按 meshlet 从近到远排序
+const int *visible_meshlet_faces(Model &model, const int width, const int height, const bool sort, int &count);
+
+// 按 mode 选择 LOD、做 meshlet 剔除和排序，得到三角形的绘制顺序和个数；返回 NULL 表示直接按模型里的顺序绘制
+const int *draw_order(Model &model, const int mode, const int width, const int height, int &count);
+
+// 只写深度，M 是模型坐标到屏幕坐标的变换矩阵，用于 shadow map 和 Z-prepass；order 为 NULL 时按模型里的顺序
+void draw_depth(Model &model, const mat<4,4> &M, TGAImage &zbuffer, const int *order=NULL, const int count=0);
+
+// Z-prepass 用的图元编号缓冲，大小和 zbuffer 一样、初始为 -1，分配在帧内存上
+int *prepass_ids(const TGAImage &zbuffer);
+
+// 用当前的 ModelView / Projection / Viewport 绘制整个模型
+void draw_model(Model &model, IShader &shader, TGAImage &image, TGAImage &zbuffer, const int mode=DRAW_DEFAULT);
+
+// 多重采样版本，不支持 DRAW_DEPTH_PREPASS（样本深度是浮点的，不能和 Z-prepass 的 8 位深度配合）和 DRAW_COARSE_*，调用者要先拒绝这些组合
+void draw_model(Model &model, IShader &shader, MultisampleBuffer &target, const int mode=DRAW_DEFAULT);
+
+// 实例化绘制：同一个模型画很多份，网格和贴图只有一份
+// 当前的 ModelView 作为相机矩阵，每个实例用包围球做视锥剔除，顶点位置按实例批量变换
+// 返回真正绘制的实例数
+int draw_instanced(Model &model, IShader &shader, const std::vector<Instance> &instances, TGAImage &image, TGAImage &zbuffer);
+
+#endif //__RENDER_H__
@@ -0,0 +1,307 @@
+//
+//  scene.cpp
+//  tinyrenderer
+//
+//  Created by skychx on 2021/4/1.
+//
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+#include <cmath>
+#include "scene.h"
+#include "shader.h"
+#include "arena.h"
+
+// 叶子节点最多放几个物体
+static const int BVH_LEAF_SIZE = 4;
+// 遍历用的栈，中位数划分的树深度是 log2(物体数)，64 层足够
+static const int BVH_STACK = 64;
+
+Scene::Scene() : models_(), materials_(), objects_(), nodes_(), index_(),
+    light_(1, 1, 1), eye_(1, 1, 3), center_(0, 0, 0), up_(0, 1, 0), shadow_extent_(1), stats_() {
+    light_.normalize();
+}
+
+Scene::~Scene() {
+    clear();
+}
+
+void Scene::clear() {
+    for (std::map<std::string, Model *>::iterator it = models_.begin(); it != models_.end(); ++it) {
+        delete it->second;
+    }
+    models_.clear();
+    materials_.clear();
+    objects_.clear();
+    nodes_.clear();
+    index_.clear();
+}
+
+bool Scene::load(const char *filename) {
+    clear();
+    std::ifstream in(filename);
+    if (!in.is_open()) {
+        std::cerr << "can't open scene " << filename << std::endl;
+        return false;
+    }
+    int nlights = 0;
+    std::string line;
+    for (int lineno = 1; std::getline(in, line); lineno++) {
+        std::istringstream iss(line);
+        std::string cmd;
+        if (!(iss >> cmd) || cmd[0] == '#') continue;
+
+        bool ok = true;
+        if (cmd == "model") {
+            std::string name, path;
+            ok = (bool)(iss >> name >> path);
+            if (ok && models_.count(name)) {
+                std::cerr << filename << ":" << lineno << ": model " << name << " is already defined" << std::endl;
+                return false;
+            }
+            if (ok) {
+                Model *m = new Model(path.c_str());
+                models_[name] = m;
+                if (m->nfaces() == 0) {
+                    std::cerr << filename << ":" << lineno << ": can't load model " << path << std::endl;
+                    return false;
+                }
+            }
+        } else if (cmd == "material") {
+            std::string name;
+            int r, g, b;
+            ok = (bool)(iss >> name >> r >> g >> b);
+            if (ok) materials_[name] = TGAColor(r, g, b);
+        } else if (cmd == "light") {
+            vec3 l;
+            ok = (bool)(iss >> l.x >> l.y >> l.z);
+            // 着色器只有一个平行光
+            if (ok && nlights++ == 1) {
+                std::cerr << filename << ":" << lineno << ": only one light is supported, using the last one" << std::endl;
+            }
+            if (ok) {
+                light_ = l;
+                light_.normalize();
+            }
+        } else if (cmd == "camera") {
+            ok = (bool)(iss >> eye_.x >> eye_.y >> eye_.z >> center_.x >> center_.y >> center_.z >> up_.x >> up_.y >> up_.z);
+        } else if (cmd == "shadow") {
+            ok = (bool)(iss >> shadow_extent_) && shadow_extent_ > 0;
+        } else if (cmd == "object") {
+            std::string name, material;
+            vec3 t;
+            ok = (bool)(iss >> name >> material >> t.x >> t.y >> t.z);
+            double angle = 0, scale = 1;
+            if (ok && (iss >> angle)) {
+                iss >> scale;
+            }
+            if (ok && !models_.count(name)) {
+                std::cerr << filename << ":" << lineno << ": unknown model " << name << std::endl;
+                return false;
+            }
+            if (ok && material != "-" && !materials_.count(material)) {
+                std::cerr << filename << ":" << lineno << ": unknown material " << material << std::endl;
+                return false;
+            }
+            if (ok) {
+                Object obj;
+                obj.model = models_[name];
+                obj.tint = material == "-" ? TGAColor(255, 255, 255) : materials_[material];
+                // 先缩放，再绕 y 轴旋转，最后平移
+                const double a = angle * M_PI / 180, c = std::cos(a) * scale, s = std::sin(a) * scale;
+                obj.transform = mat<4,4>::identity();
+                obj.transform[0][0] = c;  obj.transform[0][2] = s;
+                obj.transform[1][1] = scale;
+                obj.transform[2][0] = -s; obj.transform[2][2] = c;
+                for (int i = 0; i < 3; i++) obj.transform[i][3] = t[i];
+                // 包围球变换到世界坐标，再取外接的轴对齐包围盒
+                const vec3 center = proj<3>(obj.transform * embed<4>(obj.model->bound_center()));
+                const double r = obj.model->bound_radius() * std::abs(scale);
+                obj.lo = center - vec3(r, r, r);
+                obj.hi = center + vec3(r, r, r);
+                objects_.push_back(obj);
+            }
+        } else {
+            std::cerr << filename << ":" << lineno << ": unknown command " << cmd << std::endl;
+            return false;
+        }
+        if (!ok) {
+            std::cerr << filename << ":" << lineno << ": bad " << cmd << " line" << std::endl;
+            return false;
+        }
+    }
+    build();
+    return true;
+}
+
+int Scene::nobjects() const {
+    return (int)objects_.size();
+}
+
+void Scene::camera(const vec3 eye, const vec3 center, const vec3 up) {
+    eye_ = eye;
+    center_ = center;
+    up_ = up;
+}
+
+const SceneStats &Scene::stats() const {
+    return stats_;
+}
+
+void Scene::build() {
+    nodes_.clear();
+    index_.resize(objects_.size());
+    for (int i = 0; i < (int)index_.size(); i++) index_[i] = i;
+    if (index_.empty()) return;
+    // 物体数为 n 时最多 2n - 1 个节点，先预留好，递归时 nodes_ 不会重新分配
+    nodes_.reserve(2 * index_.size());
+    nodes_.push_back(Node());
+    build(0, 0, (int)index_.size());
+}
+
+// 自顶向下建树：包围盒最长的轴上按物体中心的中位数分成两半
+void Scene::build(const int node, const int first, const int count) {
+    Node &n = nodes_[node];
+    n.first = first;
+    n.count = count;
+    n.left = -1;
+    n.lo = objects_[index_[first]].lo;
+    n.hi = objects_[index_[first]].hi;
+    for (int k = first + 1; k < first + count; k++) {
+        const Object &obj = objects_[index_[k]];
+        for (int i = 0; i < 3; i++) {
+            n.lo[i] = std::min(n.lo[i], obj.lo[i]);
+            n.hi[i] = std::max(n.hi[i], obj.hi[i]);
+        }
+    }
+    if (count <= BVH_LEAF_SIZE) return;
+
+    const vec3 extent = n.hi - n.lo;
+    const int axis = extent.x >= extent.y && extent.x >= extent.z ? 0 : (extent.y >= extent.z ? 1 : 2);
+    const int half = count / 2;
+    std::nth_element(index_.begin() + first, index_.begin() + first + half, index_.begin() + first + count, [&](const int a, const int b) {
+        return objects_[a].lo[axis] + objects_[a].hi[axis] < objects_[b].lo[axis] + objects_[b].hi[axis];
+    });
+    const int left = (int)nodes_.size();
+    n.left = left;
+    nodes_.push_back(Node());
+    nodes_.push_back(Node());
+    build(left, first, half);
+    build(left + 1, first + half, count - half);
+}
+
+// 包围盒相对平面的位置：1 在正面，-1 在背面，0 跨过平面
+static int box_side(const vec4 &plane, const vec3 &lo, const vec3 &hi) {
+    vec3 p, q; // 沿平面法线最远和最近的两个角
+    for (int i = 0; i < 3; i++) {
+        p[i] = plane[i] >= 0 ? hi[i] : lo[i];
+        q[i] = plane[i] >= 0 ? lo[i] : hi[i];
+    }
+    if (plane * embed<4>(p) < 0) return -1;
+    if (plane * embed<4>(q) >= 0) return 1;
+    return 0;
+}
+
+// 把和视锥相交的物体编号写进 visible，返回个数；M 是世界坐标到屏幕坐标（除以 w 之前）的矩阵
+// 平面和 render.cpp 的 sphere_visible 一样：x >= 0, x <= width, y >= 0, y <= height, w > 0
+// 完全在视锥内的节点整棵子树直接收下，不再往下测试
+int Scene::cull_objects(const mat<4,4> &M, const int width, const int height, int *visible) {
+    const vec4 planes[5] = {
+        M[0],
+        M[3] * width - M[0],
+        M[1],
+        M[3] * height - M[1],
+        M[3],
+    };
+    int count = 0;
+    int stack[BVH_STACK];
+    int top = 0;
+    if (!nodes_.empty()) stack[top++] = 0;
+    while (top > 0) {
+        const Node &n = nodes_[stack[--top]];
+        stats_.nodes_visited++;
+        bool outside = false, inside = true;
+        for (int i = 0; i < 5 && !outside; i++) {
+            const int side = box_side(planes[i], n.lo, n.hi);
+            outside = side < 0;
+            inside &= side > 0;
+        }
+        if (outside) continue;
+        if (inside) {
+            std::copy(index_.begin() + n.first, index_.begin() + n.first + n.count, visible + count);
+            count += n.count;
+        } else if (n.left >= 0) {
+            stack[top++] = n.left;
+            stack[top++] = n.left + 1;
+        } else {
+            for (int k = n.first; k < n.first + n.count; k++) {
+                const Object &obj = objects_[index_[k]];
+                bool hit = true;
+                for (int i = 0; i < 5 && hit; i++) {
+                    hit = box_side(planes[i], obj.lo, obj.hi) >= 0;
+                }
+                if (hit) visible[count++] = index_[k];
+            }
+        }
+    }
+    // 按场景文件里的顺序画，和不剔除时的绘制顺序一样
+    std::sort(visible, visible + count);
+    return count;
+}
+
+void Scene::render(TGAImage &frame, TGAImage &zbuffer, TGAImage &shadowbuffer, const int mode, const bool cull) {
+    const int width = frame.get_width(), height = frame.get_height();
+    const int n = (int)objects_.size();
+    stats_ = SceneStats();
+    stats_.objects = n;
+    ArenaScope scope;
+    int *visible = frame_arena().allocate<int>(n);
+    int nvisible = n;
+
+    // 第一遍：光源视角的深度图，平行投影，把 [-extent, extent] 缩放到 [-1, 1]
+    lookat(light_, center_, up_);
+    projection(0);
+    viewport(width / 8, height / 8, width * 3/4, height * 3/4);
+    mat<4,4> S = mat<4,4>::identity();
+    S[0][0] = S[1][1] = S[2][2] = 1. / shadow_extent_;
+    const mat<4,4> M_shadow = Viewport * Projection * S * ModelView;
+    if (cull) {
+        nvisible = cull_objects(M_shadow, shadowbuffer.get_width(), shadowbuffer.get_height(), visible);
+    } else {
+        for (int i = 0; i < n; i++) visible[i] = i;
+    }
+    for (int k = 0; k < nvisible; k++) {
+        const Object &obj = objects_[visible[k]];
+        draw_depth(*obj.model, M_shadow * obj.transform, shadowbuffer);
+    }
+    stats_.shadow_drawn = nvisible;
+
+    // 第二遍：相机视角
+    lookat(eye_, center_, up_);
+    projection(-1.f / (eye_ - center_).norm());
+    viewport(width / 8, height / 8, width * 3/4, height * 3/4);
+    const mat<4,4> view = ModelView;
+    const mat<4,4> M = Viewport * Projection * view;
+    if (cull) {
+        nvisible = cull_objects(M, width, height, visible);
+    } else {
+        for (int i = 0; i < n; i++) visible[i] = i;
+        nvisible = n;
+    }
+
+    GouraudShader shader(NULL, light_);
+    shader.shadowbuffer = &shadowbuffer;
+    shader.uniform_Mshadow = M_shadow * M.invert();
+    for (int k = 0; k < nvisible; k++) {
+        const Object &obj = objects_[visible[k]];
+        ModelView = view * obj.transform;
+        shader.model = obj.model;
+        shader.instance(obj.transform, obj.tint);
+        draw_model(*obj.model, shader, frame, zbuffer, mode);
+    }
+    ModelView = view;
+    stats_.drawn = nvisible;
+    stats_.culled = n - nvisible;
+}
@@ -0,0 +1,81 @@
+//
+//  scene.h
+//  tinyrenderer
+//
+//  Created by skychx on 2021/4/1.
+//
+
+#ifndef __SCENE_H__
+#define __SCENE_H__
+
+#include <map>
+#include <string>
+#include <vector>
+#include "geometry.h"
+#include "model.h"
+#include "tgaimage.h"
+#include "render.h"
+
+struct SceneStats {
+    int objects;       // 场景里的物体数
+    int nodes_visited; // 两遍剔除一共访问的 BVH 节点数
+    int culled;        // 相机这一遍被剔除的物体数
+    int drawn;         // 相机这一遍画了的物体数
+    int shadow_drawn;  // 阴影这一遍画了的物体数
+};
+
+// 多物体场景：场景文件列出模型、材质、光源、相机和物体，物体按世界坐标的包围盒组织成 BVH
+// 每一遍绘制先用视锥遍历 BVH，整棵子树在视锥外时直接跳过，只有可见的物体才会进到逐三角形的流程里
+//
+// 场景文件每行一条，# 开头的是注释：
+//   model <名字> <obj 路径>
+//   material <名字> <r> <g> <b>          物体的颜色，乘到固有纹理上
+//   light <x> <y> <z>                    平行光的方向，只支持一个
+//   camera <eye xyz> <center xyz> <up xyz>
+//   shadow <extent>                      阴影图覆盖的世界范围 [-extent, extent]，默认 1
+//   object <模型> <材质|-> <x> <y> <z> [绕 y 轴旋转的角度 [缩放]]
+class Scene {
+public:
+    Scene();
+    ~Scene();
+    // 出错时在 std::cerr 上报告行号并返回 false
+    bool load(const char *filename);
+    int nobjects() const;
+    void camera(const vec3 eye, const vec3 center, const vec3 up);
+    // 画到 frame 上，zbuffer 和 shadowbuffer 由调用者清零；cull 为 false 时不做 BVH 剔除，用来对比
+    // 相机前面的物体被剔除时本来就画不到屏幕上，结果和不剔除完全一样；
+    // 光栅化没有近平面裁剪，相机后面的物体不剔除时会被投影到错误的位置，剔除掉反而是对的
+    void render(TGAImage &frame, TGAImage &zbuffer, TGAImage &shadowbuffer, const int mode=DRAW_DEFAULT, const bool cull=true);
+    const SceneStats &stats() const;
+
+private:
+    struct Object {
+        Model *model;
+        mat<4,4> transform;
+        TGAColor tint;
+        vec3 lo, hi; // 世界坐标的包围盒
+    };
+
+    // 子树里的物体是 index_[first, first + count)；内部节点的两个孩子是 left 和 left + 1，叶子节点 left 为 -1
+    struct Node {
+        vec3 lo, hi;
+        int left;
+        int first, count;
+    };
+
+    std::map<std::string, Model *> models_;
+    std::map<std::string, TGAColor> materials_;
+    std::vector<Object> objects_;
+    std::vector<Node> nodes_;
+    std::vector<int> index_;
+    vec3 light_, eye_, center_, up_;
+    double shadow_extent_;
+    SceneStats stats_;
+
+    void clear();
+    void build();
+    void build(const int node, const int first, const int count);
+    int cull_objects(const mat<4,4> &M, const int width, const int height, int *visible);
+};
+
+#endif //__SCENE_H__
@@ -0,0 +1,461 @@
+//
+//  server.cpp
+//  tinyrenderer
+//
+//  Created by skychx on 2021/3/26.
+//
+
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <map>
+#include <set>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <cerrno>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "server.h"
+#include "render.h"
+#include "shader.h"
+#include "progressive.h"
+
+// 一个客户端：stdin/stdout 或者一个 socket 连接，多个工作线程可能同时回复，写之前加锁
+// socket 的 fd 归 Connection 所有，最后一个引用释放时才关闭：客户端断开后队列里的任务还拿着连接，
+// 提前关掉的话这个号码可能已经被 accept 分给了别的客户端，回复就会发错人
+struct Connection {
+    int fd;
+    bool socket;
+    std::mutex lock;
+    std::shared_ptr<CancelToken> preview; // 这个连接上正在进行的渐进预览
+
+    Connection(const int out_fd, const bool is_socket=false) : fd(out_fd), socket(is_socket), lock(), preview() {
+#if defined(SO_NOSIGPIPE) && !defined(MSG_NOSIGNAL)
+        // macOS 没有 MSG_NOSIGNAL，在 socket 上关掉 SIGPIPE
+        const int on = 1;
+        if (socket) ::setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &on, sizeof(on));
+#endif
+    }
+
+    ~Connection() {
+        if (socket) ::close(fd);
+    }
+
+    // 取消上一个渐进预览，返回新预览的取消标记
+    std::shared_ptr<CancelToken> restart_preview() {
+        std::lock_guard<std::mutex> guard(lock);
+        if (preview) preview->cancel();
+        preview = std::make_shared<CancelToken>();
+        return preview;
+    }
+
+    bool send(const std::string &line, const std::string *payload=NULL) {
+        std::lock_guard<std::mutex> guard(lock);
+        return write_all(line.data(), line.size()) && (!payload || write_all(payload->data(), payload->size()));
+    }
+
+private:
+    bool write_all(const char *p, size_t n) {
+        while (n > 0) {
+            // 对方已经断开时 write 会触发 SIGPIPE 把整个服务器杀掉，socket 上用 send 只返回错误
+#ifdef MSG_NOSIGNAL
+            ssize_t w = socket ? ::send(fd, p, n, MSG_NOSIGNAL) : ::write(fd, p, n);
+#else
+            ssize_t w = socket ? ::send(fd, p, n, 0) : ::write(fd, p, n);
+#endif
+            if (w <= 0) return false;
+            p += w;
+            n -= w;
+        }
+        return true;
+    }
+};
+
+struct Job {
+    std::shared_ptr<Connection> conn;
+    std::string tag;
+    std::map<std::string, std::string> args;
+    std::shared_ptr<CancelToken> token; // 渐进预览才有
+};
+
+// 每个工作线程常驻的 render target，尺寸不变时只清零，不重新分配
+struct RenderTargets {
+    TGAImage frame, zbuffer, shadowbuffer;
+    ProgressiveTargets progressive; // 渐进预览每一遍的 render target，同样常驻
+    std::string encoded; // out=- 时编码出来的 TGA，容量会保留下来
+
+    void prepare(const int width, const int height) {
+        if (frame.get_width() != width || frame.get_height() != height) {
+            frame        = TGAImage(width, height, TGAImage::RGB);
+            zbuffer      = TGAImage(width, height, TGAImage::GRAYSCALE);
+            shadowbuffer = TGAImage(width, height, TGAImage::GRAYSCALE);
+        } else {
+            frame.clear();
+            zbuffer.clear();
+            shadowbuffer.clear();
+        }
+    }
+};
+
+// 把输出流接到一个 std::string 上，清空时 string 的容量不会释放
+struct StringBuf : public std::streambuf {
+    std::string &s;
+    StringBuf(std::string &str) : s(str) {}
+    virtual int_type overflow(int_type c) {
+        if (c != traits_type::eof()) s.push_back((char)c);
+        return c;
+    }
+    virtual std::streamsize xsputn(const char *p, std::streamsize n) {
+        s.append(p, (size_t)n);
+        return n;
+    }
+};
+
+class RenderServer {
+public:
+    RenderServer(const int nworkers) : models_(), models_lock_(), jobs_(), jobs_lock_(), jobs_cond_(), idle_cond_(), busy_(0), stopping_(false), workers_(), sequence_(0) {
+        for (int i = 0; i < nworkers; i++) workers_.push_back(std::thread(&RenderServer::worker, this));
+    }
+
+    // 等队列里的请求都处理完再退出
+    ~RenderServer() {
+        {
+            std::lock_guard<std::mutex> guard(jobs_lock_);
+            stopping_ = true;
+        }
+        jobs_cond_.notify_all();
+        for (size_t i = 0; i < workers_.size(); i++) workers_[i].join();
+    }
+
+    // 处理一行请求；load/unload 在读请求的线程里同步执行，保证之后的请求能看到模型；返回 false 表示 quit
+    bool handle(const std::shared_ptr<Connection> &conn, const std::string &line) {
+        std::istringstream in(line);
+        std::string cmd, token;
+        in >> cmd;
+        if (cmd.empty()) return true;
+        Job job;
+        job.conn = conn;
+        while (in >> token) {
+            size_t eq = token.find('=');
+            if (eq == std::string::npos) continue;
+            job.args[token.substr(0, eq)] = token.substr(eq + 1);
+        }
+        const long seq = sequence_++;
+        job.tag = job.args.count("tag") ? job.args["tag"] : std::to_string(seq);
+
+        if (cmd == "quit") {
+            drain();
+            conn->send(job.tag + " ok\n");
+            return false;
+        }
+        if (cmd == "load") {
+            load(job);
+        } else if (cmd == "unload") {
+            std::lock_guard<std::mutex> guard(models_lock_);
+            bool found = models_.erase(job.args["name"]) > 0;
+            conn->send(job.tag + (found ? " ok\n" : " error unknown model\n"));
+        } else if (cmd == "render") {
+            if (job.args["progressive"] == "1") {
+                job.token = conn->restart_preview();
+            }
+            {
+                std::lock_guard<std::mutex> guard(jobs_lock_);
+                jobs_.push_back(job);
+            }
+            jobs_cond_.notify_one();
+        } else {
+            conn->send(job.tag + " error unknown command " + cmd + "\n");
+        }
+        return true;
+    }
+
+private:
+    std::map<std::string, std::shared_ptr<Model> > models_;
+    std::mutex models_lock_;
+    std::deque<Job> jobs_;
+    std::mutex jobs_lock_;
+    std::condition_variable jobs_cond_;
+    std::condition_variable idle_cond_;
+    int busy_; // 正在渲染的请求数
+    bool stopping_;
+    std::vector<std::thread> workers_;
+    std::atomic<long> sequence_;
+
+    // 等已经提交的 render 都回复以后再返回
+    void drain() {
+        std::unique_lock<std::mutex> guard(jobs_lock_);
+        idle_cond_.wait(guard, [this] { return jobs_.empty() && busy_ == 0; });
+    }
+
+    void load(Job &job) {
+        const std::string name = job.args["name"], path = job.args["path"];
+        if (name.empty() || path.empty()) {
+            job.conn->send(job.tag + " error load needs name and path\n");
+            return;
+        }
+        std::shared_ptr<Model> model = std::make_shared<Model>(path.c_str());
+        if (!model->nfaces()) {
+            job.conn->send(job.tag + " error can't load " + path + "\n");
+            return;
+        }
+        std::lock_guard<std::mutex> guard(models_lock_);
+        models_[name] = model;
+        job.conn->send(job.tag + " ok " + std::to_string(model->nfaces()) + "\n");
+    }
+
+    void worker() {
+        RenderTargets targets;
+        for (;;) {
+            Job job;
+            {
+                std::unique_lock<std::mutex> guard(jobs_lock_);
+                jobs_cond_.wait(guard, [this] { return stopping_ || !jobs_.empty(); });
+                if (jobs_.empty()) return;
+                job = jobs_.front();
+                jobs_.pop_front();
+                busy_++;
+            }
+            render(job, targets);
+            {
+                std::lock_guard<std::mutex> guard(jobs_lock_);
+                busy_--;
+            }
+            idle_cond_.notify_all();
+        }
+    }
+
+    static bool parse_vec3(const std::map<std::string, std::string> &args, const char *key, vec3 &v) {
+        std::map<std::string, std::string>::const_iterator it = args.find(key);
+        if (it == args.end()) return true;
+        return std::sscanf(it->second.c_str(), "%lf,%lf,%lf", &v.x, &v.y, &v.z) == 3;
+    }
+
+    // 模型被多个线程共享，所以不支持会修改模型的 DRAW_AUTO_LOD
+    static bool parse_mode(const std::string &s, int &mode) {
+        std::istringstream in(s);
+        std::string flag;
+        while (std::getline(in, flag, ',')) {
+            if      (flag == "front-to-back") mode |= DRAW_FRONT_TO_BACK;
+            else if (flag == "prepass")       mode |= DRAW_DEPTH_PREPASS;
+            else if (flag == "meshlets")      mode |= DRAW_MESHLET_CULLING;
+            else if (flag == "coarse2")       mode |= DRAW_COARSE_2X2;
+            else if (flag == "coarse4")       mode |= DRAW_COARSE_4X4;
+            else if (!flag.empty()) return false;
+        }
+        return true;
+    }
+
+    void render(Job &job, RenderTargets &rt) {
+        const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        std::map<std::string, std::string> &args = job.args;
+
+        std::shared_ptr<Model> model;
+        {
+            std::lock_guard<std::mutex> guard(models_lock_);
+            std::map<std::string, std::shared_ptr<Model> >::iterator it = models_.find(args["model"]);
+            if (it != models_.end()) model = it->second;
+        }
+        if (!model) {
+            job.conn->send(job.tag + " error unknown model\n");
+            return;
+        }
+
+        const int width  = args.count("width")  ? std::atoi(args["width"].c_str())  : 800;
+        const int height = args.count("height") ? std::atoi(args["height"].c_str()) : 800;
+        vec3 eye(1, 1, 3), center(0, 0, 0), up(0, 1, 0), light(1, 1, 1);
+        int mode = DRAW_DEFAULT;
+        if (width <= 0 || height <= 0 || width > 8192 || height > 8192 || !parse_vec3(args, "eye", eye) || !parse_vec3(args, "center", center) ||
+            !parse_vec3(args, "up", up) || !parse_vec3(args, "light", light) || !parse_mode(args["mode"], mode)) {
+            job.conn->send(job.tag + " error bad arguments\n");
+            return;
+        }
+        light.normalize();
+
+        if (job.token) {
+            // 渐进预览总是按顺序画，不支持绘制模式
+            if (mode != DRAW_DEFAULT) {
+                job.conn->send(job.tag + " error mode is not supported with progressive\n");
+                return;
+            }
+            render_preview(job, model.get(), eye, center, up, light, width, height, rt, start);
+            return;
+        }
+        rt.prepare(width, height);
+
+        // 第一遍：光源视角的深度图，和 main 里的 drawShadowBuffer 一样
+        lookat(light, center, up);
+        projection(0);
+        viewport(width / 8, height / 8, width * 3/4, height * 3/4);
+        mat<4,4> M_shadow = Viewport * Projection * ModelView;
+        draw_depth(*model, M_shadow, rt.shadowbuffer);
+
+        // 第二遍：相机视角
+        lookat(eye, center, up);
+        projection(-1.f / (eye - center).norm());
+        viewport(width / 8, height / 8, width * 3/4, height * 3/4);
+        GouraudShader shader(model.get(), light);
+        shader.shadowbuffer = &rt.shadowbuffer;
+        shader.uniform_Mshadow = M_shadow * (Viewport * Projection * ModelView).invert();
+        draw_model(*model, shader, rt.frame, rt.zbuffer, mode);
+        rt.frame.flip_vertically();
+        reply(job, rt.frame, rt, "ok", start);
+    }
+
+    // 渐进预览：1/4、1/2、完整分辨率（msaa=N 时再加一遍多重采样）各回复一次 "<tag> pass <k> <毫秒> [字节数]"，
+    // 全部完成后回复 "<tag> ok <毫秒>"；同一个连接上新的预览请求会取消它，这时回复 "<tag> cancelled"
+    void render_preview(Job &job, Model *model, const vec3 eye, const vec3 center, const vec3 up, const vec3 light, const int width, const int height,
+                        RenderTargets &rt, const std::chrono::steady_clock::time_point start) {
+        ProgressiveScene scene = {model, eye, center, up, light, width, height};
+        const std::vector<ProgressivePass> passes = progressive_passes(job.args.count("msaa") ? std::atoi(job.args["msaa"].c_str()) : 1);
+        for (size_t k = 0; k < passes.size(); k++) {
+            const int msaa = passes[k].msaa;
+            if (msaa != 1 && msaa != 2 && msaa != 4 && msaa != 8) {
+                job.conn->send(job.tag + " error bad arguments\n");
+                return;
+            }
+        }
+        const int done = render_progressive(scene, passes, *job.token, [&](TGAImage &frame, const int pass, const ProgressivePass &) {
+            frame.flip_vertically();
+            return reply(job, frame, rt, "pass " + std::to_string(pass), start);
+        }, &rt.progressive);
+        if (done < (int)passes.size()) {
+            job.conn->send(job.tag + (job.token->cancelled() ? " cancelled\n" : " error can't write output\n"));
+            return;
+        }
+        std::ostringstream line;
+        line << job.tag << " ok " << std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count() << "\n";
+        job.conn->send(line.str());
+    }
+
+    // 按 out 参数写出 frame（已经 flip 过），回复 "<tag> <status> <毫秒>"，out=- 时后面跟字节数和 TGA 数据
+    bool reply(Job &job, TGAImage &frame, RenderTargets &rt, const std::string &status, const std::chrono::steady_clock::time_point start) {
+        const std::string out = job.args["out"];
+        bool ok = true;
+        if (out == "-") {
+            rt.encoded.clear();
+            StringBuf buf(rt.encoded);
+            std::ostream os(&buf);
+            ok = frame.write_tga(os);
+        } else if (!out.empty()) {
+            ok = frame.write_tga_file(out.c_str());
+        }
+        if (!ok) {
+            job.conn->send(job.tag + " error can't write output\n");
+            return false;
+        }
+
+        const double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+        std::ostringstream line;
+        line << job.tag << " " << status << " " << ms;
+        if (out == "-") {
+            line << " " << rt.encoded.size() << "\n";
+            job.conn->send(line.str(), &rt.encoded);
+        } else {
+            line << "\n";
+            job.conn->send(line.str());
+        }
+        return true;
+    }
+};
+
+// 按行读一个文件描述符，读到 quit 返回 false，连接断开返回 true
+static bool serve_connection(RenderServer &server, const int in_fd, const std::shared_ptr<Connection> &conn) {
+    std::string pending;
+    char buf[4096];
+    for (;;) {
+        ssize_t n = ::read(in_fd, buf, sizeof(buf));
+        if (n <= 0) return true;
+        pending.append(buf, n);
+        size_t nl;
+        while ((nl = pending.find('\n')) != std::string::npos) {
+            std::string line = pending.substr(0, nl);
+            pending.erase(0, nl + 1);
+            if (!server.handle(conn, line)) return false;
+        }
+    }
+}
+
+int run_server(const char *socket_path, const int workers) {
+    const int nworkers = workers > 0 ? workers : std::max(1, (int)std::thread::hardware_concurrency());
+
+    if (!socket_path) {
+        RenderServer server(nworkers);
+        serve_connection(server, 0, std::make_shared<Connection>(1));
+        return 0;
+    }
+
+    int listener = ::socket(AF_UNIX, SOCK_STREAM, 0);
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (listener < 0 || strlen(socket_path) >= sizeof(addr.sun_path)) {
+        std::cerr << "can't create socket " << socket_path << std::endl;
+        return 1;
+    }
+    strncpy(addr.sun_path, socket_path, sizeof(addr.sun_path) - 1);
+    ::unlink(socket_path);
+    if (::bind(listener, (struct sockaddr *)&addr, sizeof(addr)) < 0 || ::listen(listener, 16) < 0) {
+        std::cerr << "can't listen on " << socket_path << std::endl;
+        ::close(listener);
+        return 1;
+    }
+    std::cerr << "listening on " << socket_path << std::endl;
+
+    // 还连着的客户端：读线程是 detach 的，退出时从这里删掉自己；quit 时要把它们都叫醒
+    std::mutex clients_lock;
+    std::condition_variable clients_done;
+    std::set<int> clients;
+    bool quit = false;
+    {
+        RenderServer server(nworkers);
+        for (;;) {
+            int fd = ::accept(listener, NULL, NULL);
+            if (fd < 0) {
+                std::lock_guard<std::mutex> guard(clients_lock);
+                if (quit) break; // quit 时 listener 被 shutdown
+                if (errno == EINTR || errno == ECONNABORTED || errno == EPROTO) continue;
+                std::cerr << "accept failed: " << strerror(errno) << std::endl;
+                break;
+            }
+            std::lock_guard<std::mutex> guard(clients_lock);
+            if (quit) {
+                ::close(fd);
+                break;
+            }
+            clients.insert(fd);
+            std::thread([&, fd]() {
+                // fd 由 Connection 关闭，这里不能关；conn 要活到从 clients 里删掉以后，保证 quit 时 shutdown 的 fd 还没被关掉
+                std::shared_ptr<Connection> conn = std::make_shared<Connection>(fd, true);
+                const bool more = serve_connection(server, fd, conn);
+                std::lock_guard<std::mutex> guard(clients_lock);
+                clients.erase(fd);
+                if (!more && !quit) {
+                    // 停止接受新连接，其他还在 read() 里等着的客户端也让它们读到 EOF
+                    quit = true;
+                    ::shutdown(listener, SHUT_RDWR);
+                    for (std::set<int>::iterator it = clients.begin(); it != clients.end(); ++it) ::shutdown(*it, SHUT_RD);
+                }
+                // 在锁里通知：主线程拿到锁之前这个线程不会再碰 run_server 栈上的东西
+                clients_done.notify_all();
+            }).detach();
+        }
+        // 等所有读线程结束，之后 server 析构时把队列里剩下的任务做完
+        std::unique_lock<std::mutex> guard(clients_lock);
+        while (!clients.empty()) {
+            for (std::set<int>::iterator it = clients.begin(); it != clients.end(); ++it) ::shutdown(*it, SHUT_RD);
+            clients_done.wait(guard);
+        }
+    }
+    ::close(listener);
+    ::unlink(socket_path);
+    return 0;
+}
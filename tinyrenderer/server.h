@@ -0,0 +1,27 @@
+//
+//  server.h
+//  tinyrenderer
+//
+//  Created by skychx on 2021/3/26.
+//
+
+#ifndef __SERVER_H__
+#define __SERVER_H__
+
+// 常驻的渲染服务：模型、贴图和 render target 加载一次以后一直留在内存里，每个请求只花绘制的时间
+// socket_path 为 NULL 时从 stdin 读请求、往 stdout 写回复，否则监听这个 Unix socket，可以同时有多个连接
+// 渲染请求由 workers 个工作线程并发处理，0 表示按 CPU 核数
+//
+// 协议是一行一个请求，参数是 key=value，用空格分开：
+//   load name=head path=obj/african_head.obj
+//   unload name=head
+//   render model=head [tag=T] [width=800] [height=800] [eye=1,1,3] [center=0,0,0] [up=0,1,0] [light=1,1,1]
+//          [mode=front-to-back,prepass,meshlets,coarse2,coarse4] [out=PATH | out=-] [progressive=1 [msaa=N]]
+//   quit
+// 每个请求回复一行 "<tag> ok ..." 或者 "<tag> error <原因>"，tag 默认是请求的序号
+// render 回复 "<tag> ok <毫秒>"；out=- 时回复 "<tag> ok <毫秒> <字节数>"，后面紧跟这么多字节的 TGA 文件
+// progressive=1 时先回复低分辨率的预览，逐步细化（见 render_preview），同一个连接上新的预览会取消旧的；预览不支持 mode
+// 并发的 render 可能乱序完成，用 tag 对应请求
+int run_server(const char *socket_path, const int workers=0);
+
+#endif //__SERVER_H__
@@ -0,0 +1,211 @@
+//
+//  shader.h
+//  tinyrenderer
+//
+//  Created by skychx on 2021/3/26.
+//
+
+#ifndef __SHADER_H__
+#define __SHADER_H__
+
+#include <algorithm>
+#include <vector>
+#include "geometry.h"
+#include "model.h"
+#include "our_gl.h"
+#include "fastmath.h"
+
+extern thread_local mat<4,4> ModelView;
+extern thread_local mat<4,4> Projection;
+extern thread_local mat<4,4> Viewport;
+
+// varying 布局：uv 2 个、法线 3 个、屏幕空间齐次坐标 4 个（插值后再除 w，算阴影用）
+enum { VARYING_UV = 0, VARYING_NRM = 2, VARYING_POS = 5, VARYING_COUNT = 9 };
+
+// 片元除光照以外的全部计算结果，延迟着色时存进 G-buffer，换光源时直接拿来重新算光照
+struct Surface {
+    vec3 n;          // 法线贴图变换后的法线
+    vec3 pos;        // 片元在 framebuffer 屏幕空间的位置，算阴影用
+    TGAColor albedo; // 固有纹理
+    TGAColor tint;   // 实例的颜色
+    float shininess; // 镜面贴图的值
+};
+
+// 每个像素最终可见的表面，object 为 -1 表示没有被画到
+struct GBuffer {
+    int width, height;
+    std::vector<Surface> surfaces;
+    std::vector<int> object;
+
+    GBuffer() : width(0), height(0), surfaces(), object() {}
+    void resize(const int w, const int h) {
+        width = w;
+        height = h;
+        surfaces.resize((size_t)w * h);
+        object.assign((size_t)w * h, -1);
+    }
+    // 清掉 [x0, x1] x [y0, y1] 里的像素
+    void clear(const int x0, const int y0, const int x1, const int y1) {
+        for (int y = y0; y <= y1; y++) {
+            std::fill(object.begin() + x0 + (size_t)y * width, object.begin() + x1 + 1 + (size_t)y * width, -1);
+        }
+    }
+};
+
+struct GouraudShader : public IVaryingShader {
+    // written by vertex shader, read by fragment shader
+    // 三角形的顶点数据都在 varying 里（求切线空间时直接读三个顶点的值），这样着色器可以复制给多个线程用
+    mat<4,4> uniform_Mshadow; // 把 framebuffer 屏幕坐标变换到 shadow buffer 屏幕坐标
+    TGAImage *shadowbuffer = NULL; // 光源视角的深度图，为 NULL 时不计算阴影
+    TGAColor uniform_tint = TGAColor(255, 255, 255); // 实例的颜色，乘到固有纹理上
+    Model *model;             // 着色器只读模型，同一个模型可以同时被多个着色器使用
+    vec3 uniform_light;       // 光源方向（世界坐标）
+    vec3 uniform_l;           // 光源方向变换到相机的投影空间，见 view()
+    GBuffer *gbuffer = NULL;  // 不为 NULL 时把每个写进 framebuffer 的片元的表面属性存下来
+    int uniform_object = 0;   // 存进 G-buffer 的物体编号
+    Surface last_surface;     // 最近一次 fragment() 的表面属性
+
+    GouraudShader(Model *m, const vec3 light) : IVaryingShader(VARYING_COUNT), model(m), uniform_light(light), uniform_l(), last_surface() {
+        view(ModelView);
+    }
+
+    virtual IVaryingShader *clone() const {
+        return new GouraudShader(*this);
+    }
+
+    // 第 i 个顶点归一化后的屏幕坐标和 uv
+    vec3 vertex_ndc(const int i) const {
+        const float *p = varying[i] + VARYING_POS;
+        return vec3(p[0] / p[3], p[1] / p[3], p[2] / p[3]);
+    }
+    vec2 vertex_uv(const int i) const {
+        return vec2(varying[i][VARYING_UV], varying[i][VARYING_UV + 1]);
+    }
+
+    virtual vec4 vertex(int iface, int nthvert) {
+        // 从 .obj 文件读取三角形顶点数据
+        vec4 gl_Vertex = embed<4>(model->vert(iface, nthvert));
+        // MVP & Viewport 变换
+        gl_Vertex = Viewport * Projection * ModelView * gl_Vertex;
+        return vertex(iface, nthvert, gl_Vertex);
+    }
+
+    // 顶点位置已经变换好了，只计算 varying
+    virtual vec4 vertex(int iface, int nthvert, vec4 gl_Vertex) {
+        // 获取顶点的贴图位置信息
+        vec2 uv = model->uv(iface, nthvert);
+        // 􏳻􏰓􏰔􏰪􏰫􏰇􏳼􏳽􏳾􏰪􏰫􏳻􏰓􏰔􏰪􏰫􏰇􏳼􏳽􏳾􏰪􏰫􏳻􏰓􏰔􏰪􏰫􏰇􏳼􏳽􏳾􏰪􏰫法线贴图读到的法线 * 变换矩阵的逆转置矩阵
+        vec3 nrm = proj<3>((Projection * ModelView).invert_transpose() * embed<4>(model->normal(iface, nthvert), 0.f));
+
+        float *v = varying[nthvert];
+        for (int i = 0; i < 2; i++) v[VARYING_UV + i]  = uv[i];
+        for (int i = 0; i < 3; i++) v[VARYING_NRM + i] = nrm[i];
+        for (int i = 0; i < 4; i++) v[VARYING_POS + i] = gl_Vertex[i];
+        return gl_Vertex;
+    }
+
+    virtual void instance(const mat<4,4> &, const TGAColor &tint) {
+        uniform_tint = tint;
+    }
+
+    virtual void store(const int x, const int y) {
+        if (gbuffer) {
+            const size_t idx = x + (size_t)y * gbuffer->width;
+            gbuffer->surfaces[idx] = last_surface;
+            gbuffer->object[idx] = uniform_object;
+        }
+    }
+
+    // 光照方向只由视图矩阵决定：光源是世界坐标里的方向，按 w = 0 变换，不带物体自己的旋转、缩放和平移
+    // 构造时用当时的 ModelView 算一次，画多个物体时 ModelView 换成 view * transform 也不受影响
+    void view(const mat<4,4> &V) {
+        uniform_l = fast_normalize(proj<3>(Projection * V * embed<4>(uniform_light, 0.f)));
+    }
+
+    vec3 light_vector() const {
+        return uniform_l;
+    }
+
+    // v 是管线做过透视校正插值的 varying
+    void surface(const float *v, Surface &s) const {
+        vec2 uv(v[VARYING_UV], v[VARYING_UV + 1]);
+        vec3 bn = fast_normalize(vec3(v[VARYING_NRM], v[VARYING_NRM + 1], v[VARYING_NRM + 2]));
+        
+        // 从切线空间贴图求解法线
+        // 数学推导可见：https://github.com/ssloy/tinyrenderer/wiki/Lesson-6bis-tangent-space-normal-mapping
+        // 用三角形的三个特殊点（三个顶点 P_0、P_1、P_2）计算出 A -> AI -> B
+        // (P_0->P_1)_x  (P_0->P_1)_y  (P_0->P_1)_z
+        // (P_0->P_2)_x  (P_0->P_2)_y  (P_0->P_2)_z
+        //         bn_x          bn_y          bn_z
+        mat<3,3> A;
+        A[0] = vertex_ndc(1) - vertex_ndc(0);
+        A[1] = vertex_ndc(2) - vertex_ndc(0);
+        A[2] = bn;
+        
+        // AI 是 A 的逆矩阵
+        mat<3,3> AI = A.invert();
+        
+        vec2 duv1 = vertex_uv(1) - vertex_uv(0), duv2 = vertex_uv(2) - vertex_uv(0);
+        vec3 i = AI * vec3(duv1.x, duv2.x, 0);
+        vec3 j = AI * vec3(duv1.y, duv2.y, 0);
+        
+        // 切线空间的基
+        // 这里的 B 其实就是 TBN_World 矩阵
+        mat<3,3> B;
+        B.set_col(0, fast_normalize(i));
+        B.set_col(1, fast_normalize(j));
+        B.set_col(2, bn);
+        
+        // 法线（做了一个基变换，切线空间基向量 * 切线空间的法线向量，得到的是世界坐标系下的法线向量）
+        s.n = fast_normalize(B * model->normal(uv));
+        s.shininess = model->specular(uv);
+        // 固有纹理
+        s.albedo = model->diffuse(uv);
+        s.tint = uniform_tint;
+        vec4 pos;
+        for (int k = 0; k < 4; k++) pos[k] = v[VARYING_POS + k];
+        s.pos = proj<3>(pos / pos[3]);
+    }
+
+    // 光照：l 是 light_vector()
+    TGAColor lighting(const Surface &s, const vec3 &l) const {
+        const vec3 &n = s.n;
+        // reflected light direction
+        vec3 r = fast_normalize(n * (n * l * 2.f) - l);
+        
+        // 镜面高亮
+        // specular intensity, note that the camera lies on the z-axis (in ndc), therefore simple r.z
+        float spec = spec_pow(r.z, s.shininess);
+        // 漫反射
+        float diff = std::max<float>(0.f, n * l);
+        const TGAColor &c = s.albedo;
+        
+        // 阴影：把当前片元变换到光源视角的屏幕空间，和 shadow buffer 里的深度比较
+        float lit = 1.f;
+        if (shadowbuffer) {
+            vec4 sb_p = uniform_Mshadow * embed<4>(s.pos);
+            lit = .3f + .7f * shadow(*shadowbuffer, proj<3>(sb_p / sb_p[3]), 1);
+        }
+        
+        TGAColor color = c;
+        
+        // Phong reflection model
+        //   5: ambient component
+        //   1: diffuse component
+        // 0.6: specular component
+        const float k = lit * (diff + .6f * spec) / 255.f;
+        for (int i = 0; i < 3; i++) {
+            color[i] = std::min(5.f + c.bgra[i] * s.tint.bgra[i] * k, 255.f);
+        }
+        return color;
+    }
+
+    virtual bool fragment(const vec3, const float *v, TGAColor &color) {
+        surface(v, last_surface);
+        color = lighting(last_surface, light_vector());
+        // no, we do not discard this pixel
+        return false;
+    }
+};
+
+#endif //__SHADER_H__
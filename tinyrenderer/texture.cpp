@@ -0,0 +1,442 @@
+//
+//  texture.cpp
+//  tinyrenderer
+//
+//  Created by skychx on 2021/3/16.
+//
+
+#include <iostream>
+#include <fstream>
+#include <cstring>
+#include <algorithm>
+#include <cmath>
+#include <chrono>
+#include <cstdio>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "texture.h"
+
+CompressedTexture::CompressedTexture() : format_(BC1), width(0), height(0), bw(0), blocks() {
+}
+
+int CompressedTexture::block_bytes() const {
+    return format_ == BC5 ? 16 : 8;
+}
+
+int CompressedTexture::get_width() const {
+    return width;
+}
+
+int CompressedTexture::get_height() const {
+    return height;
+}
+
+bool CompressedTexture::empty() const {
+    return blocks.empty();
+}
+
+size_t CompressedTexture::size_bytes() const {
+    return blocks.size();
+}
+
+/////////////////////////////////////////////////////////////////////////////////
+// 编码
+
+static unsigned short pack565(const int r, const int g, const int b) {
+    return (unsigned short)(((r * 31 + 127) / 255) << 11 | ((g * 63 + 127) / 255) << 5 | ((b * 31 + 127) / 255));
+}
+
+static void unpack565(const unsigned short c, int rgb[3]) {
+    rgb[0] = (c >> 11) & 31; rgb[0] = (rgb[0] << 3) | (rgb[0] >> 2);
+    rgb[1] = (c >> 5)  & 63; rgb[1] = (rgb[1] << 2) | (rgb[1] >> 4);
+    rgb[2] =  c        & 31; rgb[2] = (rgb[2] << 3) | (rgb[2] >> 2);
+}
+
+// BC1：取颜色在主方向上投影的两个极值做端点，每个像素选最近的调色板颜色
+static void encode_bc1(const unsigned char px[16][3], unsigned char *out) {
+    int mean[3] = {0, 0, 0};
+    for (int i = 0; i < 16; i++)
+        for (int k = 0; k < 3; k++) mean[k] += px[i][k];
+    // 用协方差的符号估计主方向：以 G 为基准，R 和 B 和 G 正相关还是负相关
+    int cov_rg = 0, cov_bg = 0;
+    for (int i = 0; i < 16; i++) {
+        int g = px[i][1] * 16 - mean[1];
+        cov_rg += (px[i][0] * 16 - mean[0]) * g;
+        cov_bg += (px[i][2] * 16 - mean[2]) * g;
+    }
+    const int axis[3] = {cov_rg < 0 ? -1 : 1, 1, cov_bg < 0 ? -1 : 1};
+    int imin = 0, imax = 0, pmin = 1 << 30, pmax = -(1 << 30);
+    for (int i = 0; i < 16; i++) {
+        int p = px[i][0] * axis[0] + px[i][1] * axis[1] + px[i][2] * axis[2];
+        if (p < pmin) { pmin = p; imin = i; }
+        if (p > pmax) { pmax = p; imax = i; }
+    }
+    unsigned short c0 = pack565(px[imax][0], px[imax][1], px[imax][2]);
+    unsigned short c1 = pack565(px[imin][0], px[imin][1], px[imin][2]);
+    // c0 > c1 表示 4 色模式
+    if (c0 < c1) std::swap(c0, c1);
+
+    int palette[4][3];
+    unpack565(c0, palette[0]);
+    unpack565(c1, palette[1]);
+    for (int k = 0; k < 3; k++) {
+        palette[2][k] = (2 * palette[0][k] + palette[1][k]) / 3;
+        palette[3][k] = (palette[0][k] + 2 * palette[1][k]) / 3;
+    }
+    unsigned int indices = 0;
+    if (c0 != c1) {
+        for (int i = 0; i < 16; i++) {
+            int best = 0, best_d = 1 << 30;
+            for (int j = 0; j < 4; j++) {
+                int d = 0;
+                for (int k = 0; k < 3; k++) d += (px[i][k] - palette[j][k]) * (px[i][k] - palette[j][k]);
+                if (d < best_d) { best_d = d; best = j; }
+            }
+            indices |= (unsigned int)best << (2 * i);
+        }
+    }
+    out[0] = c0 & 0xff; out[1] = c0 >> 8;
+    out[2] = c1 & 0xff; out[3] = c1 >> 8;
+    for (int k = 0; k < 4; k++) out[4 + k] = (indices >> (8 * k)) & 0xff;
+}
+
+// BC4：两个端点取最大最小值，中间插值 6 个值，每个像素 3 bit 下标
+static void encode_bc4(const unsigned char px[16], unsigned char *out) {
+    int e0 = 0, e1 = 255;
+    for (int i = 0; i < 16; i++) {
+        e0 = std::max(e0, (int)px[i]);
+        e1 = std::min(e1, (int)px[i]);
+    }
+    int palette[8];
+    palette[0] = e0;
+    palette[1] = e1;
+    for (int j = 1; j < 7; j++) palette[j + 1] = ((7 - j) * e0 + j * e1) / 7;
+    unsigned long long indices = 0;
+    if (e0 != e1) {
+        for (int i = 0; i < 16; i++) {
+            int best = 0, best_d = 1 << 30;
+            for (int j = 0; j < 8; j++) {
+                int d = std::abs(px[i] - palette[j]);
+                if (d < best_d) { best_d = d; best = j; }
+            }
+            indices |= (unsigned long long)best << (3 * i);
+        }
+    }
+    out[0] = (unsigned char)e0;
+    out[1] = (unsigned char)e1;
+    for (int k = 0; k < 6; k++) out[2 + k] = (indices >> (8 * k)) & 0xff;
+}
+
+bool CompressedTexture::compress(const TGAImage &img, const Format format) {
+    const int bpp = img.get_bytespp();
+    if (img.get_width() <= 0 || (format == BC4 && bpp != TGAImage::GRAYSCALE) || (format != BC4 && bpp < TGAImage::RGB)) {
+        std::cerr << "can't compress texture: bad format" << std::endl;
+        return false;
+    }
+    format_ = format;
+    width  = img.get_width();
+    height = img.get_height();
+    bw = (width + 3) / 4;
+    const int bh = (height + 3) / 4;
+    blocks.assign((size_t)bw * bh * block_bytes(), 0);
+
+    for (int by = 0; by < bh; by++) {
+        for (int bx = 0; bx < bw; bx++) {
+            // 取出 4x4 块，超出图片的部分用边缘像素填充；颜色按 RGB 顺序
+            unsigned char px[16][3];
+            for (int i = 0; i < 16; i++) {
+                int x = std::min(bx * 4 + i % 4, width - 1);
+                int y = std::min(by * 4 + i / 4, height - 1);
+                // 用 get 取像素，映射的贴图行可能是倒序存放的
+                const TGAColor c = img.get(x, y);
+                const unsigned char *p = c.bgra;
+                for (int k = 0; k < 3; k++) px[i][k] = bpp == 1 ? p[0] : p[2 - k];
+            }
+            unsigned char *out = &blocks[((size_t)bx + (size_t)by * bw) * block_bytes()];
+            if (format == BC1) {
+                encode_bc1(px, out);
+            } else {
+                // BC4 存第一个通道，BC5 存 R 和 G
+                unsigned char ch[16];
+                for (int c = 0; c < (format == BC5 ? 2 : 1); c++) {
+                    for (int i = 0; i < 16; i++) ch[i] = px[i][c];
+                    encode_bc4(ch, out + 8 * c);
+                }
+            }
+        }
+    }
+    return true;
+}
+
+/////////////////////////////////////////////////////////////////////////////////
+// 解码：只解码一个像素
+
+static inline int decode_bc4(const unsigned char *block, const int i) {
+    const int e0 = block[0], e1 = block[1];
+    // 3 bit 下标可能跨字节，从 48 bit 的下标里取出来
+    const int bit = 3 * i;
+    const int byte = 2 + bit / 8;
+    int bits = block[byte] | (byte + 1 < 8 ? block[byte + 1] << 8 : 0);
+    const int idx = (bits >> (bit % 8)) & 7;
+    if (idx == 0) return e0;
+    if (idx == 1) return e1;
+    if (e0 > e1) return ((8 - idx) * e0 + (idx - 1) * e1) / 7;
+    // e0 <= e1 时是 6 值模式（编码器不会生成，按标准解码）
+    if (idx == 6) return 0;
+    if (idx == 7) return 255;
+    return ((6 - idx) * e0 + (idx - 1) * e1) / 5;
+}
+
+TGAColor CompressedTexture::get(int x, int y) const {
+    if (blocks.empty() || x < 0 || y < 0 || x >= width || y >= height) {
+        return TGAColor();
+    }
+    const unsigned char *block = &blocks[((size_t)(x >> 2) + (size_t)(y >> 2) * bw) * block_bytes()];
+    const int i = (x & 3) + (y & 3) * 4;
+
+    if (format_ == BC4) {
+        return TGAColor((unsigned char)decode_bc4(block, i));
+    }
+    if (format_ == BC5) {
+        const int r = decode_bc4(block, i);
+        const int g = decode_bc4(block + 8, i);
+        // 从 x y 重建法线的 z：x^2 + y^2 + z^2 = 1
+        const float nx = r / 255.f * 2.f - 1.f, ny = g / 255.f * 2.f - 1.f;
+        const float nz = std::sqrt(std::max(0.f, 1.f - nx * nx - ny * ny));
+        return TGAColor((unsigned char)r, (unsigned char)g, (unsigned char)((nz + 1.f) * .5f * 255.f + .5f));
+    }
+
+    const unsigned short c0 = block[0] | block[1] << 8;
+    const unsigned short c1 = block[2] | block[3] << 8;
+    const int idx = (block[4 + i / 4] >> (2 * (i % 4))) & 3;
+    int a[3], b[3], rgb[3];
+    unpack565(c0, a);
+    unpack565(c1, b);
+    for (int k = 0; k < 3; k++) {
+        switch (idx) {
+            case 0: rgb[k] = a[k]; break;
+            case 1: rgb[k] = b[k]; break;
+            case 2: rgb[k] = c0 > c1 ? (2 * a[k] + b[k]) / 3 : (a[k] + b[k]) / 2; break;
+            default: rgb[k] = c0 > c1 ? (a[k] + 2 * b[k]) / 3 : 0; break;
+        }
+    }
+    TGAColor c((unsigned char)rgb[0], (unsigned char)rgb[1], (unsigned char)rgb[2]);
+    c.bytespp = 3;
+    return c;
+}
+
+/////////////////////////////////////////////////////////////////////////////////
+// 磁盘缓存，格式：魔数 + 格式 + 宽高 + 块数据
+
+static const char BC_MAGIC[4] = {'T', 'R', 'B', 'C'};
+
+bool CompressedTexture::write_file(const char *filename) {
+    std::ofstream out(filename, std::ios::binary);
+    if (!out.is_open()) {
+        std::cerr << "can't open file " << filename << "\n";
+        return false;
+    }
+    int header[3] = {format_, width, height};
+    out.write(BC_MAGIC, sizeof(BC_MAGIC));
+    out.write((char *)header, sizeof(header));
+    out.write((char *)blocks.data(), blocks.size());
+    if (!out.good()) {
+        std::cerr << "can't dump the compressed texture\n";
+        return false;
+    }
+    return true;
+}
+
+bool CompressedTexture::read_file(const char *filename) {
+    std::ifstream in(filename, std::ios::binary);
+    if (!in.is_open()) {
+        return false;
+    }
+    char magic[4];
+    int header[3];
+    in.read(magic, sizeof(magic));
+    in.read((char *)header, sizeof(header));
+    if (!in.good() || memcmp(magic, BC_MAGIC, sizeof(magic)) ||
+        (header[0] != BC1 && header[0] != BC4 && header[0] != BC5) || header[1] <= 0 || header[2] <= 0) {
+        std::cerr << "bad compressed texture " << filename << "\n";
+        return false;
+    }
+    format_ = (Format)header[0];
+    width  = header[1];
+    height = header[2];
+    bw = (width + 3) / 4;
+    blocks.resize((size_t)bw * ((height + 3) / 4) * block_bytes());
+    in.read((char *)blocks.data(), blocks.size());
+    if (!in.good()) {
+        std::cerr << "an error occured while reading the compressed texture\n";
+        blocks.clear();
+        return false;
+    }
+    return true;
+}
+
+/////////////////////////////////////////////////////////////////////////////////
+// 贴图缓存
+
+TextureCache::TextureCache() : mutex_(), entries_(), lru_(), by_content_(), budget_((size_t)256 << 20), bytes_(0), hits_(0), misses_(0) {
+}
+
+TextureCache &TextureCache::instance() {
+    static TextureCache cache;
+    return cache;
+}
+
+void TextureCache::set_budget(const size_t bytes) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    budget_ = bytes;
+    evict();
+}
+
+size_t TextureCache::bytes() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return bytes_;
+}
+
+int TextureCache::hits() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return hits_;
+}
+
+int TextureCache::misses() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return misses_;
+}
+
+// 找到已有的条目并移到 LRU 最前面，没有的话启动后台解码
+std::shared_future<TextureCache::Texture> TextureCache::lookup(const std::string &path) {
+    std::unordered_map<std::string, Entry>::iterator it = entries_.find(path);
+    if (it != entries_.end()) {
+        hits_++;
+        lru_.splice(lru_.begin(), lru_, it->second.lru);
+        return it->second.image;
+    }
+    misses_++;
+    lru_.push_front(path);
+    Entry &e = entries_[path];
+    e.bytes = 0;
+    e.decoded = false;
+    e.lru = lru_.begin();
+    e.image = std::async(std::launch::async, &TextureCache::decode, this, path).share();
+    return e.image;
+}
+
+void TextureCache::prefetch(const std::string &path) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    lookup(path);
+}
+
+TextureCache::Texture TextureCache::get(const std::string &path) {
+    std::shared_future<Texture> image;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        image = lookup(path);
+    }
+    return image.get();
+}
+
+// 64 位 FNV-1a
+static unsigned long long hash_bytes(const unsigned char *p, const size_t n) {
+    unsigned long long h = 14695981039346656037ULL;
+    for (size_t i = 0; i < n; i++) {
+        h = (h ^ p[i]) * 1099511628211ULL;
+    }
+    return h;
+}
+
+// 解码后的贴图按尺寸和像素查重
+static unsigned long long image_key(TGAImage &img) {
+    const size_t n = (size_t)img.get_width() * img.get_height() * img.get_bytespp();
+    return n ? hash_bytes(img.buffer(), n) ^ ((unsigned long long)img.get_width() << 32 | img.get_height() << 8 | img.get_bytespp()) : 0;
+}
+
+// 先写到临时文件再 rename 成 .raw：别的进程（比如正在运行的 --server）可能映射着旧的副本，
+// 原地截断重写会让它们读到被截掉的页收到 SIGBUS，同时加载的进程也可能映射到写了一半的文件
+static void write_raw_copy(TGAImage &img, const std::string &raw) {
+    const std::string tmp = raw + ".tmp" + std::to_string(getpid());
+    if (!img.write_tga_file(tmp.c_str(), false) || std::rename(tmp.c_str(), raw.c_str()) != 0) {
+        std::remove(tmp.c_str());
+    }
+}
+
+// 文件所在的设备和 inode，同一个文件的不同路径（链接）得到同一个值
+static unsigned long long file_key(const std::string &path) {
+    struct stat st;
+    if (stat(path.c_str(), &st) != 0) return 0;
+    return ((unsigned long long)st.st_dev * 1099511628211ULL) ^ (unsigned long long)st.st_ino;
+}
+
+// 不压缩的 TGA 直接映射文件，不读取、不解码也不翻转，加载是 O(1) 的，映射的页在同一台机器的进程之间共享
+// RLE 压缩的贴图第一次加载时解码，在旁边写一份不压缩的 .raw 副本，副本比原文件新时以后直接映射副本
+TextureCache::Texture TextureCache::decode(const std::string &path) {
+    std::shared_ptr<TGAImage> img = std::make_shared<TGAImage>();
+    const std::string raw = path + ".raw";
+    std::string file = path;
+    bool mapped = img->map_tga_file(path.c_str());
+    struct stat src, cache;
+    if (!mapped && stat(path.c_str(), &src) == 0 && stat(raw.c_str(), &cache) == 0 && cache.st_mtime >= src.st_mtime) {
+        file = raw;
+        mapped = img->map_tga_file(raw.c_str());
+    }
+
+    // 先查重：映射的文件按 inode，其他的解码一次后按像素，不同路径下的同一张贴图直接共享
+    unsigned long long key;
+    bool ok = mapped;
+    if (mapped) {
+        key = file_key(file);
+    } else {
+        ok = img->read_tga_file(path.c_str());
+        key = image_key(*img);
+    }
+
+    Texture tex;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        tex = by_content_[key].lock();
+    }
+    const bool shared = (bool)tex;
+    if (!tex) {
+        if (!mapped && ok) write_raw_copy(*img, raw);
+        std::cerr << "texture file " << file << (mapped ? " mapping " : " loading ") << (ok ? "ok" : "failed") << std::endl;
+        // 映射的贴图只改行的寻址方向
+        img->flip_vertically();
+        tex = img;
+    }
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    by_content_[key] = tex;
+    std::unordered_map<std::string, Entry>::iterator it = entries_.find(path);
+    if (it != entries_.end() && !it->second.decoded) {
+        it->second.decoded = true;
+        // 映射的贴图在页缓存里，不占堆内存，不计入预算
+        it->second.bytes = shared || tex->is_mapped() ? 0 : (size_t)tex->get_width() * tex->get_height() * tex->get_bytespp();
+        bytes_ += it->second.bytes;
+        evict();
+    }
+    return tex;
+}
+
+// 从最久没用的开始淘汰，还在解码的条目和刚用过的那一个保留
+void TextureCache::evict() {
+    std::list<std::string>::iterator it = lru_.end();
+    while (bytes_ > budget_ && it != lru_.begin()) {
+        --it;
+        if (it == lru_.begin()) break;
+        Entry &e = entries_[*it];
+        // 还在解码的不能删：删掉最后一个 future 会等待解码线程结束
+        if (!e.decoded || e.image.wait_for(std::chrono::seconds(0)) != std::future_status::ready) continue;
+        bytes_ -= e.bytes;
+        std::string path = *it;
+        it = lru_.erase(it);
+        entries_.erase(path);
+    }
+    // 清理已经没人引用的内容哈希
+    for (std::unordered_map<unsigned long long, std::weak_ptr<const TGAImage> >::iterator h = by_content_.begin(); h != by_content_.end();) {
+        if (h->second.expired()) h = by_content_.erase(h);
+        else ++h;
+    }
+}
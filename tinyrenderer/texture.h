@@ -0,0 +1,86 @@
+//
+//  texture.h
+//  tinyrenderer
+//
+//  Created by skychx on 2021/3/16.
+//
+
+#ifndef __TEXTURE_H__
+#define __TEXTURE_H__
+
+#include <vector>
+#include <string>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <future>
+#include <unordered_map>
+#include "tgaimage.h"
+
+// 块压缩贴图：每 4x4 个像素压成一个定长的块，采样时只解码用到的那一个像素
+//   BC1: RGB，每块 8 字节（4 bit/像素），用于固有色贴图
+//   BC4: 单通道，每块 8 字节，用于镜面贴图
+//   BC5: 两个 BC4 通道，每块 16 字节，用于切线空间法线贴图（只存 x y，z 在采样时重建）
+class CompressedTexture {
+public:
+    enum Format {
+        BC1=1, BC4=4, BC5=5
+    };
+
+    CompressedTexture();
+    bool compress(const TGAImage &img, const Format format);
+    bool read_file(const char *filename);  // 读取压缩结果的磁盘缓存
+    bool write_file(const char *filename);
+    TGAColor get(int x, int y) const;      // 返回的颜色格式和原始贴图一致（BC1/BC5 是 RGB，BC4 是 GRAYSCALE）
+    int get_width() const;
+    int get_height() const;
+    bool empty() const;
+    size_t size_bytes() const;
+
+private:
+    Format format_;
+    int width, height;
+    int bw;                            // 每行的块数
+    std::vector<unsigned char> blocks;
+    int block_bytes() const;
+};
+
+// 进程内共享的贴图缓存：同一个路径（或者内容完全相同的文件）只解码一次，各个 Model 共享只读的贴图
+// 总内存超过预算时按 LRU 淘汰，被淘汰的贴图在仍被引用时继续有效，只是下次要重新解码
+// 贴图解码后已经上下翻转，和 Model 的 uv 约定一致；不压缩的贴图直接映射文件（见 TGAImage::map_tga_file）
+class TextureCache {
+public:
+    typedef std::shared_ptr<const TGAImage> Texture;
+
+    static TextureCache &instance();
+    void set_budget(const size_t bytes);
+    void prefetch(const std::string &path); // 在后台线程开始解码，不等待
+    Texture get(const std::string &path);   // 等待解码完成；读取失败时返回空图片，不会返回 NULL
+    size_t bytes();                         // 缓存里解码完成的贴图占用的堆内存，映射的贴图不算
+    int hits();
+    int misses();
+
+private:
+    struct Entry {
+        std::shared_future<Texture> image;
+        size_t bytes;                           // 和别的条目共享内容时为 0
+        bool decoded;
+        std::list<std::string>::iterator lru;
+    };
+    std::mutex mutex_;
+    std::unordered_map<std::string, Entry> entries_;
+    std::list<std::string> lru_;            // 最近用过的在前面
+    std::unordered_map<unsigned long long, std::weak_ptr<const TGAImage> > by_content_; // 文件内容哈希（映射的文件用 inode）-> 贴图
+    size_t budget_;
+    size_t bytes_;
+    int hits_, misses_;
+
+    TextureCache();
+    TextureCache(const TextureCache &);
+    TextureCache &operator =(const TextureCache &);
+    std::shared_future<Texture> lookup(const std::string &path); // 调用前要持有 mutex_
+    Texture decode(const std::string &path);
+    void evict();                                                // 调用前要持有 mutex_
+};
+
+#endif //__TEXTURE_H__
@@ -3,43 +3,80 @@
 #include <string.h>
 #include <time.h>
 #include <math.h>
+#include <algorithm>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include "tgaimage.h"
 
-TGAImage::TGAImage() : data(NULL), width(0), height(0), bytespp(0) {
+TGAImage::TGAImage() : data(NULL), width(0), height(0), bytespp(0), mapping(NULL), mapping_bytes(0), flipped(false),
+    tile_cleared(), pending_clear(false), clear_color(), tiles_x(0) {
 }
 
-TGAImage::TGAImage(int w, int h, int bpp) : data(NULL), width(w), height(h), bytespp(bpp) {
+// 不 memset：所有 tile 标记成清零，没有画到的 tile 永远不会被写，大图片的这些页也不会真的分配
+TGAImage::TGAImage(int w, int h, int bpp) : data(NULL), width(w), height(h), bytespp(bpp), mapping(NULL), mapping_bytes(0), flipped(false),
+    tile_cleared(), pending_clear(false), clear_color(), tiles_x(0) {
     unsigned long nbytes = width*height*bytespp;
     data = new unsigned char[nbytes];
-    memset(data, 0, nbytes);
+    clear();
 }
 
-TGAImage::TGAImage(const TGAImage &img) : data(NULL), width(img.width), height(img.height), bytespp(img.bytespp) {
+// 复制出来的总是普通的图片，行按 get/set 的顺序存放；快速清除的标记一起复制，不填 tile
+TGAImage::TGAImage(const TGAImage &img) : data(NULL), width(img.width), height(img.height), bytespp(img.bytespp), mapping(NULL), mapping_bytes(0), flipped(false),
+    tile_cleared(), pending_clear(false), clear_color(), tiles_x(0) {
     unsigned long nbytes = width*height*bytespp;
     data = new unsigned char[nbytes];
-    memcpy(data, img.data, nbytes);
+    if (!img.flipped) {
+        memcpy(data, img.data, nbytes);
+        tile_cleared = img.tile_cleared;
+        pending_clear = img.pending_clear;
+        memcpy(clear_color, img.clear_color, sizeof(clear_color));
+        tiles_x = img.tiles_x;
+    } else {
+        unsigned long bytes_per_line = width*bytespp;
+        for (int j=0; j<height; j++) {
+            img.read_row(height-1-j, data+j*bytes_per_line);
+        }
+    }
 }
 
 TGAImage::~TGAImage() {
-    if (data) delete [] data;
+    release();
+}
+
+void TGAImage::release() {
+    if (mapping) {
+        munmap(mapping, mapping_bytes);
+    } else if (data) {
+        delete [] data;
+    }
+    data = NULL;
+    mapping = NULL;
+    mapping_bytes = 0;
+    flipped = false;
+    pending_clear = false;
 }
 
 TGAImage & TGAImage::operator =(const TGAImage &img) {
     if (this != &img) {
-        if (data) delete [] data;
-        width  = img.width;
-        height = img.height;
-        bytespp = img.bytespp;
-        unsigned long nbytes = width*height*bytespp;
-        data = new unsigned char[nbytes];
-        memcpy(data, img.data, nbytes);
+        TGAImage tmp(img);
+        release();
+        width  = tmp.width;
+        height = tmp.height;
+        bytespp = tmp.bytespp;
+        data = tmp.data;
+        tmp.data = NULL;
+        tile_cleared.swap(tmp.tile_cleared);
+        pending_clear = tmp.pending_clear;
+        memcpy(clear_color, tmp.clear_color, sizeof(clear_color));
+        tiles_x = tmp.tiles_x;
     }
     return *this;
 }
 
 bool TGAImage::read_tga_file(const char *filename) {
-    if (data) delete [] data;
-    data = NULL;
+    release();
     std::ifstream in;
     in.open (filename, std::ios::binary);
     if (!in.is_open()) {
@@ -93,6 +130,51 @@ bool TGAImage::read_tga_file(const char *filename) {
     return true;
 }
 
+bool TGAImage::map_tga_file(const char *filename) {
+    release();
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+    struct stat st;
+    TGA_Header header;
+    if (fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(header) || pread(fd, &header, sizeof(header), 0) != (ssize_t)sizeof(header)) {
+        close(fd);
+        return false;
+    }
+    const int bpp = (unsigned char)header.bitsperpixel>>3;
+    // 图片数据在文件头、图片 ID 和调色板之后
+    const size_t offset = sizeof(header) + (unsigned char)header.idlength
+                        + (header.colormaptype ? (size_t)(unsigned short)header.colormaplength * (((unsigned char)header.colormapdepth+7)>>3) : 0);
+    const size_t nbytes = (size_t)header.width*header.height*bpp;
+    if ((2!=header.datatypecode && 3!=header.datatypecode) || (header.imagedescriptor & 0x10) ||
+        header.width<=0 || header.height<=0 || (bpp!=GRAYSCALE && bpp!=RGB && bpp!=RGBA) || offset+nbytes > (size_t)st.st_size) {
+        close(fd);
+        return false;
+    }
+    // 私有映射：只读的时候和页缓存共享，写的时候才复制
+    void *p = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED) {
+        std::cerr << "can't map file " << filename << "\n";
+        return false;
+    }
+    mapping = p;
+    mapping_bytes = st.st_size;
+    data = (unsigned char *)p + offset;
+    width   = header.width;
+    height  = header.height;
+    bytespp = bpp;
+    // 原点在左下角时文件里的第一行是最下面一行，和 read_tga_file 翻转后的顺序相反
+    flipped = !(header.imagedescriptor & 0x20);
+    std::cerr << width << "x" << height << "/" << bytespp*8 << " mapped\n";
+    return true;
+}
+
+bool TGAImage::is_mapped() const {
+    return mapping != NULL;
+}
+
 bool TGAImage::load_rle_data(std::ifstream &in) {
     unsigned long pixelcount = width*height;
     unsigned long currentpixel = 0;
@@ -143,9 +225,6 @@ bool TGAImage::load_rle_data(std::ifstream &in) {
 }
 
 bool TGAImage::write_tga_file(const char *filename, bool rle) {
-    unsigned char developer_area_ref[4] = {0, 0, 0, 0};
-    unsigned char extension_area_ref[4] = {0, 0, 0, 0};
-    unsigned char footer[18] = {'T','R','U','E','V','I','S','I','O','N','-','X','F','I','L','E','.','\0'};
     std::ofstream out;
     out.open (filename, std::ios::binary);
     if (!out.is_open()) {
@@ -153,29 +232,53 @@ bool TGAImage::write_tga_file(const char *filename, bool rle) {
         out.close();
         return false;
     }
+    bool ok = write_tga(out, rle);
+    out.close();
+    return ok;
+}
+
+// 写到任意的输出流（文件、内存），格式和 write_tga_file 一样
+bool TGAImage::write_tga(std::ostream &out, bool rle) {
+    unsigned char developer_area_ref[4] = {0, 0, 0, 0};
+    unsigned char extension_area_ref[4] = {0, 0, 0, 0};
+    unsigned char footer[18] = {'T','R','U','E','V','I','S','I','O','N','-','X','F','I','L','E','.','\0'};
     TGA_Header header;
     memset((void *)&header, 0, sizeof(header));
     header.bitsperpixel = bytespp<<3;
     header.width  = width;
     header.height = height;
     header.datatypecode = (bytespp==GRAYSCALE?(rle?11:3):(rle?10:2));
-    header.imagedescriptor = 0x20; // top-left origin
+    header.imagedescriptor = flipped ? 0x00 : 0x20; // 内存里的第一行是最上面一行时 top-left origin，倒序时 bottom-left
     out.write((char *)&header, sizeof(header));
     if (!out.good()) {
-        out.close();
         std::cerr << "can't dump the tga file\n";
         return false;
     }
-    if (!rle) {
+    if (!rle && !pending_clear) {
         out.write((char *)data, width*height*bytespp);
         if (!out.good()) {
             std::cerr << "can't unload raw data\n";
-            out.close();
+            return false;
+        }
+    } else if (!rle) {
+        // 有快速清除的 tile 时按行拼出来再写，不去填那些 tile
+        unsigned char row[CLEAR_TILE*4];
+        for (int y=0; y<height; y++) {
+            for (int x=0; x<width; x+=CLEAR_TILE) {
+                const int n = std::min((int)CLEAR_TILE, width-x);
+                const unsigned char *p = tile_cleared[(unsigned)x/CLEAR_TILE + (unsigned)y/CLEAR_TILE*tiles_x] ? NULL : data+(x+y*width)*bytespp;
+                if (!p) {
+                    for (int i=0; i<n; i++) memcpy(row+i*bytespp, clear_color, bytespp);
+                }
+                out.write((char *)(p ? p : row), n*bytespp);
+            }
+        }
+        if (!out.good()) {
+            std::cerr << "can't unload raw data\n";
             return false;
         }
     } else {
         if (!unload_rle_data(out)) {
-            out.close();
             std::cerr << "can't unload rle data\n";
             return false;
         }
@@ -183,41 +286,43 @@ bool TGAImage::write_tga_file(const char *filename, bool rle) {
     out.write((char *)developer_area_ref, sizeof(developer_area_ref));
     if (!out.good()) {
         std::cerr << "can't dump the tga file\n";
-        out.close();
         return false;
     }
     out.write((char *)extension_area_ref, sizeof(extension_area_ref));
     if (!out.good()) {
         std::cerr << "can't dump the tga file\n";
-        out.close();
         return false;
     }
     out.write((char *)footer, sizeof(footer));
     if (!out.good()) {
         std::cerr << "can't dump the tga file\n";
-        out.close();
         return false;
     }
-    out.close();
     return true;
 }
 
+// 内存里第 idx 个像素的地址，快速清除过的 tile 返回 clear_color
+const unsigned char *TGAImage::pixel_at(const unsigned long idx) const {
+    if (!pending_clear) return data+idx*bytespp;
+    const int x = idx%width, y = idx/width;
+    return tile_cleared[(unsigned)x/CLEAR_TILE + (unsigned)y/CLEAR_TILE*tiles_x] ? clear_color : data+idx*bytespp;
+}
+
 // TODO: it is not necessary to break a raw chunk for two equal pixels (for the matter of the resulting size)
-bool TGAImage::unload_rle_data(std::ofstream &out) {
+// 快速清除过的 tile 不读内存：两个像素都指向 clear_color 时一定相等，
+// 重复段走到清除过的 tile 里时直接跳到这一行里连续清除的 tile 的末尾，输出和逐个比较完全一样
+bool TGAImage::unload_rle_data(std::ostream &out) {
     const unsigned char max_chunk_length = 128;
     unsigned long npixels = width*height;
     unsigned long curpix = 0;
+    unsigned char chunk[max_chunk_length*4];
     while (curpix<npixels) {
-        unsigned long chunkstart = curpix*bytespp;
-        unsigned long curbyte = curpix*bytespp;
         unsigned char run_length = 1;
         bool raw = true;
         while (curpix+run_length<npixels && run_length<max_chunk_length) {
-            bool succ_eq = true;
-            for (int t=0; succ_eq && t<bytespp; t++) {
-                succ_eq = (data[curbyte+t]==data[curbyte+t+bytespp]);
-            }
-            curbyte += bytespp;
+            const unsigned char *a = pixel_at(curpix+run_length-1);
+            const unsigned char *b = pixel_at(curpix+run_length);
+            bool succ_eq = a==b || !memcmp(a, b, bytespp);
             if (1==run_length) {
                 raw = !succ_eq;
             }
@@ -229,6 +334,22 @@ bool TGAImage::unload_rle_data(std::ofstream &out) {
                 break;
             }
             run_length++;
+            if (!raw && b==clear_color) {
+                // b 所在的 tile 以及同一行后面连续清除过的 tile 都和 b 相等
+                const unsigned long idx = curpix+run_length-1;
+                const int x = idx%width, y = idx/width;
+                int tx = x/CLEAR_TILE;
+                while (tx+1<tiles_x && tile_cleared[tx+1 + (y/CLEAR_TILE)*tiles_x]) tx++;
+                const unsigned long end = y*(unsigned long)width + std::min(width, (tx+1)*CLEAR_TILE);
+                run_length = (unsigned char)std::min<unsigned long>(max_chunk_length, run_length + (end-idx-1));
+            }
+        }
+        const unsigned char *first = pixel_at(curpix);
+        if (raw && pending_clear) {
+            for (int i=0; i<run_length; i++) {
+                memcpy(chunk+i*bytespp, pixel_at(curpix+i), bytespp);
+            }
+            first = chunk;
         }
         curpix += run_length;
         out.put(raw?run_length-1:run_length+127);
@@ -236,7 +357,7 @@ bool TGAImage::unload_rle_data(std::ofstream &out) {
             std::cerr << "can't dump the tga file\n";
             return false;
         }
-        out.write((char *)(data+chunkstart), (raw?run_length*bytespp:bytespp));
+        out.write((char *)first, (raw?run_length*bytespp:bytespp));
         if (!out.good()) {
             std::cerr << "can't dump the tga file\n";
             return false;
@@ -245,17 +366,21 @@ bool TGAImage::unload_rle_data(std::ofstream &out) {
     return true;
 }
 
-TGAColor TGAImage::get(int x, int y) {
+TGAColor TGAImage::get(int x, int y) const {
     if (!data || x<0 || y<0 || x>=width || y>=height) {
         return TGAColor();
     }
-    return TGAColor(data+(x+y*width)*bytespp, bytespp);
+    return TGAColor(pixel(x, y), bytespp);
 }
 
 bool TGAImage::set(int x, int y, TGAColor &c) {
     if (!data || x<0 || y<0 || x>=width || y>=height) {
         return false;
     }
+    if (flipped) y = height-1-y;
+    if (pending_clear && tile_cleared[(unsigned)x/CLEAR_TILE + (unsigned)y/CLEAR_TILE*tiles_x]) {
+        fill_tile(x/CLEAR_TILE, y/CLEAR_TILE);
+    }
     memcpy(data+(x+y*width)*bytespp, c.bgra, bytespp);
     return true;
 }
@@ -264,19 +389,23 @@ bool TGAImage::set(int x, int y, const TGAColor &c) {
     if (!data || x<0 || y<0 || x>=width || y>=height) {
         return false;
     }
+    if (flipped) y = height-1-y;
+    if (pending_clear && tile_cleared[(unsigned)x/CLEAR_TILE + (unsigned)y/CLEAR_TILE*tiles_x]) {
+        fill_tile(x/CLEAR_TILE, y/CLEAR_TILE);
+    }
     memcpy(data+(x+y*width)*bytespp, c.bgra, bytespp);
     return true;
 }
 
-int TGAImage::get_bytespp() {
+int TGAImage::get_bytespp() const {
     return bytespp;
 }
 
-int TGAImage::get_width() {
+int TGAImage::get_width() const {
     return width;
 }
 
-int TGAImage::get_height() {
+int TGAImage::get_height() const {
     return height;
 }
 
@@ -296,30 +425,135 @@ bool TGAImage::flip_horizontally() {
 
 bool TGAImage::flip_vertically() {
     if (!data) return false;
+    // 映射的文件不移动数据，只改行的寻址方向
+    if (mapping) {
+        flipped = !flipped;
+        return true;
+    }
+    // 高度是 tile 边长的倍数时翻转后 tile 还是对齐的：清除过的 tile 不用动，只交换标记
+    if (pending_clear && height%CLEAR_TILE==0) {
+        flip_tiles();
+        return true;
+    }
+    // 否则行交换以后 tile 就对不齐了，先填满
+    resolve(0, 0, width-1, height-1);
     unsigned long bytes_per_line = width*bytespp;
-    unsigned char *line = new unsigned char[bytes_per_line];
     int half = height>>1;
+    // 两行直接原地交换，不需要临时的行缓冲
     for (int j=0; j<half; j++) {
         unsigned long l1 = j*bytes_per_line;
         unsigned long l2 = (height-1-j)*bytes_per_line;
-        memmove((void *)line,      (void *)(data+l1), bytes_per_line);
-        memmove((void *)(data+l1), (void *)(data+l2), bytes_per_line);
-        memmove((void *)(data+l2), (void *)line,      bytes_per_line);
+        std::swap_ranges(data+l1, data+l1+bytes_per_line, data+l2);
     }
-    delete [] line;
     return true;
 }
 
+// 第 ty 行 tile 和第 tiles_y-1-ty 行 tile 互换：两边都画过的段交换，只有一边画过的复制到另一边，都没画过的不动
+void TGAImage::flip_tiles() {
+    const int tiles_y = height/CLEAR_TILE;
+    for (int j=0; j<height>>1; j++) {
+        const int j2 = height-1-j;
+        const unsigned char *f1 = &tile_cleared[(j/CLEAR_TILE)*tiles_x], *f2 = &tile_cleared[(j2/CLEAR_TILE)*tiles_x];
+        for (int tx=0; tx<tiles_x; tx++) {
+            const unsigned long x0 = tx*CLEAR_TILE, n = (std::min(width, (tx+1)*CLEAR_TILE)-x0)*bytespp;
+            unsigned char *p1 = data+(x0+j*(unsigned long)width)*bytespp, *p2 = data+(x0+j2*(unsigned long)width)*bytespp;
+            if (!f1[tx] && !f2[tx]) std::swap_ranges(p1, p1+n, p2);
+            else if (!f1[tx]) memcpy(p2, p1, n);
+            else if (!f2[tx]) memcpy(p1, p2, n);
+        }
+    }
+    for (int ty=0; ty<tiles_y>>1; ty++) {
+        std::swap_ranges(tile_cleared.begin()+ty*tiles_x, tile_cleared.begin()+(ty+1)*tiles_x, tile_cleared.begin()+(tiles_y-1-ty)*tiles_x);
+    }
+}
+
 unsigned char *TGAImage::buffer() {
+    resolve(0, 0, width-1, height-1);
     return data;
 }
 
+const unsigned char *TGAImage::buffer() const {
+    resolve(0, 0, width-1, height-1);
+    return data;
+}
+
+unsigned char *TGAImage::buffer(const int x0, const int y0, const int x1, const int y1) {
+    resolve(x0, y0, x1, y1);
+    return data;
+}
+
+const unsigned char *TGAImage::pixel(const int x, int y) const {
+    if (flipped) y = height-1-y;
+    if (pending_clear && tile_cleared[(unsigned)x/CLEAR_TILE + (unsigned)y/CLEAR_TILE*tiles_x]) {
+        return clear_color;
+    }
+    return data+(x+y*width)*bytespp;
+}
+
 void TGAImage::clear() {
-    memset((void *)data, 0, width*height*bytespp);
+    clear(TGAColor());
+}
+
+void TGAImage::clear(const TGAColor &c) {
+    if (!data) return;
+    memcpy(clear_color, c.bgra, sizeof(clear_color));
+    tiles_x = (width+CLEAR_TILE-1)/CLEAR_TILE;
+    tile_cleared.assign((size_t)tiles_x*((height+CLEAR_TILE-1)/CLEAR_TILE), 1);
+    pending_clear = true;
+}
+
+// 用 clear_color 填满一个 tile：先填第一行，其余的行从第一行复制
+void TGAImage::fill_tile(const int tx, const int ty) const {
+    const int x0 = tx*CLEAR_TILE, x1 = std::min(width, x0+CLEAR_TILE);
+    const int y0 = ty*CLEAR_TILE, y1 = std::min(height, y0+CLEAR_TILE);
+    const int nbytes = (x1-x0)*bytespp;
+    unsigned char *first = data+(x0+y0*width)*bytespp;
+    if (bytespp==GRAYSCALE) {
+        memset(first, clear_color[0], nbytes);
+    } else {
+        for (int i=0; i<nbytes; i+=bytespp) memcpy(first+i, clear_color, bytespp);
+    }
+    for (int y=y0+1; y<y1; y++) {
+        memcpy(data+(x0+y*width)*bytespp, first, nbytes);
+    }
+    tile_cleared[tx + ty*tiles_x] = 0;
+}
+
+// 填满和 [x0, x1] x [y0, y1] 相交的 tile，覆盖整张图片时清掉 pending_clear
+void TGAImage::resolve(const int x0, const int y0, const int x1, const int y1) const {
+    if (!pending_clear) return;
+    const int tx0 = std::max(0, x0/CLEAR_TILE), tx1 = std::min(tiles_x-1, x1/CLEAR_TILE);
+    const int ty0 = std::max(0, y0/CLEAR_TILE), ty1 = std::min((height-1)/CLEAR_TILE, y1/CLEAR_TILE);
+    for (int ty=ty0; ty<=ty1; ty++) {
+        for (int tx=tx0; tx<=tx1; tx++) {
+            if (tile_cleared[tx + ty*tiles_x]) fill_tile(tx, ty);
+        }
+    }
+    if (x0<=0 && y0<=0 && x1>=width-1 && y1>=height-1) {
+        pending_clear = false;
+    }
+}
+
+// 内存里的第 y 行复制到 out，快速清除过的 tile 直接写 clear_color
+void TGAImage::read_row(const int y, unsigned char *out) const {
+    const unsigned char *row = data+(size_t)y*width*bytespp;
+    if (!pending_clear) {
+        memcpy(out, row, width*bytespp);
+        return;
+    }
+    for (int tx=0; tx<tiles_x; tx++) {
+        const int x0 = tx*CLEAR_TILE, n = std::min((int)CLEAR_TILE, width-x0);
+        if (tile_cleared[tx + (y/CLEAR_TILE)*tiles_x]) {
+            for (int i=0; i<n; i++) memcpy(out+(x0+i)*bytespp, clear_color, bytespp);
+        } else {
+            memcpy(out+x0*bytespp, row+x0*bytespp, n*bytespp);
+        }
+    }
 }
 
 bool TGAImage::scale(int w, int h) {
     if (w<=0 || h<=0 || !data) return false;
+    resolve(0, 0, width-1, height-1);
     unsigned char *tdata = new unsigned char[w*h*bytespp];
     int nscanline = 0;
     int oscanline = 0;
@@ -348,8 +582,11 @@ bool TGAImage::scale(int w, int h) {
             nscanline += nlinebytes;
         }
     }
-    delete [] data;
+    // 缩放只按内存里的行顺序处理，行的方向保持不变
+    const bool rows_flipped = flipped;
+    release();
     data = tdata;
+    flipped = rows_flipped;
     width = w;
     height = h;
     return true;
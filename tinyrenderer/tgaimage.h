@@ -2,6 +2,7 @@
 #define __IMAGE_H__
 
 #include <fstream>
+#include <vector>
 
 #pragma pack(push,1)
 struct TGA_Header {
@@ -69,32 +70,64 @@ protected:
     int width;
     int height;
     int bytespp;
+    void *mapping;        // map_tga_file 映射的整个文件，为 NULL 时 data 是 new 出来的
+    size_t mapping_bytes;
+    bool flipped;         // 行在内存里是倒序存放的：第 y 行在 data 的第 height-1-y 行
+    // 快速清除：clear() 只把每个 CLEAR_TILE x CLEAR_TILE 的 tile 标记成“值为 clear_color”，不写内存
+    // 标记过的 tile 读的时候直接返回 clear_color，第一次写的时候才填满；tile 按内存里的行划分
+    mutable std::vector<unsigned char> tile_cleared;
+    mutable bool pending_clear; // 还有标记着的 tile
+    unsigned char clear_color[4];
+    int tiles_x;
 
     bool   load_rle_data(std::ifstream &in);
-    bool unload_rle_data(std::ofstream &out);
+    bool unload_rle_data(std::ostream &out);
+    void release();
+    void fill_tile(const int tx, const int ty) const;
+    void flip_tiles();
+    void resolve(const int x0, const int y0, const int x1, const int y1) const;
+    void read_row(const int y, unsigned char *out) const;
+    const unsigned char *pixel_at(const unsigned long idx) const;
 public:
     enum Format {
         GRAYSCALE=1, RGB=3, RGBA=4
     };
+    // 快速清除的 tile 边长，和光栅化的条带高度（RASTER_BAND_ROWS）一样，每个 tile 只会被一个光栅线程写
+    enum { CLEAR_TILE=16 };
 
     TGAImage();
     TGAImage(int w, int h, int bpp);
     TGAImage(const TGAImage &img);
     bool read_tga_file(const char *filename);
+    // 把不压缩的 TGA 文件直接映射到内存，不读取也不解码，结果和 read_tga_file 一样
+    // 映射是写时复制的，没改过的页在进程之间共享；图片的原点方向和 flip_vertically 只改行的寻址方式，不移动数据
+    // 文件是 RLE 压缩的或者有水平翻转标记时返回 false，不输出错误，调用者可以改用 read_tga_file
+    bool map_tga_file(const char *filename);
+    bool is_mapped() const;
     bool write_tga_file(const char *filename, bool rle=true);
+    bool write_tga(std::ostream &out, bool rle=true);
     bool flip_horizontally();
     bool flip_vertically();
     bool scale(int w, int h);
-    TGAColor get(int x, int y);
+    TGAColor get(int x, int y) const;
     bool set(int x, int y, TGAColor &c);
     bool set(int x, int y, const TGAColor &c);
     ~TGAImage();
     TGAImage & operator =(const TGAImage &img);
-    int get_width();
-    int get_height();
-    int get_bytespp();
+    int get_width() const;
+    int get_height() const;
+    int get_bytespp() const;
+    // 按内存里的行顺序排列的像素；只有映射的文件才可能是倒序的（见 flipped）
+    // 会先把快速清除过的 tile 都填满，多个线程同时读之前要先在一个线程里调用一次
     unsigned char *buffer();
+    const unsigned char *buffer() const;
+    // 只填满覆盖 [x0, x1] x [y0, y1] 的 tile，调用者只能访问这个范围里的像素（内存里的行坐标）
+    unsigned char *buffer(const int x0, const int y0, const int x1, const int y1);
+    // 第 (x, y) 个像素的地址，不检查范围；快速清除过的 tile 返回 clear 值的地址，不读 tile 的内存，也不会修改图片
+    const unsigned char *pixel(const int x, const int y) const;
+    // 快速清除，图片创建时也是这样清零的
     void clear();
+    void clear(const TGAColor &c);
 };
 
 #endif //__IMAGE_H__
@@ -0,0 +1,146 @@
+//
+//  wireframe.cpp
+//  tinyrenderer
+//
+//  Created by skychx on 2021/4/5.
+//
+
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <cmath>
+#include "wireframe.h"
+#include "our_gl.h"
+#include "arena.h"
+
+extern thread_local mat<4,4> ModelView;
+extern thread_local mat<4,4> Projection;
+extern thread_local mat<4,4> Viewport;
+
+std::vector<Edge> mesh_edges(Model &model) {
+    const int nfaces = model.nfaces();
+    std::vector<Edge> edges;
+    edges.reserve(nfaces * 3);
+    for (int i = 0; i < nfaces; i++) {
+        for (int j = 0; j < 3; j++) {
+            int a = model.vert_index(i, j), b = model.vert_index(i, (j + 1) % 3);
+            if (a == b) continue;
+            Edge e = {std::min(a, b), std::max(a, b)};
+            edges.push_back(e);
+        }
+    }
+    std::sort(edges.begin(), edges.end(), [](const Edge &a, const Edge &b) { return a.v0 < b.v0 || (a.v0 == b.v0 && a.v1 < b.v1); });
+    edges.erase(std::unique(edges.begin(), edges.end(), [](const Edge &a, const Edge &b) { return a.v0 == b.v0 && a.v1 == b.v1; }), edges.end());
+    return edges;
+}
+
+// 裁剪后可以直接画的线段，屏幕坐标（已经除过 w），z 是 [0, 255] 的深度
+struct ScreenLine {
+    double x0, y0, z0, x1, y1, z1;
+    int ymin, ymax; // 覆盖的屏幕行
+};
+
+// 齐次坐标下裁掉相机后面的部分（w 很小时除法会爆掉），再把线段裁剪到 [0, width-1] x [0, height-1]（Liang-Barsky）
+static bool clip_line(vec4 p0, vec4 p1, const int width, const int height, ScreenLine &line) {
+    const double eps = 1e-6;
+    if (p0[3] < eps && p1[3] < eps) return false;
+    if (p0[3] < eps || p1[3] < eps) {
+        const double t = (eps - p0[3]) / (p1[3] - p0[3]);
+        vec4 p = p0 + (p1 - p0) * t;
+        (p0[3] < eps ? p0 : p1) = p;
+    }
+    double x0 = p0[0] / p0[3], y0 = p0[1] / p0[3], z0 = p0[2] / p0[3];
+    double x1 = p1[0] / p1[3], y1 = p1[1] / p1[3], z1 = p1[2] / p1[3];
+
+    double t0 = 0, t1 = 1;
+    const double dx = x1 - x0, dy = y1 - y0;
+    const double p[4] = {-dx, dx, -dy, dy};
+    const double q[4] = {x0, width - 1 - x0, y0, height - 1 - y0};
+    for (int k = 0; k < 4; k++) {
+        if (p[k] == 0) {
+            if (q[k] < 0) return false;
+            continue;
+        }
+        const double r = q[k] / p[k];
+        if (p[k] < 0) t0 = std::max(t0, r);
+        else          t1 = std::min(t1, r);
+    }
+    if (t0 > t1) return false;
+
+    // 屏幕空间里 z/w 沿线段是线性的
+    const double dz = z1 - z0;
+    line.x0 = x0 + dx * t0; line.y0 = y0 + dy * t0; line.z0 = z0 + dz * t0;
+    line.x1 = x0 + dx * t1; line.y1 = y0 + dy * t1; line.z1 = z0 + dz * t1;
+    line.ymin = (int)(std::min(line.y0, line.y1) + .5);
+    line.ymax = (int)(std::max(line.y0, line.y1) + .5);
+    return true;
+}
+
+// DDA：沿主方向每步一个像素，只写条带 index 上的行
+// data / zdata 是在启动线程之前取好的 buffer()，线程里不能再调用 buffer()（它会去填快速清除的 tile）
+static unsigned long raster_line(const ScreenLine &l, unsigned char *data, const unsigned char *zdata, const int width, const int bpp,
+                                 const TGAColor &color, const int bias, const int index, const int count) {
+    const double dx = l.x1 - l.x0, dy = l.y1 - l.y0;
+    const int n = std::max(1, (int)std::ceil(std::max(std::abs(dx), std::abs(dy))));
+    const double sx = dx / n, sy = dy / n, sz = (l.z1 - l.z0) / n;
+    double x = l.x0, y = l.y0, z = l.z0;
+    unsigned long written = 0;
+    for (int i = 0; i <= n; i++, x += sx, y += sy, z += sz) {
+        const int py = (int)(y + .5);
+        if (count > 1 && (py / RASTER_BAND_ROWS) % count != index) continue;
+        const int px = (int)(x + .5);
+        const size_t idx = px + (size_t)py * width;
+        if (zdata && (int)(z + .5) + bias < zdata[idx]) continue;
+        for (int b = 0; b < bpp; b++) data[idx * bpp + b] = color.bgra[b];
+        written++;
+    }
+    return written;
+}
+
+WireframeStats draw_wireframe(Model &model, const std::vector<Edge> &edges, TGAImage &image, const TGAImage *zbuffer,
+                              const TGAColor color, const int bias, int threads) {
+    WireframeStats stats = WireframeStats();
+    const int width = image.get_width(), height = image.get_height();
+    FrameArena &arena = frame_arena();
+    ArenaScope scope(arena);
+
+    // 每个顶点只变换一次
+    const mat<4,4> M = Viewport * Projection * ModelView;
+    const int nverts = model.nverts();
+    vec4 *clip = arena.allocate<vec4>(nverts);
+    for (int i = 0; i < nverts; i++) {
+        clip[i] = M * embed<4>(model.vert(i));
+    }
+    ScreenLine *lines = arena.allocate<ScreenLine>(edges.size());
+    int nlines = 0;
+    for (size_t k = 0; k < edges.size(); k++) {
+        if (clip_line(clip[edges[k].v0], clip[edges[k].v1], width, height, lines[nlines])) nlines++;
+    }
+    stats.edges = edges.size();
+    stats.clipped = edges.size() - nlines;
+
+    if (threads <= 0) threads = std::max(1, (int)std::thread::hardware_concurrency());
+    const int bands = (height + RASTER_BAND_ROWS - 1) / RASTER_BAND_ROWS;
+    threads = std::min(threads, bands);
+    std::atomic<unsigned long> pixels(0);
+    unsigned char *data = image.buffer();
+    const unsigned char *zdata = zbuffer ? zbuffer->buffer() : NULL;
+    const int bpp = image.get_bytespp();
+    auto worker = [&](const int index) {
+        unsigned long n = 0;
+        for (int k = 0; k < nlines; k++) {
+            if (threads > 1 && !band_overlaps(lines[k].ymin, lines[k].ymax, index, threads)) continue;
+            n += raster_line(lines[k], data, zdata, width, bpp, color, bias, index, threads);
+        }
+        pixels += n;
+    };
+    if (threads == 1) {
+        worker(0);
+    } else {
+        std::vector<std::thread> pool;
+        for (int i = 0; i < threads; i++) pool.push_back(std::thread(worker, i));
+        for (int i = 0; i < threads; i++) pool[i].join();
+    }
+    stats.pixels = pixels;
+    return stats;
+}
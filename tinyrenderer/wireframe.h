@@ -0,0 +1,36 @@
+//
+//  wireframe.h
+//  tinyrenderer
+//
+//  Created by skychx on 2021/4/5.
+//
+
+#ifndef __WIREFRAME_H__
+#define __WIREFRAME_H__
+
+#include <vector>
+#include "model.h"
+#include "tgaimage.h"
+
+// 网格的一条边，v0 < v1 是顶点下标
+struct Edge {
+    int v0, v1;
+};
+
+// 当前 LOD 所有三角形的边，相邻三角形共享的边只出现一次；结果只和网格有关，可以跨帧复用
+std::vector<Edge> mesh_edges(Model &model);
+
+struct WireframeStats {
+    unsigned long edges;   // 提交的边数
+    unsigned long clipped; // 完全在视口外（或相机后面）的边数
+    unsigned long pixels;  // 通过深度测试写进 image 的像素数（按线程累加）
+};
+
+// 用当前的 ModelView / Projection / Viewport 批量画线框：顶点只变换一次，边先裁剪到相机前面和视口里，
+// 再和 zbuffer 做深度测试（depth + bias >= zbuffer 才通过，这样叠在着色后的模型上不会被自己的面挡住），不写 zbuffer
+// zbuffer 为 NULL 时不做深度测试；屏幕按 RASTER_BAND_ROWS 行的条带交错分给 threads 个线程（0 表示按 CPU 核数），
+// 每个像素只由一个线程写，结果和单线程一样
+WireframeStats draw_wireframe(Model &model, const std::vector<Edge> &edges, TGAImage &image, const TGAImage *zbuffer,
+                              const TGAColor color, const int bias=2, int threads=0);
+
+#endif //__WIREFRAME_H__